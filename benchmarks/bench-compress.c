@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Throughput of the compressed fastboot upload path, to find the link speed
+ * above which compressing the image no longer shortens the upload.
+ *
+ * The images given on the command line, or a synthetic boot image, are run
+ * through compress_stream() in FASTBOOT_ZBUF_SIZE chunks, as the client does,
+ * and back through decompress_stream(), as the server does. As the two ends
+ * are pipelined with the transfer, a compressed upload takes as long as the
+ * slowest of compression, transfer of the compressed image and decompression,
+ * while an uncompressed upload takes as long as the transfer of the image.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdba.h"
+#include "compress.h"
+
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+
+#define ZBUF_SIZE	(1024 * 1024)
+#define SYNTH_SIZE	(48 * 1024 * 1024)
+
+/* Skipped test, as understood by meson */
+#define EXIT_SKIP	77
+
+static const unsigned int link_mbps[] = { 10, 100, 1000, 10000 };
+
+static size_t decompressed;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t rand_next(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+/*
+ * Resemble a boot image: a kernel, which compresses moderately well, an
+ * already compressed ramdisk and the zero padding between the parts.
+ */
+static uint8_t *synth_image(size_t size)
+{
+	static const char * const words[] = {
+		"mov", "ldr", "str", "bl", "ret", "add", "sub", "cmp", "b.ne",
+		"x0", "x1", "x19", "sp", "#0x10", "[x0]", "init", "probe", "dev",
+	};
+	uint32_t state = 0x2545f491;
+	size_t kernel = size / 2;
+	size_t ramdisk = size * 3 / 8;
+	uint8_t *image;
+	size_t off = 0;
+	size_t len;
+	uint32_t r;
+
+	image = calloc(1, size);
+	if (!image)
+		err(1, "failed to allocate image");
+
+	while (off < kernel) {
+		r = rand_next(&state);
+		if (r & 1) {
+			/* Short runs of repeated structure */
+			len = strlen(words[r % ARRAY_SIZE(words)]);
+			len = MIN(len, kernel - off);
+			memcpy(image + off, words[r % ARRAY_SIZE(words)], len);
+		} else {
+			/* Instruction encodings with a few random bits */
+			len = MIN(4, kernel - off);
+			memcpy(image + off, (uint8_t[]){ r >> 8, r >> 16 & 0x1f, 0x40, 0xf9 }, len);
+		}
+		off += len;
+	}
+
+	/* Leave a gap of padding, then the ramdisk */
+	for (off = size - ramdisk; off < size; off += sizeof(r)) {
+		r = rand_next(&state);
+		memcpy(image + off, &r, MIN(sizeof(r), size - off));
+	}
+
+	return image;
+}
+
+static void decompress_out(const void *data, size_t len)
+{
+	decompressed += len;
+}
+
+static void bench(const char *name, const uint8_t *image, size_t size)
+{
+	struct decompressor *d;
+	struct compressor *c;
+	uint8_t *zimage;
+	size_t zsize = 0;
+	size_t zcap;
+	size_t consumed;
+	size_t offset = 0;
+	double t_compress;
+	double t_decompress;
+	double crossover;
+	double t_raw;
+	double t_z;
+	bool done = false;
+	double t;
+	size_t n;
+	int i;
+
+	/* Incompressible data grows a little */
+	zcap = size + size / 64 + ZBUF_SIZE;
+	zimage = malloc(zcap);
+	if (!zimage)
+		err(1, "failed to allocate compressed image");
+
+	c = compress_init(FASTBOOT_CODEC_ZSTD);
+	t = now();
+	while (!done) {
+		if (zsize == zcap)
+			errx(1, "%s: compressed image too large", name);
+
+		n = compress_stream(c, image + offset, size - offset, &consumed,
+				    zimage + zsize, MIN(ZBUF_SIZE, zcap - zsize), &done);
+		offset += consumed;
+		zsize += n;
+	}
+	t_compress = now() - t;
+	compress_free(c);
+
+	decompressed = 0;
+	d = decompress_init(FASTBOOT_CODEC_ZSTD);
+	t = now();
+	for (offset = 0; offset < zsize; offset += n) {
+		/* Chunks of the size of a maximal protocol version 2 message */
+		n = MIN(zsize - offset, MSG_V2_MAX_LEN);
+		if (decompress_stream(d, zimage + offset, n, decompress_out) < 0)
+			errx(1, "%s: failed to decompress", name);
+	}
+	t_decompress = now() - t;
+	if (!decompress_complete(d) || decompressed != size)
+		errx(1, "%s: decompressed image doesn't match", name);
+	decompress_free(d);
+
+	printf("%s: %zu bytes, compressed to %zu (%.1f%%)\n", name, size, zsize,
+	       100.0 * zsize / size);
+	printf("  compress   %8.1f MB/s\n", size / t_compress / 1e6);
+	printf("  decompress %8.1f MB/s\n", size / t_decompress / 1e6);
+
+	for (i = 0; i < ARRAY_SIZE(link_mbps); i++) {
+		t_raw = size * 8.0 / (link_mbps[i] * 1e6);
+		t_z = zsize * 8.0 / (link_mbps[i] * 1e6);
+		t_z = MAX(t_z, MAX(t_compress, t_decompress));
+
+		printf("  %5u Mbit/s: %7.3f s uncompressed, %7.3f s compressed\n",
+		       link_mbps[i], t_raw, t_z);
+	}
+
+	/* The link speed where the image is transferred as fast as it's compressed */
+	crossover = size * 8.0 / MAX(t_compress, t_decompress) / 1e6;
+	printf("  compression pays off below %.0f Mbit/s\n", crossover);
+
+	free(zimage);
+}
+
+int main(int argc, char **argv)
+{
+	struct stat sb;
+	void *image;
+	int fd;
+	int i;
+
+	if (!compress_supported(FASTBOOT_CODEC_ZSTD)) {
+		fprintf(stderr, "built without zstd support\n");
+		return EXIT_SKIP;
+	}
+
+	if (argc < 2) {
+		image = synth_image(SYNTH_SIZE);
+		bench("synthetic boot image", image, SYNTH_SIZE);
+		free(image);
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++) {
+		fd = open(argv[i], O_RDONLY);
+		if (fd < 0 || fstat(fd, &sb) < 0)
+			err(1, "failed to open %s", argv[i]);
+
+		if (!sb.st_size)
+			errx(1, "%s is empty", argv[i]);
+
+		image = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image == MAP_FAILED)
+			err(1, "failed to map %s", argv[i]);
+		close(fd);
+
+		bench(argv[i], image, sb.st_size);
+		munmap(image, sb.st_size);
+	}
+
+	return 0;
+}
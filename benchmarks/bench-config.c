@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Cost of loading the board configuration of a large farm, generated with the
+ * given number of boards, 10000 by default. Loading is timed in a fresh
+ * process, as a session started by ssh would, both with a cold cache, where
+ * the YAML is parsed and compiled, and with a warm one, where the compiled
+ * cache is mapped, followed by listing the boards available to a user. The
+ * cost of looking up a board and checking a user's access to it, and of
+ * parsing the selected board, is reported as well.
+ */
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdba-server.h"
+#include "config_cache.h"
+#include "device.h"
+
+#define CONFIG_PATH	".cdba"
+#define CACHE_PATH	".cdba.cache"
+#define ROUNDS		5
+#define USERS		4
+#define CLASSES		16
+#define LABS		8
+
+struct timings {
+	double load;
+	double list;
+	double lookup;
+	double parse;
+};
+
+static unsigned int board_count = 10000;
+static unsigned int listed;
+
+/* The session's messages go nowhere, list entries are only counted */
+void cdba_send_buf(int type, size_t len, const void *buf)
+{
+	if (type == MSG_LIST_DEVICES && len)
+		listed++;
+}
+
+size_t cdba_credit(int channel)
+{
+	return 0;
+}
+
+void cdba_credit_wait(int channel, void (*resume)(void *), void *data)
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void generate(void)
+{
+	unsigned int i;
+	unsigned int j;
+	FILE *fh;
+
+	fh = fopen(CONFIG_PATH, "w");
+	if (!fh)
+		err(1, "failed to create %s", CONFIG_PATH);
+
+	fprintf(fh, "devices:\n");
+	for (i = 0; i < board_count; i++) {
+		fprintf(fh, "  - board: board%05u\n", i);
+		fprintf(fh, "    name: \"Board %u\"\n", i);
+		fprintf(fh, "    description: Synthetic board %u of the farm\n", i);
+		fprintf(fh, "    class: soc%u\n", i % CLASSES);
+		fprintf(fh, "    tags:\n");
+		fprintf(fh, "      - lab%u\n", i % LABS);
+		fprintf(fh, "      - rack%u\n", i / 40);
+		fprintf(fh, "    users:\n");
+		for (j = 0; j < USERS; j++)
+			fprintf(fh, "      - user%u\n", (i + j * 7) % 100);
+		fprintf(fh, "    alpaca: /dev/serial/by-path/alpaca%05u\n", i);
+		fprintf(fh, "    console: /dev/serial/by-path/console%05u\n", i);
+		fprintf(fh, "    console_baud: 115200\n");
+		fprintf(fh, "    fastboot: %08x\n", 0x10000000 + i);
+		fprintf(fh, "    fastboot_key_timeout: 2\n");
+		fprintf(fh, "\n");
+	}
+
+	if (fclose(fh))
+		err(1, "failed to write %s", CONFIG_PATH);
+}
+
+static double load(void)
+{
+	double t;
+
+	t = now();
+	if (config_cache_load(CONFIG_PATH) < 0)
+		errx(1, "failed to load %s", CONFIG_PATH);
+
+	return now() - t;
+}
+
+static double list(void)
+{
+	double t;
+
+	t = now();
+	device_list_devices("user1");
+	t = now() - t;
+
+	if (!listed)
+		errx(1, "no boards listed");
+
+	return t;
+}
+
+/* Look up every board and check a user's access to it, as sessions do */
+static double lookup(void)
+{
+	const struct config_cache_board *entry;
+	char board[32];
+	char user[32];
+	unsigned int granted = 0;
+	unsigned int i;
+	double t;
+
+	t = now();
+	for (i = 0; i < board_count; i++) {
+		snprintf(board, sizeof(board), "board%05u", i);
+		snprintf(user, sizeof(user), "user%u", i % 100);
+
+		entry = config_cache_find(board, strlen(board));
+		if (!entry)
+			errx(1, "%s not found", board);
+
+		if (config_cache_access(entry, user))
+			granted++;
+	}
+	t = now() - t;
+
+	if (!granted)
+		errx(1, "no access granted");
+
+	return t / board_count;
+}
+
+/* Parse the selected board, as device_open() does on a mapped cache */
+static double parse(void)
+{
+	const struct config_cache_board *entry;
+	double t;
+
+	entry = config_cache_find("board00042", 10);
+	if (!entry)
+		errx(1, "board00042 not found");
+
+	t = now();
+	if (!config_cache_parse(entry))
+		errx(1, "failed to parse board00042");
+
+	return now() - t;
+}
+
+/* Run a round in a fresh process, returning its timings through a pipe */
+static void run(bool cold, struct timings *timings)
+{
+	struct timings result;
+	ssize_t n;
+	pid_t pid;
+	int status;
+	int fds[2];
+
+	if (cold)
+		unlink(CACHE_PATH);
+
+	if (pipe(fds) < 0)
+		err(1, "failed to create pipe");
+
+	pid = fork();
+	if (pid < 0)
+		err(1, "failed to fork");
+
+	if (pid == 0) {
+		close(fds[0]);
+
+		result.load = load();
+		result.list = list();
+		result.lookup = lookup();
+		result.parse = parse();
+
+		write(fds[1], &result, sizeof(result));
+		_exit(0);
+	}
+
+	close(fds[1]);
+	n = read(fds[0], &result, sizeof(result));
+	close(fds[0]);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) || n != sizeof(result))
+		errx(1, "benchmark round failed");
+
+	timings->load += result.load / ROUNDS;
+	timings->list += result.list / ROUNDS;
+	timings->lookup += result.lookup / ROUNDS;
+	timings->parse += result.parse / ROUNDS;
+}
+
+int main(int argc, char **argv)
+{
+	char dir[] = "/tmp/cdba-bench-XXXXXX";
+	struct timings cold = {};
+	struct timings warm = {};
+	struct stat st_config;
+	struct stat st_cache;
+	int i;
+
+	if (argc > 1)
+		board_count = strtoul(argv[1], NULL, 10);
+	if (!board_count)
+		errx(1, "usage: %s [boards]", argv[0]);
+
+	if (!mkdtemp(dir))
+		err(1, "failed to create %s", dir);
+	if (chdir(dir) < 0)
+		err(1, "failed to enter %s", dir);
+
+	generate();
+
+	for (i = 0; i < ROUNDS; i++)
+		run(true, &cold);
+
+	if (stat(CONFIG_PATH, &st_config) < 0 || stat(CACHE_PATH, &st_cache) < 0)
+		errx(1, "configuration cache not written");
+
+	for (i = 0; i < ROUNDS; i++)
+		run(false, &warm);
+
+	printf("boards:          %u\n", board_count);
+	printf("yaml size:       %.1f MiB\n", st_config.st_size / 1048576.0);
+	printf("cache size:      %.1f MiB\n", st_cache.st_size / 1048576.0);
+	printf("cold load:       %.1f ms\n", cold.load * 1e3);
+	printf("warm load:       %.3f ms\n", warm.load * 1e3);
+	printf("list boards:     %.1f ms\n", warm.list * 1e3);
+	printf("lookup + access: %.0f ns\n", warm.lookup * 1e9);
+	printf("parse one board: %.1f us\n", warm.parse * 1e6);
+
+	unlink(CACHE_PATH);
+	unlink(CONFIG_PATH);
+	rmdir(dir);
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Cost of the watch timers, with thousands of timers pending. For each number
+ * of pending timers the average cost of scheduling, of cancelling and
+ * rescheduling a random timer, of cancelling and of expiring a timer is
+ * reported, which should grow no more than logarithmically with the number of
+ * timers.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "watch.h"
+
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+
+/* Far enough ahead not to expire while the benchmark runs */
+#define TIMEOUT_MS	(1000 * 1000)
+#define CHURN_OPS	100000
+
+static const int pending_counts[] = { 1000, 10000, 100000 };
+
+static int expired;
+static int expire_count;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void timer_cb(void *data)
+{
+	expired++;
+}
+
+static bool timers_expired(void)
+{
+	return expired == expire_count;
+}
+
+static int random_timeout(void)
+{
+	return TIMEOUT_MS + rand() % TIMEOUT_MS;
+}
+
+static void bench(int count)
+{
+	struct watch_timer **timers;
+	double t_schedule;
+	double t_churn;
+	double t_cancel;
+	double t_expire;
+	double t;
+	int ret;
+	int i;
+	int j;
+
+	timers = calloc(count, sizeof(*timers));
+	if (!timers) {
+		fprintf(stderr, "failed to allocate timers\n");
+		exit(1);
+	}
+
+	t = now();
+	for (i = 0; i < count; i++)
+		timers[i] = watch_timer_add(random_timeout(), timer_cb, NULL);
+	t_schedule = now() - t;
+
+	/* Steady state, as when timeouts are pushed out by activity */
+	t = now();
+	for (i = 0; i < CHURN_OPS; i++) {
+		j = rand() % count;
+		watch_timer_cancel(timers[j]);
+		timers[j] = watch_timer_add(random_timeout(), timer_cb, NULL);
+	}
+	t_churn = now() - t;
+
+	t = now();
+	for (i = 0; i < count; i++)
+		watch_timer_cancel(timers[i]);
+	t_cancel = now() - t;
+
+	/* Expire them all through the main loop */
+	expired = 0;
+	expire_count = count;
+	for (i = 0; i < count; i++)
+		watch_timer_add(0, timer_cb, NULL);
+
+	t = now();
+	ret = watch_main_loop(timers_expired);
+	t_expire = now() - t;
+	if (ret < 0 || expired != count) {
+		fprintf(stderr, "expired %d of %d timers\n", expired, count);
+		exit(1);
+	}
+
+	printf("%8d %12.0f %12.0f %12.0f %12.0f\n", count,
+	       t_schedule / count * 1e9, t_churn / CHURN_OPS * 1e9,
+	       t_cancel / count * 1e9, t_expire / count * 1e9);
+
+	free(timers);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	srand(1);
+
+	printf("%8s %12s %12s %12s %12s\n", "pending", "schedule ns",
+	       "resched ns", "cancel ns", "expire ns");
+
+	for (i = 0; i < ARRAY_SIZE(pending_counts); i++)
+		bench(pending_counts[i]);
+
+	return 0;
+}
@@ -0,0 +1,627 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Boards are locked using flock() on /tmp/cdba-<board>.lock, held by the
+ * session using the board until it exits. Sessions waiting for a board queue
+ * up in /tmp/cdba-<board>.queue, each holding a lock on a ticket file named
+ * by its number in the queue, so that tickets of dead sessions can be told
+ * apart and removed. The first session in the queue takes the board as it's
+ * released, which it learns of from inotify, as the others learn of their
+ * position in the queue changing.
+ *
+ * The duration of recent sessions is tracked, for waiting users to be given
+ * an estimate of their wait.
+ *
+ * Sessions asking for any board of a pool queue up the same way, in
+ * /tmp/cdba-<pool>.pool, and the first in line takes the first board of the
+ * pool that is released and not waited for by sessions asking for it by name.
+ *
+ * The time the board was last powered off is kept in the queue directory as
+ * well, until it's powered on again, so that a session doesn't have to wait
+ * for a board to settle if it's been off since the previous session. The
+ * time is taken from the monotonic clock, so it's recorded along with the
+ * boot id and ignored after the host is rebooted.
+ */
+#define _GNU_SOURCE /* for POLLRDHUP */
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "board_lock.h"
+
+/* Fall back to polling every few seconds if inotify isn't available */
+#define BOARD_LOCK_POLL_MS	3000
+
+#define BOARD_QUEUE_FMT		"/tmp/cdba-%s.queue"
+#define POOL_QUEUE_FMT		"/tmp/cdba-%s.pool"
+
+/* Length of a UUID as found in /proc/sys/kernel/random/boot_id */
+#define BOOT_ID_LEN		36
+
+struct board_queue {
+	char dir[PATH_MAX];
+	char ticket[PATH_MAX];
+	unsigned long number;
+	int ticket_fd;
+};
+
+/* Queue of the board locked by this session, for recording its power state */
+static struct board_queue locked_queue;
+static bool locked;
+
+static void queue_path(char *path, const struct board_queue *queue,
+		       const char *name)
+{
+	int n;
+
+	n = snprintf(path, PATH_MAX, "%s/%s", queue->dir, name);
+	if (n >= PATH_MAX)
+		errx(1, "failed to build lock queue path");
+}
+
+static long queue_read(const struct board_queue *queue, const char *name)
+{
+	char path[PATH_MAX];
+	char buf[32];
+	ssize_t n;
+	int fd;
+
+	queue_path(path, queue, name);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+
+	buf[n] = '\0';
+
+	return strtol(buf, NULL, 10);
+}
+
+static void queue_write(const struct board_queue *queue, const char *name,
+			long value)
+{
+	char path[PATH_MAX];
+	char buf[32];
+	int len;
+	int fd;
+
+	queue_path(path, queue, name);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return;
+
+	len = snprintf(buf, sizeof(buf), "%ld\n", value);
+	write(fd, buf, len);
+	close(fd);
+}
+
+/* Allocate the next number in the queue, serialized by a lock on the counter */
+static unsigned long queue_next(const struct board_queue *queue)
+{
+	unsigned long number = 0;
+	char path[PATH_MAX];
+	char buf[32];
+	ssize_t n;
+	int fd;
+
+	queue_path(path, queue, ".next");
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0)
+		err(1, "failed to open %s", path);
+
+	if (flock(fd, LOCK_EX) < 0)
+		err(1, "failed to lock %s", path);
+
+	n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n > 0) {
+		buf[n] = '\0';
+		number = strtoul(buf, NULL, 10);
+	}
+
+	n = snprintf(buf, sizeof(buf), "%lu\n", number + 1);
+	if (pwrite(fd, buf, n, 0) != n || ftruncate(fd, n) < 0)
+		err(1, "failed to update %s", path);
+
+	close(fd);
+
+	return number;
+}
+
+static void queue_init(struct board_queue *queue, const char *fmt,
+		       const char *name)
+{
+	int n;
+
+	n = snprintf(queue->dir, sizeof(queue->dir), fmt, name);
+	if (n >= (int)sizeof(queue->dir))
+		errx(1, "failed to build lock queue path");
+
+	/* Past all tickets, until entering the queue */
+	queue->number = ULONG_MAX;
+}
+
+static void queue_enter(struct board_queue *queue)
+{
+	char tmp[PATH_MAX];
+	char name[32];
+
+	if (mkdir(queue->dir, 0777) < 0 && errno != EEXIST)
+		err(1, "failed to create %s", queue->dir);
+
+	queue->number = queue_next(queue);
+
+	/* The ticket is locked before it's visible, so it's never seen as stale */
+	snprintf(name, sizeof(name), ".ticket-%d", getpid());
+	queue_path(tmp, queue, name);
+
+	snprintf(name, sizeof(name), "%010lu", queue->number);
+	queue_path(queue->ticket, queue, name);
+
+	queue->ticket_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (queue->ticket_fd < 0)
+		err(1, "failed to create %s", tmp);
+
+	if (flock(queue->ticket_fd, LOCK_EX) < 0)
+		err(1, "failed to lock %s", tmp);
+
+	if (rename(tmp, queue->ticket) < 0)
+		err(1, "failed to create %s", queue->ticket);
+}
+
+static void queue_leave(struct board_queue *queue)
+{
+	unlink(queue->ticket);
+	close(queue->ticket_fd);
+}
+
+/* Count the live tickets ahead of ours, removing those of dead sessions */
+static unsigned int queue_ahead(const struct board_queue *queue)
+{
+	unsigned int ahead = 0;
+	char path[PATH_MAX];
+	struct dirent *de;
+	unsigned long number;
+	char *end;
+	DIR *dir;
+	int fd;
+
+	dir = opendir(queue->dir);
+	if (!dir && errno == ENOENT)
+		return 0;
+	else if (!dir)
+		err(1, "failed to open %s", queue->dir);
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		number = strtoul(de->d_name, &end, 10);
+		if (*end || number >= queue->number)
+			continue;
+
+		queue_path(path, queue, de->d_name);
+
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		if (!flock(fd, LOCK_SH | LOCK_NB))
+			unlink(path);
+		else
+			ahead++;
+
+		close(fd);
+	}
+
+	closedir(dir);
+
+	return ahead;
+}
+
+/* Estimate the seconds until the board is ours, or -1 if unknown */
+static long queue_eta(const struct board_queue *queue, unsigned int ahead)
+{
+	long average = queue_read(queue, ".average");
+	long start = queue_read(queue, ".holder");
+	long remaining;
+
+	if (average <= 0 || start <= 0)
+		return -1;
+
+	remaining = average - (time(NULL) - start);
+	if (remaining < 0)
+		remaining = 0;
+
+	return remaining + ahead * average;
+}
+
+static void queue_report(const struct board_queue *queue, unsigned int ahead)
+{
+	long eta = queue_eta(queue, ahead);
+
+	if (eta < 0)
+		warnx("board is in use, position %u in queue, waiting...", ahead + 1);
+	else if (eta < 60)
+		warnx("board is in use, position %u in queue, estimated wait under a minute",
+		      ahead + 1);
+	else
+		warnx("board is in use, position %u in queue, estimated wait %ld min",
+		      ahead + 1, (eta + 59) / 60);
+}
+
+/*
+ * Record the start of our session and, if we waited for the previous one to
+ * end, how long it lasted.
+ */
+static void queue_acquired(const struct board_queue *queue, bool waited)
+{
+	long average = queue_read(queue, ".average");
+	long start = queue_read(queue, ".holder");
+	long now = time(NULL);
+	long duration;
+
+	if (waited && start > 0 && now > start) {
+		duration = now - start;
+		average = average > 0 ? (3 * average + duration) / 4 : duration;
+		queue_write(queue, ".average", average);
+	}
+
+	mkdir(queue->dir, 0777);
+	queue_write(queue, ".holder", now);
+}
+
+static bool connection_gone(short revents)
+{
+	return revents & (POLLHUP | POLLRDHUP | POLLERR);
+}
+
+static int lock_open(char *lock, const char *board)
+{
+	int n;
+	int fd;
+
+	n = snprintf(lock, PATH_MAX, "/tmp/cdba-%s.lock", board);
+	if (n >= PATH_MAX)
+		errx(1, "failed to build lockfile path");
+
+	fd = open(lock, O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0)
+		err(1, "failed to open lockfile %s", lock);
+
+	return fd;
+}
+
+/*
+ * Wait for the queue to move or the board lock to be released, as signalled
+ * by @inotify_fd, leaving the queue if the client disconnects.
+ */
+static void queue_wait(struct board_queue *queue, int inotify_fd)
+{
+	struct pollfd pfds[2];
+	char buf[4096];
+	int n;
+
+	/* Watch for hangup without consuming any of the client's messages */
+	pfds[0].fd = inotify_fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = STDIN_FILENO;
+	pfds[1].events = POLLRDHUP;
+
+	n = poll(pfds, 2, inotify_fd >= 0 ? -1 : BOARD_LOCK_POLL_MS);
+	if (n < 0 && errno != EINTR)
+		err(1, "failed to wait for board lock");
+
+	if (n > 0 && connection_gone(pfds[1].revents)) {
+		queue_leave(queue);
+		errx(1, "connection is gone");
+	}
+
+	while (inotify_fd >= 0 && read(inotify_fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * Tickets are removed, or closed by dead sessions, as the queue moves and
+ * lock files are closed as boards are released.
+ */
+static int queue_watch(const struct board_queue *queue)
+{
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd >= 0 &&
+	    inotify_add_watch(fd, queue->dir, IN_DELETE | IN_CLOSE_WRITE) < 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
+static int lock_watch(int inotify_fd, const char *lock)
+{
+	if (inotify_fd >= 0 &&
+	    inotify_add_watch(inotify_fd, lock, IN_CLOSE_NOWRITE) < 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+
+	return inotify_fd;
+}
+
+/**
+ * board_lock() - wait for and lock a board for the rest of the session
+ * @board:	name of the board
+ *
+ * Waiting sessions are served in order of arrival. The position in the queue
+ * is reported on stderr as it changes and the process exits if the client
+ * disconnects while waiting.
+ */
+void board_lock(const char *board)
+{
+	struct board_queue queue;
+	unsigned int reported = UINT_MAX;
+	char lock[PATH_MAX];
+	unsigned int ahead;
+	bool waited = false;
+	int inotify_fd;
+	int lock_fd;
+
+	lock_fd = lock_open(lock, board);
+
+	queue_init(&queue, BOARD_QUEUE_FMT, board);
+	queue_enter(&queue);
+
+	inotify_fd = queue_watch(&queue);
+	inotify_fd = lock_watch(inotify_fd, lock);
+
+	for (;;) {
+		ahead = queue_ahead(&queue);
+		if (!ahead && !flock(lock_fd, LOCK_EX | LOCK_NB))
+			break;
+
+		if (ahead != reported) {
+			queue_report(&queue, ahead);
+			reported = ahead;
+		}
+
+		waited = true;
+
+		queue_wait(&queue, inotify_fd);
+	}
+
+	/* Update the estimates before the next in line reports its wait */
+	queue_acquired(&queue, waited);
+
+	queue_leave(&queue);
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+
+	locked_queue = queue;
+	locked = true;
+}
+
+/* Lock the first board that is free and not waited for by name */
+static int pool_try(const char * const *boards, const int *lock_fds,
+		    unsigned int count)
+{
+	struct board_queue queue;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		queue_init(&queue, BOARD_QUEUE_FMT, boards[i]);
+		if (queue_ahead(&queue))
+			continue;
+
+		if (!flock(lock_fds[i], LOCK_EX | LOCK_NB)) {
+			queue_acquired(&queue, false);
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * board_lock_pool() - wait for and lock any board of a pool
+ * @pool:	name of the pool
+ * @boards:	names of the boards of the pool, in order of preference
+ * @count:	number of @boards
+ *
+ * Sessions waiting for a board of the pool are served in order of arrival, as
+ * for board_lock().
+ *
+ * Return: index in @boards of the board locked for the rest of the session
+ */
+unsigned int board_lock_pool(const char *pool, const char * const *boards,
+			     unsigned int count)
+{
+	struct board_queue queue;
+	unsigned int reported = UINT_MAX;
+	char lock[PATH_MAX];
+	unsigned int ahead;
+	unsigned int i;
+	int inotify_fd;
+	int *lock_fds;
+	int idx = -1;
+
+	queue_init(&queue, POOL_QUEUE_FMT, pool);
+	queue_enter(&queue);
+
+	inotify_fd = queue_watch(&queue);
+
+	lock_fds = calloc(count, sizeof(*lock_fds));
+	if (!lock_fds)
+		err(1, "failed to allocate lock files");
+
+	/* The lock files are kept open, as closing them wakes up waiters */
+	for (i = 0; i < count; i++) {
+		lock_fds[i] = lock_open(lock, boards[i]);
+		inotify_fd = lock_watch(inotify_fd, lock);
+	}
+
+	for (;;) {
+		ahead = queue_ahead(&queue);
+		if (!ahead) {
+			idx = pool_try(boards, lock_fds, count);
+			if (idx >= 0)
+				break;
+		}
+
+		if (ahead != reported) {
+			warnx("all boards of %s are in use, position %u in queue, waiting...",
+			      pool, ahead + 1);
+			reported = ahead;
+		}
+
+		queue_wait(&queue, inotify_fd);
+	}
+
+	queue_leave(&queue);
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+
+	for (i = 0; i < count; i++) {
+		if (i != (unsigned int)idx)
+			close(lock_fds[i]);
+	}
+	free(lock_fds);
+
+	queue_init(&locked_queue, BOARD_QUEUE_FMT, boards[idx]);
+	locked = true;
+
+	return idx;
+}
+
+static long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* The boot id of the host, or NULL if it can't be read */
+static const char *boot_id(void)
+{
+	static char id[BOOT_ID_LEN + 1];
+	ssize_t n;
+	int fd;
+
+	if (id[0])
+		return id;
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	n = read(fd, id, BOOT_ID_LEN);
+	close(fd);
+	if (n != BOOT_ID_LEN) {
+		id[0] = '\0';
+		return NULL;
+	}
+
+	return id;
+}
+
+/**
+ * board_lock_set_off() - record the power state of the locked board
+ * @off:	true as the board is powered off, false as it's powered on
+ *
+ * Powering off a board that is already off keeps the earlier time.
+ */
+void board_lock_set_off(bool off)
+{
+	char path[PATH_MAX];
+	const char *id;
+	int fd;
+
+	if (!locked)
+		return;
+
+	queue_path(path, &locked_queue, ".off");
+
+	if (!off) {
+		unlink(path);
+		return;
+	}
+
+	id = boot_id();
+	if (!id || board_lock_off_ms() >= 0)
+		return;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return;
+
+	dprintf(fd, "%ld %s\n", monotonic_ms(), id);
+	close(fd);
+}
+
+/**
+ * board_lock_off_ms() - time the locked board has been powered off
+ *
+ * Return: milliseconds since the board was powered off, or -1 if it's not
+ * known to be off
+ */
+long board_lock_off_ms(void)
+{
+	char recorded[BOOT_ID_LEN + 1];
+	char path[PATH_MAX];
+	long now = monotonic_ms();
+	const char *id;
+	char buf[64];
+	ssize_t n;
+	long off;
+	int fd;
+
+	id = boot_id();
+	if (!locked || !id)
+		return -1;
+
+	queue_path(path, &locked_queue, ".off");
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+
+	buf[n] = '\0';
+
+	/* A time recorded before the host was rebooted says nothing */
+	if (sscanf(buf, "%ld %36s", &off, recorded) != 2 || strcmp(recorded, id))
+		return -1;
+
+	if (off < 0 || off > now)
+		return -1;
+
+	return now - off;
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __BOARD_LOCK_H__
+#define __BOARD_LOCK_H__
+
+#include <stdbool.h>
+
+void board_lock(const char *board);
+unsigned int board_lock_pool(const char *pool, const char * const *boards,
+			     unsigned int count);
+void board_lock_set_off(bool off);
+long board_lock_off_ms(void);
+
+#endif
@@ -5,6 +5,7 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +21,15 @@ void cdba_send_buf(int type, size_t len, const void *buf)
 	/* ignore console messages */
 }
 
+size_t cdba_credit(int channel)
+{
+	return SIZE_MAX;
+}
+
+void cdba_credit_wait(int channel, void (*resume)(void *), void *data)
+{
+}
+
 static void usage(const char *name)
 {
 	fprintf(stderr, "Usage: %s <board> on|off\n", name);
@@ -4,9 +4,12 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -16,10 +19,16 @@
 
 #include "cdba-server.h"
 #include "circ_buf.h"
+#include "compress.h"
+#include "daemon.h"
+#include "delta.h"
 #include "device.h"
 #include "device_parser.h"
 #include "fastboot.h"
+#include "fastboot_cache.h"
 #include "list.h"
+#include "sha256.h"
+#include "staging.h"
 #include "watch.h"
 
 static const char *username;
@@ -53,8 +62,146 @@ static struct fastboot_ops fastboot_ops = {
 	.info = fastboot_info,
 };
 
-static void msg_select_board(const void *param)
+static int fastboot_codec = FASTBOOT_CODEC_NONE;
+
+/* Pick the first of the codecs offered by the client that we support */
+static void select_codec(const uint8_t *codecs, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (compress_supported(codecs[i])) {
+			fastboot_codec = codecs[i];
+			break;
+		}
+	}
+}
+
+static bool credits_enabled;
+static size_t credits[CREDIT_CHANNEL_COUNT];
+static size_t credits_consumed;
+
+struct credit_waiter {
+	void (*resume)(void *);
+	void *data;
+};
+
+static struct credit_waiter credit_waiters[CREDIT_CHANNEL_COUNT];
+
+/* Protocol version and capabilities, negotiated by MSG_HELLO */
+static int proto_version = 1;
+static uint32_t proto_caps;
+static size_t proto_max_len = UINT16_MAX;
+
+/*
+ * MSG_HELLO and its reply are the last version 1 frames, the client waits
+ * for the reply before sending anything else. Clients that never send it
+ * keep using version 1 framing.
+ */
+static void msg_hello(const void *data, size_t len)
+{
+	const struct msg_hello *hello = data;
+	struct msg_hello reply = {};
+	int i;
+
+	if (len < sizeof(*hello) || proto_version != 1) {
+		fprintf(stderr, "invalid hello\n");
+		watch_quit();
+		return;
+	}
+
+	reply.version = MIN(hello->version, CDBA_PROTO_VERSION);
+	reply.caps = hello->caps & CDBA_CAPS;
+	reply.max_len = MSG_V2_MAX_LEN;
+	cdba_send_buf(MSG_HELLO, sizeof(reply), &reply);
+
+	proto_version = reply.version;
+	proto_caps = reply.caps;
+	if (proto_version >= 2)
+		proto_max_len = MIN(hello->max_len, MSG_V2_MAX_LEN);
+
+	if (proto_caps & CDBA_CAP_CREDITS) {
+		credits_enabled = true;
+		for (i = 0; i < CREDIT_CHANNEL_COUNT; i++)
+			credits[i] = credit_window(i);
+	}
+}
+
+/**
+ * cdba_credit() - room for a message on a flow controlled channel
+ * @channel:	CREDIT_CHANNEL_CONSOLE or CREDIT_CHANNEL_STATUS
+ *
+ * Return: number of payload bytes that may be sent, the largest message the
+ * client accepts if it doesn't do flow control
+ */
+size_t cdba_credit(int channel)
+{
+	if (!credits_enabled)
+		return proto_max_len;
+
+	if (credits[channel] <= msg_hdr_size(proto_version))
+		return 0;
+
+	return MIN(credits[channel] - msg_hdr_size(proto_version), proto_max_len);
+}
+
+/**
+ * cdba_credit_wait() - request callback when the client grants credits
+ * @channel:	CREDIT_CHANNEL_CONSOLE or CREDIT_CHANNEL_STATUS
+ * @resume:	invoked once credits are granted on @channel
+ * @data:	passed to @resume
+ */
+void cdba_credit_wait(int channel, void (*resume)(void *), void *data)
 {
+	credit_waiters[channel].resume = resume;
+	credit_waiters[channel].data = data;
+}
+
+static void msg_credit(const void *data, size_t len)
+{
+	const struct msg_credit *credit = data;
+	struct credit_waiter waiter;
+
+	if (len != sizeof(*credit) || credit->channel >= CREDIT_CHANNEL_COUNT)
+		return;
+
+	credits[credit->channel] += credit->bytes;
+
+	waiter = credit_waiters[credit->channel];
+	credit_waiters[credit->channel].resume = NULL;
+	if (waiter.resume)
+		waiter.resume(waiter.data);
+}
+
+/* Return credits for consumed downloads, in batches */
+static void credit_consume(const struct msg_frame *msg, size_t size)
+{
+	struct msg_credit credit = { .channel = CREDIT_CHANNEL_DOWNLOAD };
+
+	if (!credits_enabled || credit_channel(msg->type) != CREDIT_CHANNEL_DOWNLOAD)
+		return;
+
+	credits_consumed += size;
+	if (credits_consumed < CREDIT_DOWNLOAD_WINDOW / 4)
+		return;
+
+	credit.bytes = credits_consumed;
+	cdba_send_buf(MSG_CREDIT, sizeof(credit), &credit);
+	credits_consumed = 0;
+}
+
+static void msg_select_board(const void *param, size_t len)
+{
+	size_t board_len;
+	uint8_t codec;
+
+	board_len = strnlen(param, len);
+	if (board_len == len) {
+		fprintf(stderr, "invalid board selection\n");
+		watch_quit();
+		return;
+	}
+
 	selected_device = device_open(param, username);
 	if (!selected_device) {
 		fprintf(stderr, "failed to open %s\n", (const char *)param);
@@ -63,34 +210,512 @@ static void msg_select_board(const void *param)
 		device_fastboot_open(selected_device, &fastboot_ops);
 	}
 
-	cdba_send(MSG_SELECT_BOARD);
+	/* Clients offering codecs expect to hear which one was picked */
+	if (len > board_len + 1) {
+		select_codec((const uint8_t *)param + board_len + 1, len - board_len - 1);
+
+		codec = fastboot_codec;
+		cdba_send_buf(MSG_SELECT_BOARD, sizeof(codec), &codec);
+	} else {
+		cdba_send(MSG_SELECT_BOARD);
+	}
 }
 
-static void *fastboot_payload;
-static size_t fastboot_size;
+/*
+ * Like MSG_SELECT_BOARD, but for any free board of the pool, named by its
+ * class or one of its tags. The reply carries the name of the board that was
+ * picked, followed by the codec if any were offered, or is empty on failure.
+ */
+static void msg_select_pool(const void *param, size_t len)
+{
+	size_t pool_len;
+	size_t board_len;
+	uint8_t *reply;
+	size_t reply_len;
 
-static void msg_fastboot_download(const void *data, size_t len)
+	pool_len = strnlen(param, len);
+	if (pool_len == len) {
+		fprintf(stderr, "invalid pool selection\n");
+		watch_quit();
+		return;
+	}
+
+	selected_device = device_open_pool(param, username);
+	if (!selected_device) {
+		fprintf(stderr, "no board available in pool %s\n", (const char *)param);
+		watch_quit();
+		cdba_send(MSG_SELECT_POOL);
+		return;
+	}
+
+	device_fastboot_open(selected_device, &fastboot_ops);
+
+	board_len = strlen(selected_device->board);
+	reply_len = board_len + 1;
+	reply = malloc(reply_len + 1);
+	if (!reply)
+		err(1, "failed to allocate pool selection reply");
+	memcpy(reply, selected_device->board, reply_len);
+
+	/* Clients offering codecs expect to hear which one was picked */
+	if (len > pool_len + 1) {
+		select_codec((const uint8_t *)param + pool_len + 1, len - pool_len - 1);
+		reply[reply_len++] = fastboot_codec;
+	}
+
+	cdba_send_buf(MSG_SELECT_POOL, reply_len, reply);
+	free(reply);
+}
+
+static struct staging fastboot_payload = { .fd = -1 };
+
+static bool fastboot_streaming;
+static size_t fastboot_stream_left;
+
+static struct fastboot_cache_entry *fastboot_cache_entry;
+static struct fastboot_digest fastboot_image;
+
+/* Previous image of the board, that a delta upload is applied to */
+static uint8_t *fastboot_base;
+static size_t fastboot_base_size;
+static uint32_t fastboot_block_size;
+static bool fastboot_delta_failed;
+
+static void fastboot_base_release(void)
+{
+	if (fastboot_base)
+		munmap(fastboot_base, fastboot_base_size);
+	fastboot_base = NULL;
+	fastboot_base_size = 0;
+}
+
+static void fastboot_download_done(bool complete)
 {
-	size_t new_size = fastboot_size + len;
-	char *newp;
+	int ret = -1;
 
-	newp = realloc(fastboot_payload, new_size);
-	if (!newp)
-		err(1, "failed too expant fastboot scratch area");
+	cdba_send(MSG_FASTBOOT_DOWNLOAD);
 
-	memcpy(newp + fastboot_size, data, len);
+	if (complete)
+		ret = fastboot_cache_commit(fastboot_cache_entry);
+	else
+		fastboot_cache_abort(fastboot_cache_entry);
+	fastboot_cache_entry = NULL;
+
+	if (!ret)
+		fastboot_cache_set_last(selected_device->board, username,
+					fastboot_image.sha256);
+
+	fastboot_base_release();
+}
+
+/* Images are booted in the background, release them once done */
+static void fastboot_cached_booted(void *data)
+{
+	munmap(data, fastboot_image.size);
 
-	fastboot_payload = newp;
-	fastboot_size = new_size;
+	fastboot_cache_set_last(selected_device->board, username, fastboot_image.sha256);
+
+	cdba_send(MSG_FASTBOOT_DOWNLOAD);
+}
+
+static void fastboot_staging_booted(void *data)
+{
+	fastboot_download_done(true);
+	staging_release(&fastboot_payload);
+}
+
+static void msg_fastboot_digest(const void *data, size_t len)
+{
+	const struct fastboot_digest *digest = data;
+	uint8_t hit = 0;
+	void *image;
+
+	if (len != sizeof(*digest))
+		return;
+
+	fastboot_cache_abort(fastboot_cache_entry);
+	fastboot_cache_entry = NULL;
+
+	fastboot_image = *digest;
+
+	image = fastboot_cache_lookup(digest->sha256, digest->size);
+	if (!image) {
+		/* Let the client upload the image, and keep a copy of it */
+		fastboot_cache_entry = fastboot_cache_insert(digest->sha256, digest->size);
+		cdba_send_buf(MSG_FASTBOOT_DIGEST, sizeof(hit), &hit);
+		return;
+	}
+
+	hit = 1;
+	cdba_send_buf(MSG_FASTBOOT_DIGEST, sizeof(hit), &hit);
+
+	warnx("using cached boot image");
+	device_boot(selected_device, image, digest->size,
+		    fastboot_cached_booted, image);
+}
+
+/*
+ * Describe the blocks of the previous image of the board, for the client to
+ * express the new image as a delta against it. An empty list of signatures
+ * tells the client to upload the full image.
+ */
+static void msg_fastboot_signatures(void)
+{
+	struct fastboot_block_signature *sigs;
+	struct fastboot_signature_header hdr;
+	size_t per_msg = UINT16_MAX / sizeof(*sigs);
+	size_t nblocks;
+	size_t i;
+
+	fastboot_base_release();
+
+	fastboot_base = fastboot_cache_last(selected_device->board, username,
+					    &fastboot_base_size);
+	if (!fastboot_base) {
+		cdba_send(MSG_FASTBOOT_SIGNATURES);
+		return;
+	}
+
+	fastboot_block_size = delta_block_size(fastboot_base_size);
+	nblocks = fastboot_base_size / fastboot_block_size;
+
+	sigs = calloc(nblocks, sizeof(*sigs));
+	if (!sigs)
+		err(1, "failed to allocate fastboot signatures");
+	delta_signatures(fastboot_base, nblocks, fastboot_block_size, sigs);
+
+	hdr.block_size = fastboot_block_size;
+	hdr.size = fastboot_base_size;
+	cdba_send_buf(MSG_FASTBOOT_SIGNATURES, sizeof(hdr), &hdr);
+
+	for (i = 0; i < nblocks; i += per_msg) {
+		cdba_send_buf(MSG_FASTBOOT_SIGNATURES,
+			      MIN(per_msg, nblocks - i) * sizeof(*sigs), &sigs[i]);
+	}
+
+	cdba_send(MSG_FASTBOOT_SIGNATURES);
+
+	free(sigs);
+}
+
+static int fastboot_delta_copy(const struct fastboot_delta_copy *copy)
+{
+	uint64_t nblocks = fastboot_base_size / fastboot_block_size;
+	size_t offset;
+	size_t len;
+
+	if (!fastboot_base || copy->block >= nblocks ||
+	    copy->count > nblocks - copy->block)
+		return -1;
+
+	offset = (size_t)copy->block * fastboot_block_size;
+	len = (size_t)copy->count * fastboot_block_size;
+
+	fastboot_cache_write(fastboot_cache_entry, fastboot_base + offset, len);
+
+	return staging_append(&fastboot_payload, fastboot_base + offset, len);
+}
+
+static bool fastboot_delta_verify(void)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	struct sha256_ctx ctx;
+
+	if (fastboot_payload.size != fastboot_image.size)
+		return false;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, fastboot_payload.data, fastboot_payload.size);
+	sha256_final(&ctx, digest);
+
+	return !memcmp(digest, fastboot_image.sha256, SHA256_DIGEST_SIZE);
+}
+
+/* Reconstruct the image from blocks of the previous image and literal data */
+static void msg_fastboot_delta(const void *data, size_t len)
+{
+	const uint8_t *op = data;
+	int ret = 0;
+
+	if (fastboot_payload.fd < 0) {
+		if (staging_init(&fastboot_payload, fastboot_image.size) < 0)
+			err(1, "failed to allocate fastboot staging area");
+		fastboot_delta_failed = false;
+	}
 
 	if (!len) {
-		device_boot(selected_device, fastboot_payload, fastboot_size);
+		if (!fastboot_delta_failed && fastboot_delta_verify()) {
+			device_boot(selected_device, fastboot_payload.data,
+				    fastboot_payload.size,
+				    fastboot_staging_booted, NULL);
+		} else {
+			warnx("failed to reconstruct fastboot image from delta");
+			fastboot_download_done(false);
+			staging_release(&fastboot_payload);
+		}
+		return;
+	}
+
+	if (fastboot_delta_failed)
+		return;
+
+	if (op[0] == FASTBOOT_DELTA_COPY && len == sizeof(struct fastboot_delta_copy)) {
+		ret = fastboot_delta_copy(data);
+	} else if (op[0] == FASTBOOT_DELTA_LITERAL) {
+		fastboot_cache_write(fastboot_cache_entry, op + 1, len - 1);
+		ret = staging_append(&fastboot_payload, op + 1, len - 1);
+	} else {
+		ret = -1;
+	}
+
+	if (ret < 0)
+		fastboot_delta_failed = true;
+}
+
+/*
+ * Images of a flash manifest are received while the previous one is being
+ * flashed. The client is told to send the next image once there's room for
+ * it, limiting the server to hold two images at a time.
+ */
+struct flash_job {
+	char *partition;
+	struct staging stage;
+
+	struct list_head node;
+};
+
+static char *fastboot_flash_partition;
+static struct list_head flash_jobs = LIST_INIT(flash_jobs);
+static unsigned int flash_job_count;
+static bool flash_ack_pending;
+static bool flash_running;
+
+static void flash_send_status(int state, int result)
+{
+	struct fastboot_flash_status status = {
+		.state = state,
+		.result = result,
+	};
+
+	cdba_send_buf(MSG_FASTBOOT_FLASH, sizeof(status), &status);
+}
+
+static void flash_run_next(void);
+
+static void flash_job_done(void *data, int status)
+{
+	struct flash_job *job = data;
+
+	if (status < 0)
+		warnx("failed to flash %s", job->partition);
+
+	flash_send_status(FASTBOOT_FLASH_DONE, status < 0);
+
+	list_del(&job->node);
+	staging_release(&job->stage);
+	free(job->partition);
+	free(job);
+	flash_job_count--;
+	flash_running = false;
+
+	if (flash_ack_pending) {
+		flash_ack_pending = false;
+		flash_send_status(FASTBOOT_FLASH_QUEUED, 0);
+	}
+
+	flash_run_next();
+}
+
+static void flash_run_next(void)
+{
+	struct flash_job *job;
+
+	if (flash_running || list_empty(&flash_jobs))
+		return;
+
+	job = list_entry_first(&flash_jobs, struct flash_job, node);
+	flash_running = true;
+
+	warnx("flashing %s", job->partition);
+	device_flash_async(selected_device, job->partition, job->stage.data,
+			   job->stage.size, flash_job_done, job);
+}
+
+/* Queue the staged image for flashing, taking over the staging area */
+static void flash_enqueue(void)
+{
+	struct flash_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		err(1, "failed to allocate flash job");
+	job->partition = fastboot_flash_partition;
+	job->stage = fastboot_payload;
+
+	fastboot_flash_partition = NULL;
+	fastboot_payload = (struct staging){ .fd = -1 };
+
+	list_add(&flash_jobs, &job->node);
+	flash_job_count++;
+
+	if (flash_job_count > 1)
+		flash_ack_pending = true;
+	else
+		flash_send_status(FASTBOOT_FLASH_QUEUED, 0);
+
+	flash_run_next();
+}
+
+/* The next download is to be flashed to the named partition */
+static void msg_fastboot_flash(const void *data, size_t len)
+{
+	if (!len || strnlen(data, len) == len) {
+		fprintf(stderr, "invalid flash partition\n");
+		return;
+	}
+
+	free(fastboot_flash_partition);
+	fastboot_flash_partition = strdup(data);
+}
+
+static void msg_fastboot_reboot(void)
+{
+	device_fastboot_reboot(selected_device);
+	cdba_send(MSG_FASTBOOT_REBOOT);
+}
+
+static void msg_fastboot_download_size(const void *data, size_t len)
+{
+	const struct fastboot_download_size *announce = data;
+	size_t max;
+	int ret;
+
+	if (len != sizeof(*announce))
+		return;
+
+	max = device_max_download_size(selected_device);
+
+	/*
+	 * Without cut-through the image is collected in full and handed to
+	 * fastboot when it's complete, stage it in a mapping of the announced
+	 * size. The same goes for images too large to be downloaded in one
+	 * piece, which might still be flashed in chunks, and images to be
+	 * flashed, that are downloaded while the previous one is flashed.
+	 */
+	if (!selected_device->fastboot_stream || fastboot_flash_partition ||
+	    announce->size > UINT32_MAX ||
+	    (max && announce->size > max)) {
+		staging_release(&fastboot_payload);
+		if (staging_init(&fastboot_payload, announce->size) < 0)
+			err(1, "failed to allocate fastboot staging area");
+		return;
+	}
+
+	ret = device_boot_start(selected_device, announce->size);
+	if (ret < 0)
+		return;
+
+	fastboot_streaming = true;
+	fastboot_stream_left = announce->size;
+}
 
-		cdba_send(MSG_FASTBOOT_DOWNLOAD);
-		free(fastboot_payload);
-		fastboot_payload = NULL;
-		fastboot_size = 0;
+static void msg_fastboot_stream(const void *data, size_t len)
+{
+	if (len) {
+		len = MIN(len, fastboot_stream_left);
+		fastboot_stream_left -= len;
+
+		device_boot_write(selected_device, data, len);
+		return;
 	}
+
+	if (fastboot_stream_left)
+		warnx("fastboot image truncated, %zu bytes missing", fastboot_stream_left);
+	else
+		device_boot_finish(selected_device);
+
+	fastboot_download_done(!fastboot_stream_left);
+	fastboot_streaming = false;
+}
+
+static void msg_fastboot_download(const void *data, size_t len)
+{
+	int ret;
+
+	fastboot_cache_write(fastboot_cache_entry, data, len);
+
+	if (fastboot_streaming) {
+		msg_fastboot_stream(data, len);
+		return;
+	}
+
+	/* Clients not announcing the image size get a growing staging area */
+	if (fastboot_payload.fd < 0 &&
+	    staging_init(&fastboot_payload, 0) < 0)
+		err(1, "failed to allocate fastboot staging area");
+
+	if (len) {
+		ret = staging_append(&fastboot_payload, data, len);
+		if (ret < 0)
+			err(1, "failed to expand fastboot staging area");
+		return;
+	}
+
+	if (fastboot_flash_partition) {
+		flash_enqueue();
+		return;
+	}
+
+	device_boot(selected_device, fastboot_payload.data, fastboot_payload.size,
+		    fastboot_staging_booted, NULL);
+}
+
+static struct decompressor *fastboot_decompressor;
+static bool fastboot_decompress_failed;
+
+static void fastboot_decompressed(const void *data, size_t len)
+{
+	msg_fastboot_download(data, len);
+}
+
+/* Decompress the image as it arrives and handle it as a regular download */
+static void msg_fastboot_compressed(const void *data, size_t len)
+{
+	int ret;
+
+	if (!fastboot_decompressor) {
+		fastboot_decompressor = decompress_init(fastboot_codec);
+		if (!fastboot_decompressor) {
+			warnx("unexpected compressed fastboot download");
+			return;
+		}
+
+		fastboot_decompress_failed = false;
+	}
+
+	if (len) {
+		if (fastboot_decompress_failed)
+			return;
+
+		ret = decompress_stream(fastboot_decompressor, data, len,
+					fastboot_decompressed);
+		if (ret < 0)
+			fastboot_decompress_failed = true;
+		return;
+	}
+
+	if (fastboot_decompress_failed || !decompress_complete(fastboot_decompressor)) {
+		warnx("compressed fastboot image is corrupt or truncated");
+
+		fastboot_streaming = false;
+		staging_release(&fastboot_payload);
+		fastboot_download_done(false);
+	} else {
+		msg_fastboot_download(NULL, 0);
+	}
+
+	decompress_free(fastboot_decompressor);
+	fastboot_decompressor = NULL;
 }
 
 static void msg_fastboot_continue(void)
@@ -121,24 +746,203 @@ static void msg_key_press(const void *data, size_t len)
 	}
 }
 
+/*
+ * Messages to the client are written to the non-blocking stdout, and queued
+ * when the pipe is full, to be flushed as stdout becomes writable. Once the
+ * queue grows beyond the high-water mark status updates are dropped, and
+ * beyond the limit console data is dropped as well, leaving room for the
+ * messages that the protocol depends upon.
+ */
+#define OUT_HIGH_WATER		(1024 * 1024)
+#define OUT_LIMIT		(8 * 1024 * 1024)
+#define OUT_IOV_MAX		64
+
+struct out_frame {
+	struct list_head node;
+
+	size_t len;
+	size_t offset;
+	uint8_t data[];
+};
+
+static struct list_head out_queue = LIST_INIT(out_queue);
+static size_t out_queued;
+static unsigned int out_dropped_status;
+static unsigned int out_dropped_console;
+
+static int handle_stdout(int fd, void *data);
+
+static void out_enqueue(const struct iovec *iov, int iovcnt, size_t skip)
+{
+	struct out_frame *frame;
+	size_t len = 0;
+	size_t off = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	frame = malloc(sizeof(*frame) + len - skip);
+	if (!frame)
+		err(1, "failed to allocate output frame");
+	frame->len = len - skip;
+	frame->offset = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		memcpy(frame->data + off, (const char *)iov[i].iov_base + skip,
+		       iov[i].iov_len - skip);
+		off += iov[i].iov_len - skip;
+		skip = 0;
+	}
+
+	if (list_empty(&out_queue))
+		watch_add_writefd(STDOUT_FILENO, handle_stdout, NULL);
+
+	list_add(&out_queue, &frame->node);
+	out_queued += frame->len;
+}
+
+/* Write as much of the queue as stdout takes, in one writev() */
+static int out_flush(void)
+{
+	struct iovec iov[OUT_IOV_MAX];
+	struct out_frame *frame;
+	struct out_frame *tmp;
+	int iovcnt = 0;
+	ssize_t n;
+
+	list_for_each_entry(frame, &out_queue, node) {
+		iov[iovcnt].iov_base = frame->data + frame->offset;
+		iov[iovcnt].iov_len = frame->len - frame->offset;
+		if (++iovcnt == OUT_IOV_MAX)
+			break;
+	}
+
+	n = writev(STDOUT_FILENO, iov, iovcnt);
+	if (n < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	list_for_each_entry_safe(frame, tmp, &out_queue, node) {
+		if (!n)
+			break;
+
+		if ((size_t)n < frame->len - frame->offset) {
+			frame->offset += n;
+			out_queued -= n;
+			break;
+		}
+
+		n -= frame->len - frame->offset;
+		out_queued -= frame->len - frame->offset;
+
+		list_del(&frame->node);
+		free(frame);
+	}
+
+	if (list_empty(&out_queue))
+		watch_del_writefd(STDOUT_FILENO);
+
+	return 0;
+}
+
+static int handle_stdout(int fd, void *data)
+{
+	int ret;
+
+	ret = out_flush();
+	if (ret < 0) {
+		fprintf(stderr, "failed to write to client: %s\n", strerror(-ret));
+		watch_quit();
+	}
+
+	return 0;
+}
+
+/* Flush the remaining messages before exiting, while the client is reading */
+static void out_drain(void)
+{
+	struct pollfd pfd = { .fd = STDOUT_FILENO, .events = POLLOUT };
+	int ret;
+
+	while (!list_empty(&out_queue)) {
+		ret = poll(&pfd, 1, 1000);
+		if (ret <= 0 || out_flush() < 0)
+			break;
+	}
+}
+
+static bool out_drop(int type, size_t len)
+{
+	int channel = credit_channel(type);
+	size_t cost = msg_hdr_size(proto_version) + len;
+
+	/* Status updates are snapshots, drop them rather than waiting */
+	if (credits_enabled && channel == CREDIT_CHANNEL_STATUS) {
+		if (credits[channel] < cost)
+			return true;
+	}
+
+	if (credits_enabled && (channel == CREDIT_CHANNEL_CONSOLE ||
+				channel == CREDIT_CHANNEL_STATUS))
+		credits[channel] -= MIN(credits[channel], cost);
+
+	if (type == MSG_STATUS_UPDATE && out_queued > OUT_HIGH_WATER) {
+		if (!out_dropped_status++)
+			warnx("client not keeping up, dropping status updates");
+		return true;
+	}
+
+	if (type == MSG_CONSOLE && out_queued > OUT_LIMIT) {
+		if (!out_dropped_console++)
+			warnx("client not keeping up, dropping console data");
+		return true;
+	}
+
+	return false;
+}
+
 void cdba_send_buf(int type, size_t len, const void *buf)
 {
-	struct msg msg = {
-		.type = type,
-		.len = len
+	uint8_t hdr[MSG_HDR_MAX];
+	struct iovec iov[] = {
+		{ .iov_base = hdr },
+		{ .iov_base = (void *)buf, .iov_len = len },
 	};
+	ssize_t n = 0;
 
-	write(STDOUT_FILENO, &msg, sizeof(msg));
-	if (len)
-		write(STDOUT_FILENO, buf, len);
+	if (out_drop(type, len))
+		return;
+
+	iov[0].iov_len = msg_hdr_encode(proto_version, hdr, type, len);
+
+	/* Preserve ordering, by only writing directly when nothing is queued */
+	if (list_empty(&out_queue)) {
+		n = writev(STDOUT_FILENO, iov, len ? 2 : 1);
+		if (n < 0 && errno != EAGAIN) {
+			fprintf(stderr, "failed to write to client: %s\n", strerror(errno));
+			watch_quit();
+			return;
+		} else if (n < 0) {
+			n = 0;
+		}
+
+		if ((size_t)n == iov[0].iov_len + len)
+			return;
+	}
+
+	out_enqueue(iov, len ? 2 : 1, n);
 }
 
 static int handle_stdin(int fd, void *buf)
 {
 	static struct circ_buf recv_buf = { };
-	struct msg *msg;
-	struct msg hdr;
-	size_t n;
+	struct msg_frame msg;
+	ssize_t size;
 	int ret;
 
 	ret = circ_fill(STDIN_FILENO, &recv_buf);
@@ -147,25 +951,36 @@ static int handle_stdin(int fd, void *buf)
 		return -1;
 	}
 
+	/* Messages are dispatched in place, as they're contiguous in the ring */
 	for (;;) {
-		n = circ_peak(&recv_buf, &hdr, sizeof(hdr));
-		if (n != sizeof(hdr))
-			return 0;
-
-		if (CIRC_AVAIL(&recv_buf) < sizeof(*msg) + hdr.len)
+		size = msg_frame_parse(proto_version, proto_max_len,
+				       circ_data(&recv_buf),
+				       CIRC_AVAIL(&recv_buf), &msg);
+		if (size < 0) {
+			fprintf(stderr, "message of %zu bytes exceeds limit of %zu\n",
+				msg.len, proto_max_len);
+			return -1;
+		} else if (!size) {
 			return 0;
+		}
 
-		msg = malloc(sizeof(*msg) + hdr.len);
-		circ_read(&recv_buf, msg, sizeof(*msg) + hdr.len);
+		/* Only the default channel is in use so far */
+		if (msg.channel) {
+			circ_consume(&recv_buf, size);
+			continue;
+		}
 
-		switch (msg->type) {
+		switch (msg.type) {
 		case MSG_CONSOLE:
-			device_write(selected_device, msg->data, msg->len);
+			device_write(selected_device, msg.data, msg.len);
 			break;
 		case MSG_FASTBOOT_PRESENT:
 			break;
 		case MSG_SELECT_BOARD:
-			msg_select_board(msg->data);
+			msg_select_board(msg.data, msg.len);
+			break;
+		case MSG_SELECT_POOL:
+			msg_select_pool(msg.data, msg.len);
 			break;
 		case MSG_HARDRESET:
 			// fprintf(stderr, "hard reset\n");
@@ -181,7 +996,7 @@ static int handle_stdin(int fd, void *buf)
 			cdba_send(MSG_POWER_OFF);
 			break;
 		case MSG_FASTBOOT_DOWNLOAD:
-			msg_fastboot_download(msg->data, msg->len);
+			msg_fastboot_download(msg.data, msg.len);
 			break;
 		case MSG_FASTBOOT_BOOT:
 			// fprintf(stderr, "fastboot boot\n");
@@ -202,20 +1017,48 @@ static int handle_stdin(int fd, void *buf)
 			device_list_devices(username);
 			break;
 		case MSG_BOARD_INFO:
-			device_info(username, msg->data, msg->len);
+			device_info(username, msg.data, msg.len);
 			break;
 		case MSG_FASTBOOT_CONTINUE:
 			msg_fastboot_continue();
 			break;
 		case MSG_KEY_PRESS:
-			msg_key_press(msg->data, msg->len);
+			msg_key_press(msg.data, msg.len);
+			break;
+		case MSG_FASTBOOT_DOWNLOAD_SIZE:
+			msg_fastboot_download_size(msg.data, msg.len);
+			break;
+		case MSG_FASTBOOT_DIGEST:
+			msg_fastboot_digest(msg.data, msg.len);
+			break;
+		case MSG_FASTBOOT_SIGNATURES:
+			msg_fastboot_signatures();
+			break;
+		case MSG_FASTBOOT_DELTA:
+			msg_fastboot_delta(msg.data, msg.len);
+			break;
+		case MSG_FASTBOOT_COMPRESSED:
+			msg_fastboot_compressed(msg.data, msg.len);
+			break;
+		case MSG_FASTBOOT_FLASH:
+			msg_fastboot_flash(msg.data, msg.len);
+			break;
+		case MSG_FASTBOOT_REBOOT:
+			msg_fastboot_reboot();
+			break;
+		case MSG_CREDIT:
+			msg_credit(msg.data, msg.len);
+			break;
+		case MSG_HELLO:
+			msg_hello(msg.data, msg.len);
 			break;
 		default:
-			fprintf(stderr, "unk %d len %d\n", msg->type, msg->len);
-			exit(1);
+			fprintf(stderr, "unk %d len %zu\n", msg.type, msg.len);
+			break;
 		}
 
-		free(msg);
+		credit_consume(&msg, size);
+		circ_consume(&recv_buf, size);
 	}
 
 	return 0;
@@ -231,14 +1074,34 @@ static void atexit_handler(void)
 	syslog(LOG_INFO, "exiting");
 }
 
+static void usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-d] [-s <socket>]\n", __progname);
+	exit(1);
+}
+
 int main(int argc, char **argv)
 {
+	const char *socket_path = NULL;
+	bool daemon_mode = false;
 	int flags;
+	int opt;
 	int ret;
 
-	signal(SIGPIPE, sigpipe_handler);
-
-	fprintf(stderr, "Starting cdba server\n");
+	while ((opt = getopt(argc, argv, "ds:")) != -1) {
+		switch (opt) {
+		case 'd':
+			daemon_mode = true;
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
 
 	username = getenv("CDBA_USER");
 	if (!username)
@@ -246,6 +1109,13 @@ int main(int argc, char **argv)
 	if (!username)
 		username = "nobody";
 
+	/* Hand the session over to the daemon, if one is running */
+	socket_path = daemon_socket_path(socket_path);
+	if (!daemon_mode)
+		daemon_attach(socket_path, username);
+
+	signal(SIGPIPE, sigpipe_handler);
+
 	openlog("cdba-server", LOG_PID, LOG_DAEMON);
 	atexit(atexit_handler);
 
@@ -258,13 +1128,27 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (daemon_mode)
+		username = daemon_run(socket_path);
+
+	fprintf(stderr, "Starting cdba server\n");
+
 	watch_add_readfd(STDIN_FILENO, handle_stdin, NULL);
 
 	flags = fcntl(STDIN_FILENO, F_GETFL, 0);
 	fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
 
+	flags = fcntl(STDOUT_FILENO, F_GETFL, 0);
+	fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
+
 	watch_run();
 
+	/* Send the console output held for batching, before draining */
+	if (selected_device)
+		device_console_close(selected_device);
+
+	out_drain();
+
 	/* if we got here, stdin/out/err might be not accessible anymore */
 	ret = open("/dev/null", O_RDWR);
 	if (ret >= 0) {
@@ -9,4 +9,7 @@
 void cdba_send_buf(int type, size_t len, const void *buf);
 #define cdba_send(type) cdba_send_buf(type, 0, NULL)
 
+size_t cdba_credit(int channel);
+void cdba_credit_wait(int channel, void (*resume)(void *), void *data);
+
 #endif
@@ -4,15 +4,21 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
+#define _GNU_SOURCE /* for F_SETPIPE_SZ */
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <alloca.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -22,12 +28,17 @@
 
 #include "cdba.h"
 #include "circ_buf.h"
+#include "compress.h"
+#include "delta.h"
 #include "list.h"
+#include "sha256.h"
 
 static bool quit;
 static bool fastboot_repeat;
 static bool fastboot_done;
 static bool fastboot_continue;
+static bool fastboot_compress;
+static int fastboot_codec = FASTBOOT_CODEC_NONE;
 
 static int status_fd = -1;
 
@@ -120,6 +131,9 @@ static int fork_ssh(const char *host, const char *cmd, int *pipes)
 	pipes[1] = piped_stdout[0];
 	pipes[2] = piped_stderr[0];
 
+	/* Allow larger batches of fastboot download messages, if permitted */
+	fcntl(pipes[0], F_SETPIPE_SZ, 1024 * 1024);
+
 	for (i = 0; i < 3; i++) {
 		flags = fcntl(pipes[i], F_GETFL, 0);
 		fcntl(pipes[i], F_SETFL, flags | O_NONBLOCK);
@@ -128,40 +142,149 @@ static int fork_ssh(const char *host, const char *cmd, int *pipes)
 	return 0;
 }
 
+/*
+ * Write the entire iovec to the non-blocking fd. If nothing could be written
+ * -1 and EAGAIN is returned, but once the first byte is in the pipe the rest
+ * is written as well, so that a message is never left half written.
+ */
+static ssize_t cdba_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	ssize_t total = 0;
+	ssize_t n;
+
+	for (;;) {
+		n = writev(fd, iov, iovcnt);
+		if (n < 0 && errno == EAGAIN && total) {
+			poll(&pfd, 1, -1);
+			continue;
+		} else if (n < 0) {
+			return n;
+		}
+
+		total += n;
+
+		while (iovcnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (!iovcnt)
+			return total;
+
+		iov->iov_base = (char *)iov->iov_base + n;
+		iov->iov_len -= n;
+	}
+}
+
+/* Framing in use, version 1 until the server has replied to MSG_HELLO */
+static int proto_version = 1;
+static size_t proto_max_len = UINT16_MAX;
+static uint32_t proto_caps;
+
 #define cdba_send(fd, type) cdba_send_buf(fd, type, 0, NULL)
 static int cdba_send_buf(int fd, int type, size_t len, const void *buf)
 {
+	uint8_t hdr[MSG_HDR_MAX];
+	struct iovec iov[] = {
+		{ .iov_base = hdr },
+		{ .iov_base = (void *)buf, .iov_len = len },
+	};
+	ssize_t ret;
+
+	iov[0].iov_len = msg_hdr_encode(proto_version, hdr, type, len);
+
+	ret = cdba_writev(fd, iov, len ? 2 : 1);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Console input and commands that didn't fit in the ssh pipe, e.g. while an
+ * upload keeps it full, sent in order as the pipe drains. The terminal isn't
+ * read while any are pending.
+ */
+struct tty_msg {
+	struct list_head node;
+
+	int type;
+	size_t len;
+	uint8_t data[];
+};
+
+static struct list_head tty_queue = LIST_INIT(tty_queue);
+
+/* Send the queued input, returning -1 if the pipe filled up again */
+static int tty_queue_flush(int fd)
+{
+	struct tty_msg *msg;
+	struct tty_msg *next;
 	int ret;
 
-	struct msg msg = {
-		.type = type,
-		.len = len
-	};
+	list_for_each_entry_safe(msg, next, &tty_queue, node) {
+		ret = cdba_send_buf(fd, msg->type, msg->len, msg->data);
+		if (ret < 0 && errno == EAGAIN)
+			return -1;
+		else if (ret < 0)
+			err(1, "failed to send console input");
 
-	ret = write(fd, &msg, sizeof(msg));
-	if (ret < 0)
-		return ret;
+		list_del(&msg->node);
+		free(msg);
+	}
+
+	return 0;
+}
+
+static void tty_send(int fd, int type, size_t len, const void *data)
+{
+	struct tty_msg *msg;
+	int ret;
+
+	if (list_empty(&tty_queue)) {
+		ret = cdba_send_buf(fd, type, len, data);
+		if (!ret)
+			return;
+		else if (errno != EAGAIN)
+			err(1, "failed to send console input");
+	}
+
+	msg = malloc(sizeof(*msg) + len);
+	if (!msg)
+		err(1, "failed to queue console input");
 
+	msg->type = type;
+	msg->len = len;
 	if (len)
-		ret = write(fd, buf, len);
+		memcpy(msg->data, data, len);
 
-	return ret < 0 ? ret : 0;
+	list_add(&tty_queue, &msg->node);
 }
 
-static int cdba_send_key(int fd, int key, uint8_t state)
+static void tty_send_key(int fd, int key, uint8_t state)
 {
 	struct key_press press = {
 		.key = key,
 		.state = state,
 	};
 
-	return cdba_send_buf(fd, MSG_KEY_PRESS, sizeof(press), &press);
+	tty_send(fd, MSG_KEY_PRESS, sizeof(press), &press);
 }
 
-static int cdba_toggle_key(int fd, int key, bool key_state[DEVICE_KEY_COUNT])
+static void tty_toggle_key(int fd, int key, bool key_state[DEVICE_KEY_COUNT])
 {
 	key_state[key] = !key_state[key];
-	return cdba_send_key(fd, key, key_state[key]);
+	tty_send_key(fd, key, key_state[key]);
+}
+
+/* Send the console input collected so far as a single message */
+static void tty_flush(int fd, char *out, size_t *len)
+{
+	if (!*len)
+		return;
+
+	tty_send(fd, MSG_CONSOLE, *len, out);
+	*len = 0;
 }
 
 static int tty_callback(int *ssh_fds)
@@ -169,7 +292,9 @@ static int tty_callback(int *ssh_fds)
 	static bool key_state[DEVICE_KEY_COUNT];
 	static const char ctrl_a = 0x1;
 	static bool special;
-	char buf[32];
+	char out[4096];
+	char buf[4096];
+	size_t len = 0;
 	ssize_t k;
 	ssize_t n;
 
@@ -177,55 +302,66 @@ static int tty_callback(int *ssh_fds)
 	if (n < 0)
 		return n;
 
+	/*
+	 * Runs of regular input, e.g. pastes, are sent as one message, which
+	 * is flushed before any command so that the ordering is retained.
+	 */
 	for (k = 0; k < n; k++) {
 		if (buf[k] == ctrl_a) {
 			special = true;
 		} else if (special) {
+			if (buf[k] == 'a') {
+				out[len++] = ctrl_a;
+				special = false;
+				continue;
+			}
+
+			tty_flush(ssh_fds[0], out, &len);
+
 			switch (buf[k]) {
 			case 'q':
 				quit = true;
 				break;
 			case 'P':
-				cdba_send(ssh_fds[0], MSG_POWER_ON);
+				tty_send(ssh_fds[0], MSG_POWER_ON, 0, NULL);
 				break;
 			case 'p':
-				cdba_send(ssh_fds[0], MSG_POWER_OFF);
+				tty_send(ssh_fds[0], MSG_POWER_OFF, 0, NULL);
 				break;
 			case 's':
-				cdba_send(ssh_fds[0], MSG_STATUS_UPDATE);
+				tty_send(ssh_fds[0], MSG_STATUS_UPDATE, 0, NULL);
 				break;
 			case 'V':
-				cdba_send(ssh_fds[0], MSG_VBUS_ON);
+				tty_send(ssh_fds[0], MSG_VBUS_ON, 0, NULL);
 				break;
 			case 'v':
-				cdba_send(ssh_fds[0], MSG_VBUS_OFF);
-				break;
-			case 'a':
-				cdba_send_buf(ssh_fds[0], MSG_CONSOLE, 1, &ctrl_a);
+				tty_send(ssh_fds[0], MSG_VBUS_OFF, 0, NULL);
 				break;
 			case 'B':
-				cdba_send(ssh_fds[0], MSG_SEND_BREAK);
+				tty_send(ssh_fds[0], MSG_SEND_BREAK, 0, NULL);
 				break;
 			case 'o':
-				cdba_send_key(ssh_fds[0], DEVICE_KEY_POWER, KEY_PRESS_PULSE);
+				tty_send_key(ssh_fds[0], DEVICE_KEY_POWER, KEY_PRESS_PULSE);
 				break;
 			case 'O':
-				cdba_toggle_key(ssh_fds[0], DEVICE_KEY_POWER, key_state);
+				tty_toggle_key(ssh_fds[0], DEVICE_KEY_POWER, key_state);
 				break;
 			case 'f':
-				cdba_send_key(ssh_fds[0], DEVICE_KEY_FASTBOOT, KEY_PRESS_PULSE);
+				tty_send_key(ssh_fds[0], DEVICE_KEY_FASTBOOT, KEY_PRESS_PULSE);
 				break;
 			case 'F':
-				cdba_toggle_key(ssh_fds[0], DEVICE_KEY_FASTBOOT, key_state);
+				tty_toggle_key(ssh_fds[0], DEVICE_KEY_FASTBOOT, key_state);
 				break;
 			}
 
 			special = false;
 		} else {
-			cdba_send_buf(ssh_fds[0], MSG_CONSOLE, 1, buf + k);
+			out[len++] = buf[k];
 		}
 	}
 
+	tty_flush(ssh_fds[0], out, &len);
+
 	return 0;
 }
 
@@ -237,6 +373,150 @@ struct work {
 
 static struct list_head work_items = LIST_INIT(work_items);
 
+/*
+ * Flow control, when supported by the server. Downloads are limited by the
+ * credits granted by the server, and console and status credits are
+ * returned to the server as the messages are consumed.
+ */
+static bool credits_enabled;
+static size_t download_credit;
+static size_t credits_owed[CREDIT_CHANNEL_COUNT];
+static bool credits_queued;
+static struct work *download_parked;
+
+/* Don't bother sending downloads in smaller pieces than this */
+#define CREDIT_DOWNLOAD_MIN	4096
+
+static void credit_return_fn(struct work *work, int ssh_stdin)
+{
+	struct msg_credit credit;
+	int ret;
+	int i;
+
+	credits_queued = false;
+
+	for (i = 0; i < CREDIT_CHANNEL_COUNT; i++) {
+		if (!credits_owed[i])
+			continue;
+
+		credit.channel = i;
+		credit.bytes = credits_owed[i];
+		credits_owed[i] = 0;
+
+		ret = cdba_send_buf(ssh_stdin, MSG_CREDIT, sizeof(credit), &credit);
+		if (ret < 0)
+			err(1, "failed to send credits");
+	}
+}
+
+static void credit_return(const struct msg_frame *msg, size_t size)
+{
+	static struct work credit_work = { credit_return_fn };
+	int channel = credit_channel(msg->type);
+
+	if (!credits_enabled || channel < 0 || channel == CREDIT_CHANNEL_DOWNLOAD)
+		return;
+
+	credits_owed[channel] += size;
+	if (credits_owed[channel] < credit_window(channel) / 4 || credits_queued)
+		return;
+
+	list_add(&work_items, &credit_work.node);
+	credits_queued = true;
+}
+
+static void handle_credit(const void *data, size_t len)
+{
+	const struct msg_credit *credit = data;
+
+	if (len != sizeof(*credit) || credit->channel != CREDIT_CHANNEL_DOWNLOAD)
+		return;
+
+	download_credit += credit->bytes;
+
+	if (download_parked && download_credit >= CREDIT_DOWNLOAD_MIN) {
+		list_add(&work_items, &download_parked->node);
+		download_parked = NULL;
+	}
+}
+
+/*
+ * Wait for credits before sending more of the download, unless the entire
+ * remainder, message headers included, fits.
+ */
+static bool download_park(struct work *work, size_t remaining)
+{
+	if (!credits_enabled || download_credit >= CREDIT_DOWNLOAD_MIN ||
+	    download_credit > remaining)
+		return false;
+
+	download_parked = work;
+	return true;
+}
+
+static size_t download_budget(size_t budget)
+{
+	if (credits_enabled)
+		budget = MIN(budget, download_credit);
+
+	return budget;
+}
+
+static void download_sent(size_t len)
+{
+	if (credits_enabled)
+		download_credit -= MIN(download_credit, len);
+}
+
+/*
+ * The server's reply to MSG_HELLO is the last version 1 frame, so nothing
+ * else is sent until it has arrived and the framing is settled.
+ */
+static bool hello_pending;
+
+static void hello_fn(struct work *work, int ssh_stdin)
+{
+	struct msg_hello hello = {
+		.version = CDBA_PROTO_VERSION,
+		.caps = CDBA_CAPS,
+		.max_len = MSG_V2_MAX_LEN,
+	};
+	int ret;
+
+	ret = cdba_send_buf(ssh_stdin, MSG_HELLO, sizeof(hello), &hello);
+	if (ret < 0)
+		err(1, "failed to send hello");
+
+	hello_pending = true;
+}
+
+static void request_hello(void)
+{
+	static struct work hello_work = { hello_fn };
+
+	list_add(&work_items, &hello_work.node);
+}
+
+static void handle_hello(const void *data, size_t len)
+{
+	const struct msg_hello *hello = data;
+
+	if (len < sizeof(*hello) || !hello->version)
+		errx(1, "invalid hello reply from server");
+
+	proto_version = hello->version;
+	proto_caps = hello->caps;
+	if (proto_version >= 2)
+		proto_max_len = MIN(hello->max_len, MSG_V2_MAX_LEN);
+
+	if (hello->caps & CDBA_CAP_CREDITS) {
+		credits_enabled = true;
+		download_credit = CREDIT_DOWNLOAD_WINDOW;
+	}
+
+	hello_pending = false;
+}
+
 static void list_boards_fn(struct work *work, int ssh_stdin)
 {
 	int ret;
@@ -291,29 +571,49 @@ static void request_board_info(const char *board)
 struct select_board {
 	struct work work;
 
+	int type;
 	const char *board;
 };
 
 static void select_board_fn(struct work *work, int ssh_stdin)
 {
 	struct select_board *board = container_of(work, struct select_board, work);
+	static const uint8_t codecs[] = { FASTBOOT_CODEC_ZSTD };
+	uint8_t buf[UINT8_MAX + sizeof(codecs)];
+	size_t len;
+	size_t i;
 	int ret;
 
-	ret = cdba_send_buf(ssh_stdin, MSG_SELECT_BOARD,
-			    strlen(board->board) + 1,
-			    board->board);
+	if (board->type == MSG_SELECT_POOL && !(proto_caps & CDBA_CAP_POOLS))
+		errx(1, "server doesn't support board pools");
+
+	len = strlen(board->board) + 1;
+	if (len > UINT8_MAX)
+		errx(1, "%s name too long",
+		     board->type == MSG_SELECT_POOL ? "pool" : "board");
+	memcpy(buf, board->board, len);
+
+	/* Offer the codecs we support, following the board name */
+	for (i = 0; fastboot_compress && i < sizeof(codecs); i++) {
+		if (compress_supported(codecs[i]))
+			buf[len++] = codecs[i];
+	}
+
+	ret = cdba_send_buf(ssh_stdin, board->type, len, buf);
 	if (ret < 0)
-		err(1, "failed to send power on request");
+		err(1, "failed to send board selection");
 
 	free(work);
 }
 
-static void request_select_board(const char *board)
+/* @board names a pool of boards for MSG_SELECT_POOL */
+static void request_select_board(int type, const char *board)
 {
 	struct select_board *work;
 
 	work = malloc(sizeof(*work));
 	work->work.fn = select_board_fn;
+	work->type = type;
 	work->board = board;
 
 	list_add(&work_items, &work->work.node);
@@ -367,25 +667,123 @@ static void request_fastboot_continue(void)
 	list_add(&work_items, &work.node);
 }
 
+#define FASTBOOT_FRAMES_MAX	64
+#define FASTBOOT_ZBUF_SIZE	(1024 * 1024)
+
 struct fastboot_download_work {
 	struct work work;
 
 	void *data;
 	size_t offset;
 	size_t size;
+
+	bool announced;
+
+	/* Delta against the server's previous image of the board */
+	struct delta_op *ops;
+	size_t nops;
+	size_t op;
+	size_t op_offset;
+
+	/* Compressed image, produced in chunks while uploading */
+	struct compressor *compressor;
+	void *zbuf;
+	size_t zoff;
+	size_t zlen;
+	bool zdone;
 };
 
+static struct fastboot_download_work *fastboot_pending;
+static struct fastboot_digest fastboot_digest;
+
+static struct fastboot_signature_header fastboot_sig_header;
+static struct fastboot_block_signature *fastboot_sigs;
+static size_t fastboot_nsigs;
+
+static void fastboot_work_free(struct fastboot_download_work *work)
+{
+	if (work->size)
+		munmap(work->data, work->size);
+	free(work->ops);
+	compress_free(work->compressor);
+	free(work->zbuf);
+	free(work);
+}
+
+/* Room in the pipe towards ssh, to size the batch of download messages */
+static size_t fastboot_pipe_space(int fd)
+{
+	int queued;
+	int size;
+
+	size = fcntl(fd, F_GETPIPE_SZ);
+	if (size < 0 || ioctl(fd, FIONREAD, &queued) < 0)
+		return UINT16_MAX;
+
+	return MAX(size - queued, PIPE_BUF);
+}
+
 static void fastboot_work_fn(struct work *_work, int ssh_stdin)
 {
 	struct fastboot_download_work *work = container_of(_work, struct fastboot_download_work, work);
-	ssize_t left;
-	int ret;
+	struct iovec iov[2 * FASTBOOT_FRAMES_MAX + 1];
+	uint8_t hdrs[FASTBOOT_FRAMES_MAX + 1][MSG_HDR_MAX];
+	size_t hdr_size = msg_hdr_size(proto_version);
+	struct fastboot_download_size announce;
+	size_t offset = work->offset;
+	size_t budget;
+	size_t left;
+	bool done = false;
+	int iovcnt = 0;
+	int i;
+	ssize_t ret;
+
+	if (download_park(_work, work->size - offset + 3 * hdr_size +
+				 sizeof(announce)))
+		return;
+
+	budget = download_budget(fastboot_pipe_space(ssh_stdin));
+
+	if (!work->announced) {
+		announce.size = work->size;
+
+		iov[iovcnt].iov_base = hdrs[FASTBOOT_FRAMES_MAX];
+		iov[iovcnt++].iov_len = msg_hdr_encode(proto_version, hdrs[FASTBOOT_FRAMES_MAX],
+						       MSG_FASTBOOT_DOWNLOAD_SIZE,
+						       sizeof(announce));
+		iov[iovcnt].iov_base = &announce;
+		iov[iovcnt++].iov_len = sizeof(announce);
+
+		budget -= MIN(budget, hdr_size + sizeof(announce));
+	}
+
+	/*
+	 * Pack as many header and payload pairs as fits in the pipe into a
+	 * single writev(), the last one being the zero length terminator.
+	 */
+	for (i = 0; i < FASTBOOT_FRAMES_MAX && budget > hdr_size; i++) {
+		left = MIN(budget - hdr_size, proto_max_len);
+		left = MIN(left, work->size - offset);
+
+		iov[iovcnt].iov_base = hdrs[i];
+		iov[iovcnt++].iov_len = msg_hdr_encode(proto_version, hdrs[i],
+						       MSG_FASTBOOT_DOWNLOAD, left);
+		if (left) {
+			iov[iovcnt].iov_base = (char *)work->data + offset;
+			iov[iovcnt++].iov_len = left;
+		}
 
-	left = MIN(2048, work->size - work->offset);
+		offset += left;
+		budget -= hdr_size + left;
 
-	ret = cdba_send_buf(ssh_stdin, MSG_FASTBOOT_DOWNLOAD,
-			    left,
-			    (char *)work->data + work->offset);
+		/* We've queued the entire image, and a zero length packet */
+		if (!left) {
+			done = true;
+			break;
+		}
+	}
+
+	ret = cdba_writev(ssh_stdin, iov, iovcnt);
 	if (ret < 0 && errno == EAGAIN) {
 		list_add(&work_items, &_work->node);
 		return;
@@ -393,36 +791,579 @@ static void fastboot_work_fn(struct work *_work, int ssh_stdin)
 		err(1, "failed to write fastboot message");
 	}
 
-	work->offset += left;
+	download_sent(ret);
 
-	/* We've sent the entire image, and a zero length packet */
-	if (!left)
-		free(work);
+	work->announced = true;
+	work->offset = offset;
+
+	if (done)
+		fastboot_work_free(work);
 	else
 		list_add(&work_items, &_work->node);
 }
 
-static void request_fastboot_files(void)
+static void fastboot_compressed_fn(struct work *_work, int ssh_stdin)
+{
+	struct fastboot_download_work *work = container_of(_work, struct fastboot_download_work, work);
+	struct iovec iov[2 * FASTBOOT_FRAMES_MAX + 2];
+	uint8_t hdrs[FASTBOOT_FRAMES_MAX + 1][MSG_HDR_MAX];
+	size_t hdr_size = msg_hdr_size(proto_version);
+	struct fastboot_download_size announce;
+	size_t zoff;
+	size_t consumed;
+	size_t budget;
+	size_t left;
+	bool done = false;
+	int iovcnt = 0;
+	int i;
+	ssize_t ret;
+
+	if (download_park(_work, work->zdone ? work->zlen - work->zoff +
+						3 * hdr_size + sizeof(announce) :
+						SIZE_MAX))
+		return;
+
+	/* Compress the next part of the image once the previous is sent */
+	if (work->zoff == work->zlen && !work->zdone) {
+		work->zlen = compress_stream(work->compressor,
+					     (char *)work->data + work->offset,
+					     work->size - work->offset, &consumed,
+					     work->zbuf, FASTBOOT_ZBUF_SIZE,
+					     &work->zdone);
+		work->offset += consumed;
+		work->zoff = 0;
+	}
+
+	zoff = work->zoff;
+	budget = download_budget(fastboot_pipe_space(ssh_stdin));
+
+	if (!work->announced) {
+		announce.size = work->size;
+
+		iov[iovcnt].iov_base = hdrs[FASTBOOT_FRAMES_MAX];
+		iov[iovcnt++].iov_len = msg_hdr_encode(proto_version, hdrs[FASTBOOT_FRAMES_MAX],
+						       MSG_FASTBOOT_DOWNLOAD_SIZE,
+						       sizeof(announce));
+		iov[iovcnt].iov_base = &announce;
+		iov[iovcnt++].iov_len = sizeof(announce);
+
+		budget -= MIN(budget, hdr_size + sizeof(announce));
+	}
+
+	for (i = 0; i < FASTBOOT_FRAMES_MAX && budget > hdr_size; i++) {
+		left = MIN(budget - hdr_size, proto_max_len);
+		left = MIN(left, work->zlen - zoff);
+
+		/* Wait for more compressed data, rather than terminating */
+		if (!left && !work->zdone)
+			break;
+
+		iov[iovcnt].iov_base = hdrs[i];
+		iov[iovcnt++].iov_len = msg_hdr_encode(proto_version, hdrs[i],
+						       MSG_FASTBOOT_COMPRESSED, left);
+		if (left) {
+			iov[iovcnt].iov_base = (char *)work->zbuf + zoff;
+			iov[iovcnt++].iov_len = left;
+		}
+
+		zoff += left;
+		budget -= hdr_size + left;
+
+		if (!left) {
+			done = true;
+			break;
+		}
+	}
+
+	if (iovcnt) {
+		ret = cdba_writev(ssh_stdin, iov, iovcnt);
+		if (ret < 0 && errno == EAGAIN) {
+			list_add(&work_items, &_work->node);
+			return;
+		} else if (ret < 0) {
+			err(1, "failed to write fastboot message");
+		}
+
+		download_sent(ret);
+	}
+
+	work->announced = true;
+	work->zoff = zoff;
+
+	if (done)
+		fastboot_work_free(work);
+	else
+		list_add(&work_items, &_work->node);
+}
+
+static void fastboot_delta_fn(struct work *_work, int ssh_stdin)
+{
+	struct fastboot_download_work *work = container_of(_work, struct fastboot_download_work, work);
+	struct fastboot_delta_copy copies[FASTBOOT_FRAMES_MAX];
+	static const uint8_t literal_op = FASTBOOT_DELTA_LITERAL;
+	struct iovec iov[3 * FASTBOOT_FRAMES_MAX];
+	uint8_t hdrs[FASTBOOT_FRAMES_MAX][MSG_HDR_MAX];
+	size_t hdr_size = msg_hdr_size(proto_version);
+	size_t op_offset = work->op_offset;
+	size_t op_idx = work->op;
+	struct delta_op *op;
+	size_t budget;
+	size_t left;
+	size_t len;
+	bool done = false;
+	int iovcnt = 0;
+	int hdr_iov;
+	int i;
+	ssize_t ret;
+
+	if (download_park(_work, op_idx == work->nops ? hdr_size : SIZE_MAX))
+		return;
+
+	budget = download_budget(fastboot_pipe_space(ssh_stdin));
+
+	for (i = 0; i < FASTBOOT_FRAMES_MAX &&
+		    budget > hdr_size + (op_idx < work->nops ? sizeof(copies[0]) : 0); i++) {
+		hdr_iov = iovcnt++;
+		iov[hdr_iov].iov_base = hdrs[i];
+
+		if (op_idx == work->nops) {
+			iov[hdr_iov].iov_len = msg_hdr_encode(proto_version, hdrs[i],
+							      MSG_FASTBOOT_DELTA, 0);
+			done = true;
+			break;
+		}
+
+		op = &work->ops[op_idx];
+		if (op->op == FASTBOOT_DELTA_COPY) {
+			copies[i].op = FASTBOOT_DELTA_COPY;
+			copies[i].block = op->offset;
+			copies[i].count = op->len;
+
+			len = sizeof(copies[i]);
+			iov[iovcnt].iov_base = &copies[i];
+			iov[iovcnt++].iov_len = sizeof(copies[i]);
+
+			op_idx++;
+		} else {
+			left = MIN(budget - hdr_size - 1, proto_max_len - 1);
+			left = MIN(left, op->len - op_offset);
+
+			len = 1 + left;
+			iov[iovcnt].iov_base = (void *)&literal_op;
+			iov[iovcnt++].iov_len = 1;
+			iov[iovcnt].iov_base = (char *)work->data + op->offset + op_offset;
+			iov[iovcnt++].iov_len = left;
+
+			op_offset += left;
+			if (op_offset == op->len) {
+				op_offset = 0;
+				op_idx++;
+			}
+		}
+
+		iov[hdr_iov].iov_len = msg_hdr_encode(proto_version, hdrs[i],
+						      MSG_FASTBOOT_DELTA, len);
+		budget -= hdr_size + len;
+	}
+
+	ret = cdba_writev(ssh_stdin, iov, iovcnt);
+	if (ret < 0 && errno == EAGAIN) {
+		list_add(&work_items, &_work->node);
+		return;
+	} else if (ret < 0) {
+		err(1, "failed to write fastboot message");
+	}
+
+	download_sent(ret);
+
+	work->op = op_idx;
+	work->op_offset = op_offset;
+
+	if (done)
+		fastboot_work_free(work);
+	else
+		list_add(&work_items, &_work->node);
+}
+
+static void fastboot_digest_fn(struct work *work, int ssh_stdin)
+{
+	int ret;
+
+	ret = cdba_send_buf(ssh_stdin, MSG_FASTBOOT_DIGEST,
+			    sizeof(fastboot_digest), &fastboot_digest);
+	if (ret < 0)
+		err(1, "failed to send fastboot image digest");
+}
+
+/* Hash the image, unless it's unchanged since the last time it was sent */
+static void fastboot_digest_update(struct fastboot_download_work *work, struct stat *sb)
+{
+	static struct stat digest_sb;
+	struct sha256_ctx ctx;
+
+	if (digest_sb.st_ino == sb->st_ino && digest_sb.st_dev == sb->st_dev &&
+	    digest_sb.st_size == sb->st_size &&
+	    digest_sb.st_mtim.tv_sec == sb->st_mtim.tv_sec &&
+	    digest_sb.st_mtim.tv_nsec == sb->st_mtim.tv_nsec)
+		return;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, work->data, work->size);
+	sha256_final(&ctx, fastboot_digest.sha256);
+	fastboot_digest.size = work->size;
+
+	digest_sb = *sb;
+}
+
+/* Map the image file, for it to be uploaded */
+static struct fastboot_download_work *fastboot_work_open(const char *file, struct stat *sb)
 {
 	struct fastboot_download_work *work;
-	struct stat sb;
 	int fd;
 
 	work = calloc(1, sizeof(*work));
 	work->work.fn = fastboot_work_fn;
 
-	fd = open(fastboot_file, O_RDONLY);
+	fd = open(file, O_RDONLY);
 	if (fd < 0)
-		err(1, "failed to open \"%s\"", fastboot_file);
+		err(1, "failed to open \"%s\"", file);
 
-	fstat(fd, &sb);
+	if (fstat(fd, sb) < 0)
+		err(1, "failed to stat \"%s\"", file);
 
-	work->size = sb.st_size;
-	work->data = malloc(work->size);
-	read(fd, work->data, work->size);
+	work->size = sb->st_size;
+	if (work->size) {
+		work->data = mmap(NULL, work->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (work->data == MAP_FAILED)
+			err(1, "failed to map \"%s\"", file);
+
+		madvise(work->data, work->size, MADV_SEQUENTIAL);
+	}
 	close(fd);
 
+	return work;
+}
+
+static void request_fastboot_files(void)
+{
+	static struct work digest_work = { fastboot_digest_fn };
+	struct fastboot_download_work *work;
+	struct stat sb;
+
+	work = fastboot_work_open(fastboot_file, &sb);
+
+	fastboot_digest_update(work, &sb);
+
+	/* Upload the image only if the server doesn't have it already */
+	if (fastboot_pending)
+		fastboot_work_free(fastboot_pending);
+	fastboot_pending = work;
+
+	list_add(&work_items, &digest_work.node);
+}
+
+static void fastboot_signatures_fn(struct work *work, int ssh_stdin)
+{
+	int ret;
+
+	ret = cdba_send(ssh_stdin, MSG_FASTBOOT_SIGNATURES);
+	if (ret < 0)
+		err(1, "failed to request fastboot image signatures");
+}
+
+static void handle_fastboot_digest(const void *data, size_t len)
+{
+	static struct work signatures_work = { fastboot_signatures_fn };
+	const uint8_t *hit = data;
+
+	if (!fastboot_pending)
+		return;
+
+	if (len && *hit) {
+		fastboot_work_free(fastboot_pending);
+		fastboot_pending = NULL;
+		return;
+	}
+
+	/* Ask for the server's previous image, to upload only the changes */
+	fastboot_sig_header.block_size = 0;
+	fastboot_nsigs = 0;
+
+	list_add(&work_items, &signatures_work.node);
+}
+
+/* Upload the changes, unless too little of the image is already known */
+static bool fastboot_delta_prepare(struct fastboot_download_work *work)
+{
+	size_t matched;
+
+	if (!fastboot_nsigs)
+		return false;
+
+	work->nops = delta_compute(work->data, work->size, fastboot_sigs,
+				   fastboot_nsigs, fastboot_sig_header.block_size,
+				   &work->ops, &matched);
+	if (matched < work->size / 8) {
+		free(work->ops);
+		work->ops = NULL;
+		return false;
+	}
+
+	work->work.fn = fastboot_delta_fn;
+
+	return true;
+}
+
+static void fastboot_compress_prepare(struct fastboot_download_work *work)
+{
+	if (fastboot_codec == FASTBOOT_CODEC_NONE || !work->size)
+		return;
+
+	work->compressor = compress_init(fastboot_codec);
+	if (!work->compressor)
+		return;
+
+	work->zbuf = malloc(FASTBOOT_ZBUF_SIZE);
+	work->work.fn = fastboot_compressed_fn;
+}
+
+static void fastboot_upload_prepare(struct fastboot_download_work *work)
+{
+	if (!fastboot_delta_prepare(work))
+		fastboot_compress_prepare(work);
+}
+
+static void handle_fastboot_signatures(const void *data, size_t len)
+{
+	size_t count;
+
+	if (!fastboot_pending)
+		return;
+
+	if (!len) {
+		fastboot_upload_prepare(fastboot_pending);
+		list_add(&work_items, &fastboot_pending->work.node);
+		fastboot_pending = NULL;
+		return;
+	}
+
+	if (!fastboot_sig_header.block_size) {
+		if (len == sizeof(fastboot_sig_header))
+			memcpy(&fastboot_sig_header, data, len);
+		return;
+	}
+
+	count = len / sizeof(*fastboot_sigs);
+	fastboot_sigs = realloc(fastboot_sigs, (fastboot_nsigs + count) * sizeof(*fastboot_sigs));
+	memcpy(&fastboot_sigs[fastboot_nsigs], data, count * sizeof(*fastboot_sigs));
+	fastboot_nsigs += count;
+}
+
+/*
+ * A flash manifest lists partitions to flash, followed by the action to take
+ * once they are all flashed. The next image is uploaded while the previous
+ * one is being flashed.
+ */
+struct flash_entry {
+	char *partition;
+	char *file;
+
+	struct list_head node;
+};
+
+enum {
+	FLASH_THEN_REBOOT,
+	FLASH_THEN_CONTINUE,
+	FLASH_THEN_BOOT,
+};
+
+static const char *fastboot_manifest;
+static struct list_head flash_entries = LIST_INIT(flash_entries);
+static struct flash_entry *flash_sent;
+static struct flash_entry *flash_flashed;
+static int flash_action = FLASH_THEN_REBOOT;
+static bool flash_action_set;
+static bool flash_failed;
+
+static void check_image(const char *file)
+{
+	struct stat sb;
+
+	if (lstat(file, &sb))
+		err(1, "unable to read \"%s\"", file);
+	else if (!S_ISREG(sb.st_mode) && !S_ISLNK(sb.st_mode))
+		errx(1, "\"%s\" is not a regular file", file);
+}
+
+static void flash_manifest_load(const char *path)
+{
+	struct flash_entry *entry;
+	char *args[3];
+	size_t size = 0;
+	char *line = NULL;
+	int lineno = 0;
+	char *cmd;
+	FILE *fp;
+	int n;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		err(1, "failed to open manifest \"%s\"", path);
+
+	while (getline(&line, &size, fp) >= 0) {
+		lineno++;
+
+		cmd = strtok(line, " \t\n");
+		if (!cmd || cmd[0] == '#')
+			continue;
+
+		for (n = 0; n < 3; n++) {
+			args[n] = strtok(NULL, " \t\n");
+			if (!args[n])
+				break;
+		}
+
+		if (flash_action_set)
+			errx(1, "%s:%d: entry following the final action", path, lineno);
+
+		if (!strcmp(cmd, "flash") && n == 2) {
+			check_image(args[1]);
+
+			entry = calloc(1, sizeof(*entry));
+			entry->partition = strdup(args[0]);
+			entry->file = strdup(args[1]);
+			list_add(&flash_entries, &entry->node);
+		} else if (!strcmp(cmd, "boot") && n == 1) {
+			check_image(args[0]);
+
+			fastboot_file = strdup(args[0]);
+			flash_action = FLASH_THEN_BOOT;
+			flash_action_set = true;
+		} else if (!strcmp(cmd, "continue") && n == 0) {
+			flash_action = FLASH_THEN_CONTINUE;
+			flash_action_set = true;
+		} else if (!strcmp(cmd, "reboot") && n == 0) {
+			flash_action = FLASH_THEN_REBOOT;
+			flash_action_set = true;
+		} else {
+			errx(1, "%s:%d: invalid manifest entry", path, lineno);
+		}
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+struct flash_request {
+	struct work work;
+
+	const char *partition;
+};
+
+static void flash_partition_fn(struct work *work, int ssh_stdin)
+{
+	struct flash_request *flash = container_of(work, struct flash_request, work);
+	int ret;
+
+	ret = cdba_send_buf(ssh_stdin, MSG_FASTBOOT_FLASH,
+			    strlen(flash->partition) + 1, flash->partition);
+	if (ret < 0)
+		err(1, "failed to send fastboot flash request");
+
+	free(work);
+}
+
+static void fastboot_reboot_fn(struct work *work, int ssh_stdin)
+{
+	int ret;
+
+	ret = cdba_send(ssh_stdin, MSG_FASTBOOT_REBOOT);
+	if (ret < 0)
+		err(1, "failed to send fastboot reboot request");
+}
+
+static struct flash_entry *flash_entry_next(struct flash_entry *entry)
+{
+	if (entry->node.next == &flash_entries)
+		return NULL;
+
+	return list_entry_next(entry, node);
+}
+
+/* Announce the partition and upload the image of the next entry */
+static void flash_send_next(void)
+{
+	struct fastboot_download_work *work;
+	struct flash_request *flash;
+	struct stat sb;
+
+	if (!flash_sent)
+		return;
+
+	flash = malloc(sizeof(*flash));
+	flash->work.fn = flash_partition_fn;
+	flash->partition = flash_sent->partition;
+	list_add(&work_items, &flash->work.node);
+
+	work = fastboot_work_open(flash_sent->file, &sb);
+	fastboot_compress_prepare(work);
 	list_add(&work_items, &work->work.node);
+
+	flash_sent = flash_entry_next(flash_sent);
+}
+
+static void flash_finish(void)
+{
+	static struct work reboot_work = { fastboot_reboot_fn };
+
+	switch (flash_action) {
+	case FLASH_THEN_BOOT:
+		request_fastboot_files();
+		break;
+	case FLASH_THEN_CONTINUE:
+		request_fastboot_continue();
+		break;
+	case FLASH_THEN_REBOOT:
+		list_add(&work_items, &reboot_work.node);
+		break;
+	}
+}
+
+static void flash_start(void)
+{
+	if (list_empty(&flash_entries)) {
+		flash_finish();
+		return;
+	}
+
+	flash_sent = list_entry_first(&flash_entries, struct flash_entry, node);
+	flash_flashed = flash_sent;
+
+	flash_send_next();
+}
+
+static void handle_fastboot_flash(const void *data, size_t len)
+{
+	const struct fastboot_flash_status *status = data;
+
+	if (len != sizeof(*status) || !flash_flashed)
+		return;
+
+	if (status->state == FASTBOOT_FLASH_QUEUED) {
+		flash_send_next();
+		return;
+	}
+
+	if (status->result) {
+		warnx("failed to flash %s", flash_flashed->partition);
+		flash_failed = true;
+		quit = true;
+		return;
+	}
+
+	flash_flashed = flash_entry_next(flash_flashed);
+	if (!flash_flashed)
+		flash_finish();
 }
 
 static void handle_status_update(const void *data, size_t len)
@@ -519,30 +1460,56 @@ static bool auto_power_on;
 
 static int handle_message(struct circ_buf *buf)
 {
-	struct msg *msg;
-	struct msg hdr;
-	size_t n;
+	struct msg_frame msg;
+	size_t board_len;
+	ssize_t size;
 
+	/* Messages are dispatched in place, as they're contiguous in the ring */
 	for (;;) {
-		n = circ_peak(buf, &hdr, sizeof(hdr));
-		if (n != sizeof(hdr))
-			return 0;
-
-		if (CIRC_AVAIL(buf) < sizeof(*msg) + hdr.len)
+		size = msg_frame_parse(proto_version, proto_max_len,
+				       circ_data(buf), CIRC_AVAIL(buf), &msg);
+		if (size < 0) {
+			warnx("message of %zu bytes from server exceeds limit of %zu",
+			      msg.len, proto_max_len);
+			return -1;
+		} else if (!size) {
 			return 0;
+		}
 
-		// fprintf(stderr, "avail: %zd hdr.len: %d\n", CIRC_AVAIL(buf), hdr.len);
+		// fprintf(stderr, "avail: %zu msg.len: %zu\n", CIRC_AVAIL(buf), msg.len);
 
-		msg = malloc(sizeof(*msg) + hdr.len);
-		circ_read(buf, msg, sizeof(*msg) + hdr.len);
+		/* Only the board of the session is carried on channel 0 so far */
+		if (msg.channel) {
+			circ_consume(buf, size);
+			continue;
+		}
 
-		switch (msg->type) {
+		switch (msg.type) {
+		case MSG_HELLO:
+			handle_hello(msg.data, msg.len);
+			break;
 		case MSG_SELECT_BOARD:
 			// printf("======================================== MSG_SELECT_BOARD\n");
+			if (msg.len)
+				fastboot_codec = msg.data[0];
+			request_power_on();
+			break;
+		case MSG_SELECT_POOL:
+			if (!msg.len)
+				break;
+
+			board_len = strnlen((const char *)msg.data, msg.len);
+			if (board_len == msg.len)
+				errx(1, "invalid pool selection reply from server");
+
+			fprintf(stderr, "selected board %.*s\n",
+				(int)board_len, msg.data);
+			if (msg.len > board_len + 1)
+				fastboot_codec = msg.data[board_len + 1];
 			request_power_on();
 			break;
 		case MSG_CONSOLE:
-			handle_console(msg->data, msg->len);
+			handle_console(msg.data, msg.len);
 			break;
 		case MSG_HARDRESET:
 			break;
@@ -557,9 +1524,11 @@ static int handle_message(struct circ_buf *buf)
 			}
 			break;
 		case MSG_FASTBOOT_PRESENT:
-			if (*(uint8_t*)msg->data) {
+			if (*msg.data) {
 				// printf("======================================== MSG_FASTBOOT_PRESENT(on)\n");
-				if (fastboot_continue) {
+				if (fastboot_manifest && (!fastboot_done || fastboot_repeat)) {
+					flash_start();
+				} else if (fastboot_continue) {
 					request_fastboot_continue();
 					fastboot_continue = false;
 				} else if (!fastboot_done || fastboot_repeat) {
@@ -577,25 +1546,41 @@ static int handle_message(struct circ_buf *buf)
 			// printf("======================================== MSG_FASTBOOT_BOOT\n");
 			break;
 		case MSG_STATUS_UPDATE:
-			handle_status_update(msg->data, msg->len);
+			handle_status_update(msg.data, msg.len);
 			break;
 		case MSG_LIST_DEVICES:
-			handle_list_devices(msg->data, msg->len);
+			handle_list_devices(msg.data, msg.len);
 			break;
 		case MSG_BOARD_INFO:
-			handle_board_info(msg->data, msg->len);
+			handle_board_info(msg.data, msg.len);
 			return -1;
 			break;
 		case MSG_FASTBOOT_CONTINUE:
 			// printf("======================================== MSG_FASTBOOT_CONTINUE\n");
 			fastboot_done = true;
 			break;
+		case MSG_FASTBOOT_DIGEST:
+			handle_fastboot_digest(msg.data, msg.len);
+			break;
+		case MSG_FASTBOOT_SIGNATURES:
+			handle_fastboot_signatures(msg.data, msg.len);
+			break;
+		case MSG_FASTBOOT_FLASH:
+			handle_fastboot_flash(msg.data, msg.len);
+			break;
+		case MSG_FASTBOOT_REBOOT:
+			fastboot_done = true;
+			break;
+		case MSG_CREDIT:
+			handle_credit(msg.data, msg.len);
+			break;
 		default:
-			fprintf(stderr, "unk %d len %d\n", msg->type, msg->len);
-			return -1;
+			fprintf(stderr, "unk %d len %zu\n", msg.type, msg.len);
+			break;
 		}
 
-		free(msg);
+		credit_return(&msg, size);
+		circ_consume(buf, size);
 	}
 
 	return 0;
@@ -617,8 +1602,11 @@ static void usage(void)
 {
 	extern const char *__progname;
 
-	fprintf(stderr, "usage: %s -b <board> [-h <host>] [-t <timeout>] "
-			"[-T <inactivity-timeout>] [boot.img]\n",
+	fprintf(stderr, "usage: %s -b <board> | -p <pool> [-h <host>] [-t <timeout>] "
+			"[-T <inactivity-timeout>] [-z] [boot.img]\n",
+			__progname);
+	fprintf(stderr, "usage: %s -b <board> | -p <pool> -m <manifest> [-h <host>] [-t <timeout>] "
+			"[-T <inactivity-timeout>] [-z]\n",
 			__progname);
 	fprintf(stderr, "usage: %s -i -b <board> [-h <host>]\n",
 			__progname);
@@ -648,10 +1636,10 @@ int main(int argc, char **argv)
 	struct work *work;
 	struct circ_buf recv_buf = { };
 	const char *board = NULL;
+	const char *pool = NULL;
 	const char *host = NULL;
 	struct timeval now;
 	struct timeval tv;
-	struct stat sb;
 	int ssh_fds[3];
 	char buf[128];
 	fd_set rfds;
@@ -662,7 +1650,7 @@ int main(int argc, char **argv)
 	int opt;
 	int ret;
 
-	while ((opt = getopt(argc, argv, "b:c:C:h:ilRt:S:s:T:")) != -1) {
+	while ((opt = getopt(argc, argv, "b:c:C:h:ilm:p:Rt:S:s:T:z")) != -1) {
 		switch (opt) {
 		case 'b':
 			board = optarg;
@@ -682,6 +1670,12 @@ int main(int argc, char **argv)
 		case 'l':
 			verb = CDBA_LIST;
 			break;
+		case 'm':
+			fastboot_manifest = optarg;
+			break;
+		case 'p':
+			pool = optarg;
+			break;
 		case 'R':
 			fastboot_repeat = true;
 			break;
@@ -697,25 +1691,38 @@ int main(int argc, char **argv)
 		case 'T':
 			timeout_inactivity = atoi(optarg);
 			break;
+		case 'z':
+			fastboot_compress = true;
+			break;
 		default:
 			usage();
 		}
 	}
 
+	request_hello();
+
 	switch (verb) {
 	case CDBA_BOOT:
-		if (optind > argc || !board)
+		if (optind > argc || !board == !pool)
 			usage();
 
-		fastboot_file = argv[optind];
-		if (!fastboot_file)
-			fastboot_continue = true;
-		else if (lstat(fastboot_file, &sb))
-			err(1, "unable to read \"%s\"", fastboot_file);
-		else if (!S_ISREG(sb.st_mode) && !S_ISLNK(sb.st_mode))
-			errx(1, "\"%s\" is not a regular file", fastboot_file);
+		if (fastboot_manifest) {
+			if (argv[optind])
+				usage();
 
-		request_select_board(board);
+			flash_manifest_load(fastboot_manifest);
+		} else {
+			fastboot_file = argv[optind];
+			if (!fastboot_file)
+				fastboot_continue = true;
+			else
+				check_image(fastboot_file);
+		}
+
+		if (pool)
+			request_select_board(MSG_SELECT_POOL, pool);
+		else
+			request_select_board(MSG_SELECT_BOARD, board);
 		break;
 	case CDBA_LIST:
 		request_board_list();
@@ -768,14 +1775,15 @@ int main(int argc, char **argv)
 		FD_SET(ssh_fds[2], &rfds);
 		nfds = MAX(ssh_fds[1], ssh_fds[2]);
 
-		if (orig_tios) {
+		if (orig_tios && !hello_pending && list_empty(&tty_queue)) {
 			FD_SET(STDIN_FILENO, &rfds);
 
 			nfds = MAX(nfds, STDIN_FILENO);
 		}
 
 		FD_ZERO(&wfds);
-		if (!list_empty(&work_items))
+		if ((!list_empty(&work_items) || !list_empty(&tty_queue)) &&
+		    !hello_pending)
 			FD_SET(ssh_fds[0], &wfds);
 
 		if (timeout) {
@@ -844,10 +1852,16 @@ int main(int argc, char **argv)
 		}
 
 		if (FD_ISSET(ssh_fds[0], &wfds)) {
+			/* Pending console input goes ahead of other work */
+			if (tty_queue_flush(ssh_fds[0]) < 0)
+				continue;
+
 			list_for_each_entry_safe(work, next, &work_items, node) {
 				list_del(&work->node);
 
 				work->fn(work, ssh_fds[0]);
+				if (hello_pending)
+					break;
 			}
 		}
 	}
@@ -866,5 +1880,8 @@ int main(int argc, char **argv)
 	if (reached_timeout)
 		return fastboot_done ? 110 : 2;
 
+	if (flash_failed)
+		return 1;
+
 	return (quit || received_power_off) ? 0 : 1;
 }
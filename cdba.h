@@ -1,6 +1,7 @@
 #ifndef __CDBA_H__
 #define __CDBA_H__
 
+#include <sys/types.h>
 #include <stdint.h>
 
 #define __packed __attribute__((packed))
@@ -8,12 +9,33 @@
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
+#include <stddef.h>
+#include <string.h>
+
 struct msg {
 	uint8_t type;
 	uint16_t len;
 	uint8_t data[];
 } __packed;
 
+/*
+ * Frame header of protocol version 2, used in both directions once the
+ * client has sent MSG_HELLO and the server has replied to it. The hello
+ * messages themselves are always framed as version 1.
+ */
+struct msg_v2 {
+	uint8_t type;
+	uint8_t channel;
+	uint16_t reserved;
+	uint32_t len;
+	uint8_t data[];
+} __packed;
+
+#define MSG_HDR_MAX		sizeof(struct msg_v2)
+
+/* Largest version 2 payload, must fit twice in the receive ring buffer */
+#define MSG_V2_MAX_LEN		(512 * 1024)
+
 enum {
 	MSG_SELECT_BOARD = 1,
 	MSG_CONSOLE,
@@ -32,8 +54,195 @@ enum {
 	MSG_BOARD_INFO,
 	MSG_FASTBOOT_CONTINUE,
 	MSG_KEY_PRESS,
+	MSG_FASTBOOT_DOWNLOAD_SIZE,
+	MSG_FASTBOOT_DIGEST,
+	MSG_FASTBOOT_SIGNATURES,
+	MSG_FASTBOOT_DELTA,
+	MSG_FASTBOOT_COMPRESSED,
+	MSG_FASTBOOT_FLASH,
+	MSG_CREDIT,
+	MSG_HELLO,
+	MSG_SELECT_POOL,
+};
+
+#define CDBA_PROTO_VERSION	2
+
+/* Capabilities negotiated using MSG_HELLO */
+#define CDBA_CAP_CREDITS	(1 << 0)
+#define CDBA_CAP_POOLS		(1 << 1)
+
+#define CDBA_CAPS		(CDBA_CAP_CREDITS | CDBA_CAP_POOLS)
+
+struct msg_hello {
+	uint8_t version;
+	uint32_t caps;
+	uint32_t max_len;
+} __packed;
+
+/* A received message, independent of the framing */
+struct msg_frame {
+	int type;
+	int channel;
+	size_t len;
+	const uint8_t *data;
+};
+
+static inline size_t msg_hdr_size(int version)
+{
+	return version >= 2 ? sizeof(struct msg_v2) : sizeof(struct msg);
+}
+
+/* Write the header for a message of @len bytes, returning its size */
+static inline size_t msg_hdr_encode(int version, void *hdr, int type, size_t len)
+{
+	struct msg_v2 v2 = { .type = type, .len = len };
+	struct msg v1 = { .type = type, .len = len };
+
+	if (version >= 2) {
+		memcpy(hdr, &v2, sizeof(v2));
+		return sizeof(v2);
+	}
+
+	memcpy(hdr, &v1, sizeof(v1));
+	return sizeof(v1);
+}
+
+/*
+ * Parse the message in @buf, returning its size, 0 if it's incomplete or -1 if
+ * its payload exceeds @max_len, in which case it would never fit the ring.
+ */
+static inline ssize_t msg_frame_parse(int version, size_t max_len, const void *buf,
+				      size_t avail, struct msg_frame *frame)
+{
+	const struct msg_v2 *v2 = buf;
+	const struct msg *v1 = buf;
+	size_t hdr_size = msg_hdr_size(version);
+
+	if (avail < hdr_size)
+		return 0;
+
+	if (version >= 2) {
+		frame->type = v2->type;
+		frame->channel = v2->channel;
+		frame->len = v2->len;
+		frame->data = v2->data;
+	} else {
+		frame->type = v1->type;
+		frame->channel = 0;
+		frame->len = v1->len;
+		frame->data = v1->data;
+	}
+
+	if (frame->len > max_len)
+		return -1;
+
+	if (avail - hdr_size < frame->len)
+		return 0;
+
+	return hdr_size + frame->len;
+}
+
+/* Codecs for compressed fastboot downloads, offered after MSG_SELECT_BOARD's board name */
+enum {
+	FASTBOOT_CODEC_NONE,
+	FASTBOOT_CODEC_ZSTD,
+};
+
+/*
+ * With flow control (CDBA_CAP_CREDITS) enabled, each side may only send as
+ * many bytes, message headers included, on a channel as the other side has
+ * granted. The initial window is implicitly granted, and the receiver returns
+ * credits using MSG_CREDIT as it consumes the messages.
+ */
+enum {
+	CREDIT_CHANNEL_CONSOLE,
+	CREDIT_CHANNEL_STATUS,
+	CREDIT_CHANNEL_DOWNLOAD,
+	CREDIT_CHANNEL_COUNT,
+};
+
+#define CREDIT_CONSOLE_WINDOW	(256 * 1024)
+#define CREDIT_STATUS_WINDOW	(64 * 1024)
+#define CREDIT_DOWNLOAD_WINDOW	(4 * 1024 * 1024)
+
+struct msg_credit {
+	uint8_t channel;
+	uint32_t bytes;
+} __packed;
+
+static inline int credit_channel(int type)
+{
+	switch (type) {
+	case MSG_CONSOLE:
+		return CREDIT_CHANNEL_CONSOLE;
+	case MSG_STATUS_UPDATE:
+		return CREDIT_CHANNEL_STATUS;
+	case MSG_FASTBOOT_DOWNLOAD_SIZE:
+	case MSG_FASTBOOT_DOWNLOAD:
+	case MSG_FASTBOOT_DELTA:
+	case MSG_FASTBOOT_COMPRESSED:
+		return CREDIT_CHANNEL_DOWNLOAD;
+	default:
+		return -1;
+	}
+}
+
+static inline uint32_t credit_window(int channel)
+{
+	switch (channel) {
+	case CREDIT_CHANNEL_CONSOLE:
+		return CREDIT_CONSOLE_WINDOW;
+	case CREDIT_CHANNEL_STATUS:
+		return CREDIT_STATUS_WINDOW;
+	default:
+		return CREDIT_DOWNLOAD_WINDOW;
+	}
+}
+
+struct fastboot_download_size {
+	uint64_t size;
+} __packed;
+
+#define FASTBOOT_DIGEST_SIZE	32
+
+struct fastboot_digest {
+	uint8_t sha256[FASTBOOT_DIGEST_SIZE];
+	uint64_t size;
+} __packed;
+
+struct fastboot_signature_header {
+	uint32_t block_size;
+	uint64_t size;
+} __packed;
+
+#define FASTBOOT_STRONG_SIZE	8
+
+struct fastboot_block_signature {
+	uint32_t weak;
+	uint8_t strong[FASTBOOT_STRONG_SIZE];
+} __packed;
+
+enum {
+	FASTBOOT_DELTA_COPY,
+	FASTBOOT_DELTA_LITERAL,
+};
+
+struct fastboot_delta_copy {
+	uint8_t op;
+	uint32_t block;
+	uint32_t count;
+} __packed;
+
+enum {
+	FASTBOOT_FLASH_QUEUED,
+	FASTBOOT_FLASH_DONE,
 };
 
+struct fastboot_flash_status {
+	uint8_t state;
+	uint8_t result;
+} __packed;
+
 struct key_press {
 	uint8_t key;
 	uint8_t state;
@@ -4,14 +4,49 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
-
+#define _GNU_SOURCE /* for memfd_create() */
+#include <sys/mman.h>
+#include <err.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "circ_buf.h"
 
+/*
+ * The buffer is mapped twice, back to back, so that data wrapping around
+ * the end of the buffer can be accessed contiguously, through the second
+ * mapping.
+ */
+static void circ_init(struct circ_buf *circ)
+{
+	char *base;
+	int fd;
+
+	fd = memfd_create("circ_buf", MFD_CLOEXEC);
+	if (fd < 0)
+		err(1, "failed to create circular buffer");
+
+	if (ftruncate(fd, CIRC_BUF_SIZE) < 0)
+		err(1, "failed to size circular buffer");
+
+	base = mmap(NULL, 2 * CIRC_BUF_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		err(1, "failed to reserve circular buffer");
+
+	if (mmap(base, CIRC_BUF_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(base + CIRC_BUF_SIZE, CIRC_BUF_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		err(1, "failed to map circular buffer");
+
+	close(fd);
+
+	circ->buf = base;
+}
+
 /**
  * circ_fill() - read data into circular buffer
  * @fd:		non-blocking file descriptor to read
@@ -24,8 +59,11 @@ ssize_t circ_fill(int fd, struct circ_buf *circ)
 	ssize_t space;
 	ssize_t n = 0;
 
+	if (!circ->buf)
+		circ_init(circ);
+
 	do {
-		space = CIRC_SPACE_TO_END(circ);
+		space = CIRC_SPACE(circ);
 		if (!space) {
 			errno = EAGAIN;
 			return -1;
@@ -44,35 +82,43 @@ ssize_t circ_fill(int fd, struct circ_buf *circ)
 	return 0;
 }
 
-size_t circ_peak(struct circ_buf *circ, void *buf, size_t len)
+/**
+ * circ_data() - access the buffered data in place
+ * @circ:	circ_buf object
+ *
+ * Return: pointer to the CIRC_AVAIL() bytes of buffered data, which are
+ * contiguous in memory regardless of wrapping
+ */
+void *circ_data(struct circ_buf *circ)
 {
-	size_t tail = circ->tail;
-	char *p = buf;
+	return circ->buf + circ->tail;
+}
 
-	while (len--) {
-		if (tail == circ->head)
-			return 0;
+/**
+ * circ_consume() - drop data from the buffer
+ * @circ:	circ_buf object
+ * @len:	number of bytes, at most CIRC_AVAIL()
+ */
+void circ_consume(struct circ_buf *circ, size_t len)
+{
+	circ->tail = (circ->tail + len) & (CIRC_BUF_SIZE - 1);
+}
 
-		*p++ = circ->buf[tail];
+size_t circ_peak(struct circ_buf *circ, void *buf, size_t len)
+{
+	if (!circ->buf || CIRC_AVAIL(circ) < len)
+		return 0;
 
-		tail = (tail + 1) & (CIRC_BUF_SIZE - 1);
-	}
+	memcpy(buf, circ->buf + circ->tail, len);
 
-	return p - (char *)buf;
+	return len;
 }
 
 size_t circ_read(struct circ_buf *circ, void *buf, size_t len)
 {
-	char *p = buf;
-
-	while (len--) {
-		if (circ->tail == circ->head)
-			return 0;
-
-		*p++ = circ->buf[circ->tail];
+	len = circ_peak(circ, buf, len);
 
-		circ->tail = (circ->tail + 1) & (CIRC_BUF_SIZE - 1);
-	}
+	circ_consume(circ, len);
 
-	return p - (char *)buf;
+	return len;
 }
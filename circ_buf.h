@@ -13,10 +13,14 @@
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #endif
 
-#define CIRC_BUF_SIZE 16384
+/*
+ * Must be able to hold a complete message of maximum size, and be a multiple
+ * of the page size, as the buffer is mapped twice in a row.
+ */
+#define CIRC_BUF_SIZE (1024 * 1024)
 
 struct circ_buf {
-	char buf[CIRC_BUF_SIZE];
+	char *buf;
 	size_t head;
 	size_t tail;
 };
@@ -24,9 +28,9 @@ struct circ_buf {
 #define CIRC_AVAIL(circ) (((circ)->head - (circ)->tail) & (CIRC_BUF_SIZE - 1))
 #define CIRC_SPACE(circ) (((circ)->tail - (circ)->head - 1) & (CIRC_BUF_SIZE - 1))
 
-#define CIRC_SPACE_TO_END(circ) MIN(CIRC_SPACE(circ), CIRC_BUF_SIZE - (circ)->head)
-
 ssize_t circ_fill(int fd, struct circ_buf *circ);
+void *circ_data(struct circ_buf *circ);
+void circ_consume(struct circ_buf *circ, size_t len);
 size_t circ_peak(struct circ_buf *circ, void *buf, size_t len);
 size_t circ_read(struct circ_buf *circ, void *buf, size_t len);
 
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Streaming compression of fastboot images, for uploads over slow links.
+ * The client compresses the image as it is sent and the server decompresses
+ * each received chunk right away, so neither side holds the compressed image.
+ */
+#include <err.h>
+#include <stdlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "cdba.h"
+#include "compress.h"
+
+bool compress_supported(int codec)
+{
+#ifdef HAVE_ZSTD
+	if (codec == FASTBOOT_CODEC_ZSTD)
+		return true;
+#endif
+
+	return false;
+}
+
+#ifdef HAVE_ZSTD
+
+struct compressor {
+	ZSTD_CCtx *cctx;
+};
+
+struct decompressor {
+	ZSTD_DCtx *dctx;
+	void *buf;
+	size_t buf_size;
+	size_t pending;
+};
+
+struct compressor *compress_init(int codec)
+{
+	struct compressor *c;
+
+	if (codec != FASTBOOT_CODEC_ZSTD)
+		return NULL;
+
+	c = calloc(1, sizeof(*c));
+	c->cctx = ZSTD_createCCtx();
+	if (!c->cctx)
+		errx(1, "failed to allocate zstd compression context");
+
+	return c;
+}
+
+/**
+ * compress_stream() - compress the remainder of the input
+ * @c:		compressor
+ * @in:		data not yet consumed
+ * @in_len:	length of @in
+ * @consumed:	number of bytes of @in that was consumed
+ * @out:	buffer for the compressed data
+ * @out_len:	size of @out
+ * @done:	set when all input is consumed and the stream is terminated
+ *
+ * Return: number of bytes of compressed data written to @out
+ */
+size_t compress_stream(struct compressor *c, const void *in, size_t in_len,
+		       size_t *consumed, void *out, size_t out_len, bool *done)
+{
+	ZSTD_outBuffer output = { out, out_len, 0 };
+	ZSTD_inBuffer input = { in, in_len, 0 };
+	size_t ret;
+
+	ret = ZSTD_compressStream2(c->cctx, &output, &input, ZSTD_e_end);
+	if (ZSTD_isError(ret))
+		errx(1, "failed to compress: %s", ZSTD_getErrorName(ret));
+
+	*consumed = input.pos;
+	*done = ret == 0;
+
+	return output.pos;
+}
+
+void compress_free(struct compressor *c)
+{
+	if (!c)
+		return;
+
+	ZSTD_freeCCtx(c->cctx);
+	free(c);
+}
+
+struct decompressor *decompress_init(int codec)
+{
+	struct decompressor *d;
+
+	if (codec != FASTBOOT_CODEC_ZSTD)
+		return NULL;
+
+	d = calloc(1, sizeof(*d));
+	d->dctx = ZSTD_createDCtx();
+	if (!d->dctx)
+		errx(1, "failed to allocate zstd decompression context");
+
+	d->buf_size = ZSTD_DStreamOutSize();
+	d->buf = malloc(d->buf_size);
+
+	return d;
+}
+
+/* Decompress @in, passing the decompressed data to @out in chunks */
+int decompress_stream(struct decompressor *d, const void *in, size_t len,
+		      void (*out)(const void *data, size_t len))
+{
+	ZSTD_inBuffer input = { in, len, 0 };
+	ZSTD_outBuffer output;
+	size_t ret;
+
+	do {
+		output.dst = d->buf;
+		output.size = d->buf_size;
+		output.pos = 0;
+
+		ret = ZSTD_decompressStream(d->dctx, &output, &input);
+		if (ZSTD_isError(ret)) {
+			warnx("failed to decompress: %s", ZSTD_getErrorName(ret));
+			return -1;
+		}
+
+		d->pending = ret;
+
+		if (output.pos)
+			out(output.dst, output.pos);
+	} while (input.pos < input.size || output.pos == output.size);
+
+	return 0;
+}
+
+/* All compressed frames have been completely decoded */
+bool decompress_complete(struct decompressor *d)
+{
+	return d->pending == 0;
+}
+
+void decompress_free(struct decompressor *d)
+{
+	if (!d)
+		return;
+
+	ZSTD_freeDCtx(d->dctx);
+	free(d->buf);
+	free(d);
+}
+
+#else
+
+struct compressor *compress_init(int codec)
+{
+	return NULL;
+}
+
+size_t compress_stream(struct compressor *c, const void *in, size_t in_len,
+		       size_t *consumed, void *out, size_t out_len, bool *done)
+{
+	return 0;
+}
+
+void compress_free(struct compressor *c)
+{
+}
+
+struct decompressor *decompress_init(int codec)
+{
+	return NULL;
+}
+
+int decompress_stream(struct decompressor *d, const void *in, size_t len,
+		      void (*out)(const void *data, size_t len))
+{
+	return -1;
+}
+
+bool decompress_complete(struct decompressor *d)
+{
+	return false;
+}
+
+void decompress_free(struct decompressor *d)
+{
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct compressor;
+struct decompressor;
+
+bool compress_supported(int codec);
+
+struct compressor *compress_init(int codec);
+size_t compress_stream(struct compressor *c, const void *in, size_t in_len,
+		       size_t *consumed, void *out, size_t out_len, bool *done);
+void compress_free(struct compressor *c);
+
+struct decompressor *decompress_init(int codec);
+int decompress_stream(struct decompressor *d, const void *in, size_t len,
+		      void (*out)(const void *data, size_t len));
+bool decompress_complete(struct decompressor *d);
+void decompress_free(struct decompressor *d);
+
+#endif
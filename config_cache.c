@@ -0,0 +1,1196 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Compiled form of the board configuration, stored next to the server's
+ * working directory and mapped on startup as long as the YAML it was compiled
+ * from is unchanged. It holds hash tables of the board names and of the users
+ * of each board, the class and tags of each board, the strings needed for
+ * listing the boards and the YAML text of each board, which is only parsed
+ * once the board is opened.
+ *
+ * The daemon watches the configuration and reloads it as it changes. Boards
+ * whose YAML text is unchanged are not parsed again, but carried over from the
+ * previous version of the cache.
+ *
+ * Boards whose text can't be parsed on its own, such as boards listed in flow
+ * style, are parsed from the whole configuration instead, and never carried
+ * over.
+ */
+#define _GNU_SOURCE /* for pipe2() */
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "config_cache.h"
+#include "device.h"
+#include "device_parser.h"
+#include "list.h"
+
+#define CONFIG_CACHE_PATH	".cdba.cache"
+#define CONFIG_CACHE_MAGIC	"CDBACFG"
+#define CONFIG_CACHE_VERSION	3
+
+/* The boards' YAML text can't be parsed on its own */
+#define CONFIG_CACHE_UNSPLIT	(1 << 0)
+
+struct config_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+
+	/* Identity of the YAML file the cache was compiled from */
+	uint64_t src_dev;
+	uint64_t src_ino;
+	uint64_t src_size;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+
+	uint32_t boards_off;
+	uint32_t board_count;
+	uint32_t buckets_off;
+	uint32_t bucket_count;
+	uint32_t slots_off;
+	uint32_t slot_count;
+	uint32_t strings_off;
+	uint32_t strings_len;
+
+	/* Top-level entries other than boards, as YAML text */
+	uint32_t globals;
+	uint32_t globals_len;
+
+	uint32_t flags;
+};
+
+struct config_cache_image {
+	const struct config_cache_header *hdr;
+	const struct config_cache_board *boards;
+	const uint32_t *buckets;
+	const uint32_t *slots;
+	const char *strings;
+
+	/* Boards already parsed, indexed as boards, or NULL */
+	struct device **devices;
+	bool mapped;
+};
+
+struct growbuf {
+	void *data;
+	size_t len;
+	size_t size;
+};
+
+struct config_cache_builder {
+	char *buf;
+	size_t len;
+
+	size_t *lines;
+	size_t line_count;
+
+	struct growbuf boards;
+	struct growbuf users;
+	struct growbuf tags;
+	struct growbuf strings;
+	struct growbuf globals;
+	struct growbuf devices;
+
+	/* Boards of the previous cache, hashed by their first line */
+	uint32_t *first_lines;
+	uint32_t first_line_slots;
+	const struct config_cache_board *reused;
+
+	bool persistable;
+};
+
+static struct config_cache_image cache;
+static char *config_path;
+static const char *config_name;
+
+static uint32_t hash_str(const char *str, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static uint32_t table_size(size_t count)
+{
+	uint32_t size = 2;
+
+	while (size < count * 2)
+		size <<= 1;
+
+	return size;
+}
+
+static void *growbuf_add(struct growbuf *gb, const void *data, size_t len)
+{
+	void *ptr;
+
+	if (gb->len + len > gb->size) {
+		gb->size = gb->size ? gb->size * 2 : 4096;
+		while (gb->len + len > gb->size)
+			gb->size *= 2;
+
+		gb->data = realloc(gb->data, gb->size);
+		if (!gb->data)
+			err(1, "failed to allocate config cache");
+	}
+
+	ptr = (char *)gb->data + gb->len;
+	if (data)
+		memcpy(ptr, data, len);
+	gb->len += len;
+
+	return ptr;
+}
+
+static const char *image_str(const struct config_cache_image *img, uint32_t off)
+{
+	if (!off || off >= img->hdr->strings_len)
+		return NULL;
+
+	return img->strings + off;
+}
+
+static const char *image_yaml(const struct config_cache_image *img,
+			      const struct config_cache_board *entry)
+{
+	if (entry->yaml >= img->hdr->strings_len ||
+	    entry->yaml_len > img->hdr->strings_len - entry->yaml)
+		return NULL;
+
+	return img->strings + entry->yaml;
+}
+
+static const uint32_t *image_users(const struct config_cache_image *img,
+				   const struct config_cache_board *entry)
+{
+	if (entry->users > img->hdr->slot_count ||
+	    entry->user_slots > img->hdr->slot_count - entry->users)
+		return NULL;
+
+	return &img->slots[entry->users];
+}
+
+static const uint32_t *image_tags(const struct config_cache_image *img,
+				  const struct config_cache_board *entry)
+{
+	if (entry->tags > img->hdr->slot_count ||
+	    entry->tag_count > img->hdr->slot_count - entry->tags)
+		return NULL;
+
+	return &img->slots[entry->tags];
+}
+
+static const struct config_cache_board *image_find(const struct config_cache_image *img,
+						   const char *board, size_t len)
+{
+	const struct config_cache_board *entry;
+	uint32_t mask = img->hdr->bucket_count - 1;
+	uint32_t hash = hash_str(board, len);
+	uint32_t idx;
+	uint32_t i;
+
+	for (i = 0; i < img->hdr->bucket_count; i++, hash++) {
+		idx = img->buckets[hash & mask];
+		if (!idx || idx > img->hdr->board_count)
+			return NULL;
+
+		entry = &img->boards[idx - 1];
+		if (entry->board >= img->hdr->strings_len)
+			return NULL;
+
+		if (!strncmp(img->strings + entry->board, board, len) &&
+		    img->strings[entry->board + len] == '\0')
+			return entry;
+	}
+
+	return NULL;
+}
+
+static uint32_t builder_str(struct config_cache_builder *ccb,
+			    const char *str, size_t len)
+{
+	uint32_t off = ccb->strings.len;
+
+	growbuf_add(&ccb->strings, str, len);
+	growbuf_add(&ccb->strings, "", 1);
+
+	return off;
+}
+
+static uint32_t builder_strdup(struct config_cache_builder *ccb, const char *str)
+{
+	return str ? builder_str(ccb, str, strlen(str)) : 0;
+}
+
+static void builder_user(struct config_cache_builder *ccb,
+			 struct config_cache_board *entry, const char *username)
+{
+	uint32_t off = builder_strdup(ccb, username);
+
+	growbuf_add(&ccb->users, &off, sizeof(off));
+	entry->user_slots++;
+}
+
+static void builder_tag(struct config_cache_builder *ccb,
+			struct config_cache_board *entry, const char *tag)
+{
+	uint32_t off = builder_strdup(ccb, tag);
+
+	growbuf_add(&ccb->tags, &off, sizeof(off));
+	entry->tag_count++;
+}
+
+static size_t builder_line(struct config_cache_builder *ccb, size_t line)
+{
+	return line < ccb->line_count ? ccb->lines[line] : ccb->len;
+}
+
+static size_t first_line_len(const char *text, size_t len)
+{
+	const char *nl = memchr(text, '\n', len);
+
+	return nl ? (size_t)(nl - text) : len;
+}
+
+/* Hash the boards of the current cache, to find them in the new YAML */
+static void builder_index(struct config_cache_builder *ccb)
+{
+	const struct config_cache_board *entry;
+	const char *yaml;
+	uint32_t mask;
+	uint32_t hash;
+	uint32_t i;
+
+	ccb->first_line_slots = table_size(cache.hdr->board_count);
+	ccb->first_lines = calloc(ccb->first_line_slots, sizeof(uint32_t));
+	if (!ccb->first_lines)
+		err(1, "failed to allocate config cache");
+
+	mask = ccb->first_line_slots - 1;
+	for (i = 0; i < cache.hdr->board_count; i++) {
+		entry = &cache.boards[i];
+		yaml = image_yaml(&cache, entry);
+		if (!yaml)
+			continue;
+
+		hash = hash_str(yaml, first_line_len(yaml, entry->yaml_len));
+		while (ccb->first_lines[hash & mask])
+			hash++;
+
+		ccb->first_lines[hash & mask] = i + 1;
+	}
+}
+
+static bool builder_reuse(size_t first_line, void *data)
+{
+	struct config_cache_builder *ccb = data;
+	const struct config_cache_board *entry;
+	size_t start = builder_line(ccb, first_line);
+	size_t len = builder_line(ccb, first_line + 1) - start;
+	const char *yaml;
+	uint32_t mask = ccb->first_line_slots - 1;
+	uint32_t hash;
+	uint32_t idx;
+
+	hash = hash_str(ccb->buf + start, first_line_len(ccb->buf + start, len));
+	while ((idx = ccb->first_lines[hash & mask])) {
+		entry = &cache.boards[idx - 1];
+		yaml = image_yaml(&cache, entry);
+
+		if (entry->yaml_len && entry->yaml_len <= ccb->len - start &&
+		    !memcmp(yaml, ccb->buf + start, entry->yaml_len)) {
+			ccb->reused = entry;
+			return true;
+		}
+
+		hash++;
+	}
+
+	return false;
+}
+
+static void builder_board(struct device *dev, size_t first_line,
+			  size_t end_line, void *data)
+{
+	struct config_cache_builder *ccb = data;
+	const struct config_cache_board *old = NULL;
+	struct config_cache_board *entry;
+	struct device_user *user;
+	struct device_tag *tag;
+	size_t start = builder_line(ccb, first_line);
+	size_t end = builder_line(ccb, end_line);
+	const uint32_t *users;
+	const uint32_t *tags;
+	uint32_t i;
+
+	/* The board must start its own line to be parsed on its own */
+	if (ccb->buf[start + strspn(ccb->buf + start, " \t")] != '-')
+		ccb->persistable = false;
+
+	/*
+	 * A skipped board is taken from the current cache, unless the YAML
+	 * continued past its previous text.
+	 */
+	if (!dev) {
+		old = ccb->reused;
+		if (end - start != old->yaml_len) {
+			old = NULL;
+			dev = device_parser_board(ccb->buf + start, end - start);
+			if (!dev)
+				errx(1, "failed to parse board at line %zu", first_line + 1);
+		}
+	}
+
+	entry = growbuf_add(&ccb->boards, NULL, sizeof(*entry));
+	memset(entry, 0, sizeof(*entry));
+
+	entry->yaml = builder_str(ccb, ccb->buf + start, end - start);
+	entry->yaml_len = end - start;
+
+	/* Users are collected here and hashed once all boards are known */
+	entry->users = ccb->users.len / sizeof(uint32_t);
+	entry->tags = ccb->tags.len / sizeof(uint32_t);
+
+	if (old) {
+		entry->board = builder_strdup(ccb, image_str(&cache, old->board));
+		entry->name = builder_strdup(ccb, image_str(&cache, old->name));
+		entry->description = builder_strdup(ccb, image_str(&cache, old->description));
+		entry->board_class = builder_strdup(ccb, image_str(&cache, old->board_class));
+		entry->flags = old->flags;
+
+		users = image_users(&cache, old);
+		for (i = 0; users && i < old->user_slots; i++) {
+			if (users[i])
+				builder_user(ccb, entry, image_str(&cache, users[i]));
+		}
+
+		tags = image_tags(&cache, old);
+		for (i = 0; tags && i < old->tag_count; i++)
+			builder_tag(ccb, entry, image_str(&cache, tags[i]));
+
+		dev = cache.devices ? cache.devices[old - cache.boards] : NULL;
+	} else {
+		entry->board = builder_strdup(ccb, dev->board);
+		entry->name = builder_strdup(ccb, dev->name);
+		entry->description = builder_strdup(ccb, dev->description);
+		entry->board_class = builder_strdup(ccb, dev->board_class);
+
+		if (dev->tags) {
+			list_for_each_entry(tag, dev->tags, node)
+				builder_tag(ccb, entry, tag->tag);
+		}
+
+		if (dev->users) {
+			entry->flags |= CONFIG_CACHE_RESTRICTED;
+
+			list_for_each_entry(user, dev->users, node)
+				builder_user(ccb, entry, user->username);
+		}
+	}
+
+	growbuf_add(&ccb->devices, &dev, sizeof(dev));
+}
+
+static void builder_global(size_t first_line, size_t end_line, void *data)
+{
+	struct config_cache_builder *ccb = data;
+	size_t start = builder_line(ccb, first_line);
+	size_t end = builder_line(ccb, end_line);
+
+	growbuf_add(&ccb->globals, ccb->buf + start, end - start);
+}
+
+static void *config_cache_compile(struct config_cache_builder *ccb,
+				  const struct stat *st)
+{
+	struct device_parser_layout layout = {
+		.board = builder_board,
+		.global = builder_global,
+		.data = ccb,
+	};
+	struct config_cache_board *boards;
+	struct config_cache_header *hdr;
+	const uint32_t *users;
+	const char *username;
+	uint32_t *buckets;
+	uint32_t *slots;
+	uint32_t globals;
+	uint32_t mask;
+	uint32_t hash;
+	size_t slot_count = 0;
+	size_t tags_off;
+	size_t count;
+	size_t size;
+	size_t i;
+	size_t j;
+	char *image;
+	int ret;
+
+	ccb->persistable = true;
+	builder_str(ccb, "", 0);
+
+	if (cache.hdr && !(cache.hdr->flags & CONFIG_CACHE_UNSPLIT)) {
+		builder_index(ccb);
+		layout.reuse = builder_reuse;
+	}
+
+	ret = device_parser_parse(ccb->buf, ccb->len, &layout);
+	if (ret < 0)
+		return NULL;
+
+	if (layout.flow_style)
+		ccb->persistable = false;
+
+	globals = ccb->globals.len ? builder_str(ccb, ccb->globals.data, ccb->globals.len) : 0;
+
+	count = ccb->boards.len / sizeof(*boards);
+	boards = ccb->boards.data;
+	for (i = 0; i < count; i++) {
+		if (boards[i].user_slots)
+			slot_count += table_size(boards[i].user_slots);
+	}
+
+	/* The tags of all boards follow the users' hash tables */
+	tags_off = slot_count;
+	slot_count += ccb->tags.len / sizeof(uint32_t);
+
+	size = sizeof(*hdr) + ccb->boards.len +
+	       table_size(count) * sizeof(uint32_t) +
+	       slot_count * sizeof(uint32_t) +
+	       ccb->strings.len;
+	if (size > UINT32_MAX) {
+		warnx("configuration too large to be cached");
+		return NULL;
+	}
+
+	image = calloc(1, size);
+	if (!image)
+		err(1, "failed to allocate config cache");
+
+	hdr = (struct config_cache_header *)image;
+	memcpy(hdr->magic, CONFIG_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = CONFIG_CACHE_VERSION;
+	hdr->size = size;
+	hdr->src_dev = st->st_dev;
+	hdr->src_ino = st->st_ino;
+	hdr->src_size = st->st_size;
+	hdr->src_mtime_sec = st->st_mtim.tv_sec;
+	hdr->src_mtime_nsec = st->st_mtim.tv_nsec;
+	hdr->boards_off = sizeof(*hdr);
+	hdr->board_count = count;
+	hdr->buckets_off = hdr->boards_off + ccb->boards.len;
+	hdr->bucket_count = table_size(count);
+	hdr->slots_off = hdr->buckets_off + hdr->bucket_count * sizeof(uint32_t);
+	hdr->slot_count = slot_count;
+	hdr->strings_off = hdr->slots_off + slot_count * sizeof(uint32_t);
+	hdr->strings_len = ccb->strings.len;
+	hdr->globals = globals;
+	hdr->globals_len = ccb->globals.len;
+	if (!ccb->persistable)
+		hdr->flags |= CONFIG_CACHE_UNSPLIT;
+
+	memcpy(image + hdr->strings_off, ccb->strings.data, ccb->strings.len);
+
+	/* Buckets hold the board index + 1, the first board of a name wins */
+	buckets = (uint32_t *)(image + hdr->buckets_off);
+	mask = hdr->bucket_count - 1;
+	for (i = 0; i < count; i++) {
+		const char *board = image + hdr->strings_off + boards[i].board;
+
+		hash = hash_str(board, strlen(board));
+		while (buckets[hash & mask]) {
+			const struct config_cache_board *other = &boards[buckets[hash & mask] - 1];
+
+			if (!strcmp(image + hdr->strings_off + other->board, board))
+				break;
+			hash++;
+		}
+
+		if (!buckets[hash & mask])
+			buckets[hash & mask] = i + 1;
+	}
+
+	slots = (uint32_t *)(image + hdr->slots_off);
+	users = ccb->users.data;
+	for (i = 0; i < count; i++) {
+		const uint32_t *board_users = &users[boards[i].users];
+		size_t user_count = boards[i].user_slots;
+
+		boards[i].users = slots - (uint32_t *)(image + hdr->slots_off);
+		if (!user_count)
+			continue;
+
+		boards[i].user_slots = table_size(user_count);
+		mask = boards[i].user_slots - 1;
+
+		for (j = 0; j < user_count; j++) {
+			username = image + hdr->strings_off + board_users[j];
+
+			hash = hash_str(username, strlen(username));
+			while (slots[hash & mask])
+				hash++;
+
+			slots[hash & mask] = board_users[j];
+		}
+
+		slots += boards[i].user_slots;
+	}
+
+	slots = (uint32_t *)(image + hdr->slots_off);
+	if (ccb->tags.len)
+		memcpy(&slots[tags_off], ccb->tags.data, ccb->tags.len);
+	for (i = 0; i < count; i++)
+		boards[i].tags += tags_off;
+
+	memcpy(image + hdr->boards_off, boards, ccb->boards.len);
+
+	return image;
+}
+
+static void config_cache_write(const void *image, size_t size)
+{
+	char tmp[] = CONFIG_CACHE_PATH ".XXXXXX";
+	ssize_t n;
+	int fd;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+
+	n = write(fd, image, size);
+	close(fd);
+
+	if (n != (ssize_t)size || rename(tmp, CONFIG_CACHE_PATH) < 0)
+		unlink(tmp);
+}
+
+static bool config_cache_current(const struct config_cache_header *hdr,
+				 const struct stat *src)
+{
+	return hdr->src_dev == (uint64_t)src->st_dev &&
+	       hdr->src_ino == (uint64_t)src->st_ino &&
+	       hdr->src_size == (uint64_t)src->st_size &&
+	       hdr->src_mtime_sec == src->st_mtim.tv_sec &&
+	       hdr->src_mtime_nsec == src->st_mtim.tv_nsec;
+}
+
+/* Check that the offsets and sizes of @hdr are within its @size bytes */
+static bool config_cache_valid(const struct config_cache_header *hdr, size_t size)
+{
+	if (memcmp(hdr->magic, CONFIG_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != CONFIG_CACHE_VERSION ||
+	    hdr->size != size)
+		return false;
+
+	if (hdr->boards_off > hdr->size ||
+	    hdr->board_count > (hdr->size - hdr->boards_off) / sizeof(struct config_cache_board) ||
+	    hdr->buckets_off > hdr->size ||
+	    hdr->bucket_count > (hdr->size - hdr->buckets_off) / sizeof(uint32_t) ||
+	    !hdr->bucket_count || (hdr->bucket_count & (hdr->bucket_count - 1)) ||
+	    hdr->slots_off > hdr->size ||
+	    hdr->slot_count > (hdr->size - hdr->slots_off) / sizeof(uint32_t) ||
+	    hdr->strings_off >= hdr->size ||
+	    hdr->strings_len != hdr->size - hdr->strings_off ||
+	    ((const char *)hdr)[hdr->size - 1] != '\0' ||
+	    hdr->globals >= hdr->strings_len ||
+	    hdr->globals_len > hdr->strings_len - hdr->globals)
+		return false;
+
+	return true;
+}
+
+static const void *config_cache_map(const struct stat *src)
+{
+	const struct config_cache_header *hdr;
+	struct stat st;
+	void *image;
+	int fd;
+
+	fd = open(CONFIG_CACHE_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
+
+	hdr = image;
+	if (!config_cache_valid(hdr, st.st_size) || !config_cache_current(hdr, src))
+		goto stale;
+
+	return image;
+
+stale:
+	munmap(image, st.st_size);
+	return NULL;
+}
+
+static void config_cache_use(const void *image, bool mapped,
+			     struct device **devices)
+{
+	const char *base = image;
+
+	cache.hdr = image;
+	cache.boards = (const void *)(base + cache.hdr->boards_off);
+	cache.buckets = (const void *)(base + cache.hdr->buckets_off);
+	cache.slots = (const void *)(base + cache.hdr->slots_off);
+	cache.strings = base + cache.hdr->strings_off;
+	cache.devices = devices;
+	cache.mapped = mapped;
+}
+
+static void config_cache_release(struct config_cache_image *img)
+{
+	if (img->mapped)
+		munmap((void *)img->hdr, img->hdr->size);
+	else
+		free((void *)img->hdr);
+
+	free(img->devices);
+}
+
+static void global_ignore(size_t first_line, size_t end_line, void *data)
+{
+}
+
+static void board_ignore(struct device *dev, size_t first_line,
+			 size_t end_line, void *data)
+{
+}
+
+static char *config_cache_read(const char *path, size_t *len)
+{
+	size_t size = 0;
+	char *buf = NULL;
+	size_t n;
+	FILE *fh;
+
+	fh = fopen(path, "r");
+	if (!fh)
+		return NULL;
+
+	*len = 0;
+	do {
+		if (*len + 1 >= size) {
+			size = size ? size * 2 : 65536;
+			buf = realloc(buf, size);
+			if (!buf)
+				err(1, "failed to allocate configuration buffer");
+		}
+
+		n = fread(buf + *len, 1, size - *len - 1, fh);
+		*len += n;
+	} while (n);
+
+	fclose(fh);
+
+	/* Terminate the last line, for it to be part of the last board */
+	if (*len && buf[*len - 1] != '\n')
+		buf[(*len)++] = '\n';
+
+	return buf;
+}
+
+/* Compile @path, writing the cache file if possible */
+static void *config_cache_build(const char *path, const struct stat *st,
+				struct device ***devices)
+{
+	struct config_cache_builder ccb = {};
+	void *image;
+	size_t i;
+
+	ccb.buf = config_cache_read(path, &ccb.len);
+	if (!ccb.buf)
+		return NULL;
+
+	ccb.lines = malloc((ccb.len + 1) * sizeof(*ccb.lines));
+	if (!ccb.lines)
+		err(1, "failed to allocate line table");
+
+	ccb.lines[ccb.line_count++] = 0;
+	for (i = 0; i < ccb.len; i++) {
+		if (ccb.buf[i] == '\n')
+			ccb.lines[ccb.line_count++] = i + 1;
+	}
+
+	image = config_cache_compile(&ccb, st);
+	if (!image)
+		errx(1, "failed to compile configuration %s", path);
+
+	if (ccb.persistable)
+		config_cache_write(image, ((const struct config_cache_header *)image)->size);
+
+	if (devices)
+		*devices = ccb.devices.data;
+	else
+		free(ccb.devices.data);
+
+	free(ccb.first_lines);
+	free(ccb.lines);
+	free(ccb.boards.data);
+	free(ccb.users.data);
+	free(ccb.tags.data);
+	free(ccb.strings.data);
+	free(ccb.globals.data);
+	free(ccb.buf);
+
+	return image;
+}
+
+/**
+ * config_cache_load() - load the board configuration
+ * @path:	path of the YAML formatted configuration
+ *
+ * The compiled configuration is mapped if it was compiled from the current
+ * version of @path, otherwise @path is parsed and compiled anew.
+ *
+ * Return: 0 on success, -1 if @path can't be read
+ */
+int config_cache_load(const char *path)
+{
+	struct device_parser_layout layout = {
+		.board = board_ignore,
+		.global = global_ignore,
+	};
+	struct device **devices;
+	const void *image;
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+
+	image = config_cache_map(&st);
+	if (image) {
+		config_cache_use(image, true, NULL);
+
+		if (cache.hdr->globals_len)
+			device_parser_parse(cache.strings + cache.hdr->globals,
+					    cache.hdr->globals_len, &layout);
+	} else {
+		image = config_cache_build(path, &st, &devices);
+		if (!image)
+			return -1;
+
+		config_cache_use(image, false, devices);
+	}
+
+	config_path = strdup(path);
+	config_name = strrchr(config_path, '/');
+	config_name = config_name ? config_name + 1 : config_path;
+
+	return 0;
+}
+
+static int config_cache_xfer(int fd, void *buf, size_t len, bool out)
+{
+	ssize_t n;
+
+	while (len) {
+		if (out)
+			n = write(fd, buf, len);
+		else
+			n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		buf = (char *)buf + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Compile the configuration in a child process, which exits on errors in the
+ * YAML, and have it pass the compiled image back to us. The YAML is never
+ * parsed by the daemon itself, as the parser exits on errors.
+ */
+static void *config_cache_check(const struct stat *st)
+{
+	struct config_cache_header hdr;
+	char *image = NULL;
+	pid_t pid;
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		return NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	} else if (pid == 0) {
+		close(fds[0]);
+
+		image = config_cache_build(config_path, st, NULL);
+		if (image)
+			config_cache_xfer(fds[1], image, ((struct config_cache_header *)image)->size, true);
+
+		_exit(0);
+	}
+
+	close(fds[1]);
+
+	if (config_cache_xfer(fds[0], &hdr, sizeof(hdr), false) < 0 ||
+	    hdr.size < sizeof(hdr))
+		goto out;
+
+	image = malloc(hdr.size);
+	if (!image)
+		goto out;
+
+	memcpy(image, &hdr, sizeof(hdr));
+	if (config_cache_xfer(fds[0], image + sizeof(hdr), hdr.size - sizeof(hdr), false) < 0 ||
+	    !config_cache_valid((void *)image, hdr.size) ||
+	    !config_cache_current((void *)image, st)) {
+		free(image);
+		image = NULL;
+	}
+
+out:
+	close(fds[0]);
+
+	return image;
+}
+
+/* Replace the current cache, logging how the boards differ */
+static void config_cache_replace(const void *image)
+{
+	struct config_cache_image old = cache;
+	const struct config_cache_board *prev;
+	const struct config_cache_board *entry;
+	unsigned int added = 0;
+	unsigned int removed = 0;
+	unsigned int changed = 0;
+	const char *board;
+	bool unsplit;
+	uint32_t i;
+
+	config_cache_use(image, false, NULL);
+
+	/* Boards without text of their own can't be compared */
+	unsplit = (old.hdr->flags | cache.hdr->flags) & CONFIG_CACHE_UNSPLIT;
+
+	cache.devices = calloc(cache.hdr->board_count + 1, sizeof(*cache.devices));
+	if (!cache.devices)
+		err(1, "failed to allocate config cache");
+
+	for (i = 0; i < cache.hdr->board_count; i++) {
+		entry = &cache.boards[i];
+		board = image_str(&cache, entry->board);
+
+		prev = image_find(&old, board, strlen(board));
+		if (!prev) {
+			added++;
+		} else if (unsplit || prev->yaml_len != entry->yaml_len ||
+			   memcmp(image_yaml(&old, prev), image_yaml(&cache, entry), entry->yaml_len)) {
+			changed++;
+		} else if (old.devices) {
+			/* Carried over, so it's not freed with the old cache */
+			cache.devices[i] = old.devices[prev - old.boards];
+			old.devices[prev - old.boards] = NULL;
+		}
+	}
+
+	for (i = 0; old.devices && i < old.hdr->board_count; i++) {
+		if (old.devices[i])
+			device_free(old.devices[i]);
+	}
+
+	for (i = 0; i < old.hdr->board_count; i++) {
+		board = image_str(&old, old.boards[i].board);
+		if (!image_find(&cache, board, strlen(board)))
+			removed++;
+	}
+
+	if (old.hdr->globals_len != cache.hdr->globals_len ||
+	    memcmp(old.strings + old.hdr->globals,
+		   cache.strings + cache.hdr->globals, cache.hdr->globals_len))
+		syslog(LOG_WARNING, "top-level options of %s changed, restart to apply them",
+		       config_path);
+
+	syslog(LOG_INFO, "reloaded %s: %u boards added, %u changed, %u removed",
+	       config_path, added, changed, removed);
+
+	config_cache_release(&old);
+}
+
+/**
+ * config_cache_watch() - watch the configuration for changes
+ *
+ * Return: inotify file descriptor to pass to config_cache_reload() as it
+ * becomes readable, or -1 on failure
+ */
+int config_cache_watch(void)
+{
+	char dir[PATH_MAX];
+	int fd;
+
+	/* Watch the directory, to see the file being replaced by renames */
+	if (config_name == config_path)
+		strcpy(dir, ".");
+	else if (config_name - config_path == 1)
+		strcpy(dir, "/");
+	else
+		snprintf(dir, sizeof(dir), "%.*s",
+			 (int)(config_name - config_path - 1), config_path);
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * config_cache_reload() - reload the configuration if it has changed
+ * @fd:		inotify file descriptor returned by config_cache_watch()
+ *
+ * The new configuration is validated before it replaces the current one, so
+ * errors in it leave the current configuration in place. Boards whose YAML
+ * text is unchanged keep their parsed configuration.
+ */
+void config_cache_reload(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	bool changed = false;
+	void *image;
+	struct stat st;
+	ssize_t n;
+	char *ptr;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + n; ptr += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+
+			if (event->len && !strcmp(event->name, config_name))
+				changed = true;
+		}
+	}
+
+	if (!changed)
+		return;
+
+	if (stat(config_path, &st) < 0) {
+		syslog(LOG_WARNING, "failed to stat %s: %m", config_path);
+		return;
+	}
+
+	if (config_cache_current(cache.hdr, &st))
+		return;
+
+	image = config_cache_check(&st);
+	if (!image) {
+		syslog(LOG_ERR, "failed to load %s, keeping the current configuration",
+		       config_path);
+		return;
+	}
+
+	config_cache_replace(image);
+}
+
+/**
+ * config_cache_find() - look up a board by name
+ * @board:	name of the board, not necessarily NUL terminated
+ * @len:	length of @board
+ *
+ * Return: the board, or NULL if no board by that name exists
+ */
+const struct config_cache_board *config_cache_find(const char *board, size_t len)
+{
+	return image_find(&cache, board, len);
+}
+
+/**
+ * config_cache_board() - iterate over the boards
+ * @idx:	index of the board, in the order of the configuration
+ *
+ * Return: the board, or NULL past the last board
+ */
+const struct config_cache_board *config_cache_board(unsigned int idx)
+{
+	if (idx >= cache.hdr->board_count)
+		return NULL;
+
+	return &cache.boards[idx];
+}
+
+/**
+ * config_cache_str() - resolve a string of the compiled configuration
+ * @off:	offset of the string
+ *
+ * Return: the string, or NULL for the empty string
+ */
+const char *config_cache_str(uint32_t off)
+{
+	return image_str(&cache, off);
+}
+
+/**
+ * config_cache_access() - check if a user may use a board
+ * @entry:	the board
+ * @username:	the user, or NULL if unknown
+ *
+ * Return: true if @username is permitted to use the board
+ */
+bool config_cache_access(const struct config_cache_board *entry,
+			 const char *username)
+{
+	const uint32_t *slots;
+	uint32_t mask;
+	uint32_t hash;
+	uint32_t i;
+
+	if (!(entry->flags & CONFIG_CACHE_RESTRICTED))
+		return true;
+
+	slots = image_users(&cache, entry);
+	if (!username || !slots || !entry->user_slots)
+		return false;
+
+	mask = entry->user_slots - 1;
+	hash = hash_str(username, strlen(username));
+
+	for (i = 0; i < entry->user_slots; i++, hash++) {
+		if (!slots[hash & mask] || slots[hash & mask] >= cache.hdr->strings_len)
+			return false;
+
+		if (!strcmp(cache.strings + slots[hash & mask], username))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * config_cache_in_pool() - check if a board belongs to a pool
+ * @entry:	the board
+ * @pool:	class or tag of the pool
+ *
+ * Return: true if the board's class or one of its tags is @pool
+ */
+bool config_cache_in_pool(const struct config_cache_board *entry,
+			  const char *pool)
+{
+	const uint32_t *tags;
+	const char *str;
+	uint32_t i;
+
+	str = image_str(&cache, entry->board_class);
+	if (str && !strcmp(str, pool))
+		return true;
+
+	tags = image_tags(&cache, entry);
+	for (i = 0; tags && i < entry->tag_count; i++) {
+		str = image_str(&cache, tags[i]);
+		if (str && !strcmp(str, pool))
+			return true;
+	}
+
+	return false;
+}
+
+struct board_search {
+	const char *board;
+	struct device *dev;
+};
+
+static void board_search(struct device *dev, size_t first_line,
+			 size_t end_line, void *data)
+{
+	struct board_search *search = data;
+
+	if (!search->dev && !strcmp(dev->board, search->board))
+		search->dev = dev;
+	else
+		device_free(dev);
+}
+
+/* Find @board in the whole configuration, the first board by that name wins */
+static struct device *config_cache_parse_all(const char *board)
+{
+	struct board_search search = { .board = board };
+	struct device_parser_layout layout = {
+		.board = board_search,
+		.global = global_ignore,
+		.data = &search,
+	};
+	size_t len;
+	char *buf;
+	int ret;
+
+	buf = config_cache_read(config_path, &len);
+	if (!buf)
+		err(1, "failed to read %s", config_path);
+
+	ret = device_parser_parse(buf, len, &layout);
+	free(buf);
+
+	return ret < 0 ? NULL : search.dev;
+}
+
+/**
+ * config_cache_parse() - get the full configuration of a board
+ * @entry:	the board
+ *
+ * Return: the board's device, parsed from its YAML text, or from the whole
+ * configuration if the board's text can't be parsed on its own
+ */
+struct device *config_cache_parse(const struct config_cache_board *entry)
+{
+	struct device *dev;
+	const char *yaml;
+
+	if (cache.devices && cache.devices[entry - cache.boards])
+		return cache.devices[entry - cache.boards];
+
+	if (cache.hdr->flags & CONFIG_CACHE_UNSPLIT) {
+		dev = config_cache_parse_all(config_cache_str(entry->board));
+	} else {
+		yaml = image_yaml(&cache, entry);
+		if (!yaml)
+			errx(1, "corrupt configuration cache");
+
+		dev = device_parser_board(yaml, entry->yaml_len);
+	}
+	if (!dev)
+		errx(1, "failed to parse configuration of %s",
+		     config_cache_str(entry->board));
+
+	return dev;
+}
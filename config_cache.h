@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __CONFIG_CACHE_H__
+#define __CONFIG_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct device;
+
+#define CONFIG_CACHE_RESTRICTED	(1 << 0)
+
+/* Strings are offsets into the string area, 0 being the empty string */
+struct config_cache_board {
+	uint32_t board;
+	uint32_t name;
+	uint32_t description;
+	uint32_t yaml;
+	uint32_t yaml_len;
+	uint32_t users;
+	uint32_t user_slots;
+	uint32_t board_class;
+	uint32_t tags;
+	uint32_t tag_count;
+	uint32_t flags;
+};
+
+int config_cache_load(const char *path);
+int config_cache_watch(void);
+void config_cache_reload(int fd);
+
+const struct config_cache_board *config_cache_find(const char *board, size_t len);
+const struct config_cache_board *config_cache_board(unsigned int idx);
+const char *config_cache_str(uint32_t off);
+bool config_cache_access(const struct config_cache_board *entry,
+			 const char *username);
+bool config_cache_in_pool(const struct config_cache_board *entry,
+			  const char *pool);
+struct device *config_cache_parse(const struct config_cache_board *entry);
+
+#endif
@@ -8,10 +8,14 @@
 #include <sys/stat.h>
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "cdba-server.h"
+#include "console_batch.h"
 #include "device.h"
 #include "tty.h"
 #include "watch.h"
@@ -19,31 +23,187 @@
 struct console {
 	int console_fd;
 	struct termios console_tios;
+
+	struct console_batch *batch;
+
+	/* Input for the device, waiting for the tty or for pacing */
+	char *tx_buf;
+	size_t tx_head;
+	size_t tx_len;
+	size_t tx_size;
+	bool tx_watched;
+	struct watch_timer *tx_timer;
+
+	unsigned int char_delay;
+	unsigned int line_delay;
 };
 
+/* Limit on input queued for the device, beyond which it's discarded */
+#define CONSOLE_TX_MAX	(1024 * 1024)
+
+static int console_data(int fd, void *data);
+
+static void console_resume(void *data)
+{
+	struct device *device = data;
+	struct console *console = device->console;
+
+	watch_add_readfd(console->console_fd, console_data, device);
+}
+
 static int console_data(int fd, void *data)
 {
-	char buf[128];
+	struct device *device = data;
+	struct console *console = device->console;
+	size_t avail;
 	ssize_t n;
 
-	n = read(fd, buf, sizeof(buf));
-	if (n < 0)
+	/* Leave the data in the tty until the client has room for it */
+	avail = cdba_credit(CREDIT_CHANNEL_CONSOLE);
+	if (!avail) {
+		watch_del_readfd(fd);
+		cdba_credit_wait(CREDIT_CHANNEL_CONSOLE, console_resume, data);
+		return 0;
+	}
+
+	n = console_batch_read(console->batch, fd, avail);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+	else if (n < 0)
 		return n;
 
-	cdba_send_buf(MSG_CONSOLE, n, buf);
+	return 0;
+}
+
+static bool console_is_eol(char ch)
+{
+	return ch == '\r' || ch == '\n';
+}
+
+/* Size of the next write, as permitted by the pacing */
+static size_t console_tx_chunk(struct console *console)
+{
+	const char *buf = console->tx_buf + console->tx_head;
+	size_t i;
+
+	if (console->char_delay)
+		return 1;
+
+	if (console->line_delay) {
+		for (i = 0; i < console->tx_len; i++) {
+			if (console_is_eol(buf[i]))
+				return i + 1;
+		}
+	}
+
+	return console->tx_len;
+}
+
+static void console_tx(struct console *console);
+
+static int console_tx_ready(int fd, void *data)
+{
+	struct console *console = data;
+
+	watch_del_writefd(fd);
+	console->tx_watched = false;
+
+	console_tx(console);
 
 	return 0;
 }
 
+static void console_tx_timeout(void *data)
+{
+	struct console *console = data;
+
+	console->tx_timer = NULL;
+	console_tx(console);
+}
+
+/*
+ * Write as much of the queued input as the tty accepts, waiting for it to
+ * become writable again if it's full. With pacing, a timer is armed after
+ * each character or line to delay the rest.
+ */
+static void console_tx(struct console *console)
+{
+	unsigned int delay;
+	size_t chunk;
+	ssize_t n;
+	char last;
+
+	while (console->tx_len && !console->tx_timer && !console->tx_watched) {
+		chunk = console_tx_chunk(console);
+
+		n = write(console->console_fd, console->tx_buf + console->tx_head, chunk);
+		if (n < 0 && errno == EAGAIN) {
+			watch_add_writefd(console->console_fd, console_tx_ready, console);
+			console->tx_watched = true;
+			return;
+		} else if (n < 0) {
+			warn("failed to write to console");
+			console->tx_len = 0;
+			break;
+		}
+
+		last = console->tx_buf[console->tx_head + n - 1];
+		console->tx_head += n;
+		console->tx_len -= n;
+
+		if (console_is_eol(last) && console->line_delay)
+			delay = console->line_delay;
+		else
+			delay = console->char_delay;
+
+		if (delay && console->tx_len)
+			console->tx_timer = watch_timer_add(delay, console_tx_timeout, console);
+	}
+
+	if (!console->tx_len)
+		console->tx_head = 0;
+}
+
+static void console_tx_queue(struct console *console, const void *buf, size_t len)
+{
+	/* Move the pending input to the front, before growing the buffer */
+	if (console->tx_head + console->tx_len + len > console->tx_size) {
+		memmove(console->tx_buf, console->tx_buf + console->tx_head, console->tx_len);
+		console->tx_head = 0;
+	}
+
+	if (console->tx_len + len > console->tx_size) {
+		console->tx_size = MAX(console->tx_len + len, 2 * console->tx_size);
+		console->tx_buf = realloc(console->tx_buf, console->tx_size);
+		if (!console->tx_buf)
+			err(1, "failed to grow console transmit queue");
+	}
+
+	memcpy(console->tx_buf + console->tx_head + console->tx_len, buf, len);
+	console->tx_len += len;
+}
+
 static void *console_open(struct device *device)
 {
 	struct console *console;
+	int flags;
 
 	console = calloc(1, sizeof(*console));
-	console->console_fd = tty_open(device->console_dev, &console->console_tios);
+	console->console_fd = tty_open(device->console_dev, &console->console_tios,
+				       &device->console_tty);
 	if (console->console_fd < 0)
 		err(1, "failed to open %s", device->console_dev);
 
+	/* Input is queued and written as the tty accepts it */
+	flags = fcntl(console->console_fd, F_GETFL, 0);
+	fcntl(console->console_fd, F_SETFL, flags | O_NONBLOCK);
+
+	console->char_delay = device->console_char_delay;
+	console->line_delay = device->console_line_delay;
+
+	console->batch = console_batch_new(device->console_batch_size,
+					   device->console_batch_latency);
+
 	watch_add_readfd(console->console_fd, console_data, device);
 
 	return console;
@@ -53,7 +213,15 @@ static int console_write(struct device *device, const void *buf, size_t len)
 {
 	struct console *console = device->console;
 
-	return write(console->console_fd, buf, len);;
+	if (console->tx_len + len > CONSOLE_TX_MAX) {
+		warnx("console input queue full, discarding input");
+		return -1;
+	}
+
+	console_tx_queue(console, buf, len);
+	console_tx(console);
+
+	return len;
 }
 
 static void console_send_break(struct device *device)
@@ -63,8 +231,25 @@ static void console_send_break(struct device *device)
 	tcsendbreak(console->console_fd, 0);
 }
 
+static void console_close(struct device *device)
+{
+	struct console *console = device->console;
+
+	watch_del_readfd(console->console_fd);
+	if (console->tx_watched)
+		watch_del_writefd(console->console_fd);
+	watch_timer_cancel(console->tx_timer);
+
+	console_batch_free(console->batch);
+
+	close(console->console_fd);
+	free(console->tx_buf);
+	free(console);
+}
+
 const struct console_ops console_ops = {
 	.open = console_open,
 	.write = console_write,
 	.send_break = console_send_break,
+	.close = console_close,
 };
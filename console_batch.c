@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "cdba-server.h"
+#include "console_batch.h"
+#include "watch.h"
+
+/*
+ * Console output is collected from the device and sent to the client in
+ * MSG_CONSOLE messages of up to @size bytes. A partial batch is sent once
+ * it has been held for @latency_ms, so a steady stream of output results in
+ * full messages while interactive use only sees a small delay.
+ */
+struct console_batch {
+	char *buf;
+	size_t size;
+	size_t len;
+
+	unsigned int latency_ms;
+	struct watch_timer *timer;
+};
+
+/**
+ * console_batch_new() - allocate console batching state
+ * @size:	largest batch, in bytes
+ * @latency_ms:	longest time to hold on to a partial batch, 0 to send the
+ *		data of each read right away
+ *
+ * Return: the batching state, to pass to console_batch_read()
+ */
+struct console_batch *console_batch_new(size_t size, unsigned int latency_ms)
+{
+	struct console_batch *batch;
+
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		err(1, "failed to allocate console batch");
+
+	batch->size = size ? size : CONSOLE_BATCH_SIZE;
+	batch->latency_ms = latency_ms;
+	batch->buf = malloc(batch->size);
+	if (!batch->buf)
+		err(1, "failed to allocate console batch");
+
+	return batch;
+}
+
+static void console_batch_timeout(void *data)
+{
+	struct console_batch *batch = data;
+
+	batch->timer = NULL;
+	console_batch_flush(batch);
+}
+
+/**
+ * console_batch_flush() - send the batched console data
+ * @batch:	console batching state
+ */
+void console_batch_flush(struct console_batch *batch)
+{
+	watch_timer_cancel(batch->timer);
+	batch->timer = NULL;
+
+	if (!batch->len)
+		return;
+
+	cdba_send_buf(MSG_CONSOLE, batch->len, batch->buf);
+	batch->len = 0;
+}
+
+/**
+ * console_batch_read() - read console data from @fd into the batch
+ * @batch:	console batching state
+ * @fd:		console file descriptor, ready for reading
+ * @avail:	number of bytes the client has room for, must not be 0
+ *
+ * The batch is sent once it's full, or when the latency budget has passed.
+ * It never grows beyond @avail, so that it can always be sent; as nothing
+ * else consumes console credits, @avail doesn't shrink while data is held.
+ *
+ * Return: number of bytes read, 0 on end of file, negative on error
+ */
+ssize_t console_batch_read(struct console_batch *batch, int fd, size_t avail)
+{
+	size_t room = MIN(batch->size, avail);
+	ssize_t n;
+
+	n = read(fd, batch->buf + batch->len, room - batch->len);
+	if (n <= 0)
+		return n;
+
+	batch->len += n;
+
+	if (batch->len >= room || !batch->latency_ms)
+		console_batch_flush(batch);
+	else if (!batch->timer)
+		batch->timer = watch_timer_add(batch->latency_ms,
+					       console_batch_timeout, batch);
+
+	return n;
+}
+
+/**
+ * console_batch_free() - send remaining data and release the batch
+ * @batch:	console batching state, may be NULL
+ */
+void console_batch_free(struct console_batch *batch)
+{
+	if (!batch)
+		return;
+
+	console_batch_flush(batch);
+	free(batch->buf);
+	free(batch);
+}
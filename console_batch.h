@@ -0,0 +1,17 @@
+#ifndef __CONSOLE_BATCH_H__
+#define __CONSOLE_BATCH_H__
+
+#include <sys/types.h>
+
+/* Defaults, unless overridden by console_batch_size/console_batch_latency */
+#define CONSOLE_BATCH_SIZE	4096
+#define CONSOLE_BATCH_LATENCY	2
+
+struct console_batch;
+
+struct console_batch *console_batch_new(size_t size, unsigned int latency_ms);
+ssize_t console_batch_read(struct console_batch *batch, int fd, size_t avail);
+void console_batch_flush(struct console_batch *batch);
+void console_batch_free(struct console_batch *batch);
+
+#endif
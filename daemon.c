@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#define _GNU_SOURCE /* for struct ucred */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "config_cache.h"
+#include "daemon.h"
+
+/*
+ * The daemon parses the configuration once and waits for sessions on a unix
+ * socket. Each session is started by cdba-server, invoked by ssh, passing
+ * its stdin, stdout and stderr and the user name over the socket. The
+ * daemon forks a child that runs the session on these file descriptors,
+ * while cdba-server waits for the child to close the connection.
+ *
+ * Changes to the configuration are picked up by the daemon as they are
+ * written, for the following sessions to use.
+ *
+ * Board controllers are still opened by each session, not kept open by the
+ * daemon. The drivers' open routines register watches and drive the board as
+ * they acquire the controller, their state would go stale in the daemon as
+ * sessions use the board, and libusb contexts don't survive fork(). The bulk
+ * of the setup time, waiting for a board to settle after powering it off, is
+ * instead skipped for boards that have been off since the previous session,
+ * see device_settle().
+ */
+
+#define DAEMON_USERNAME_MAX	256
+
+static struct sockaddr_un daemon_address(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "socket path \"%s\" too long", path);
+
+	strcpy(addr.sun_path, path);
+
+	return addr;
+}
+
+/**
+ * daemon_socket_path() - resolve the path of the daemon's socket
+ * @path:	path given on the command line, or NULL
+ *
+ * Return: @path, $CDBA_SOCKET or $HOME/.cdba.sock, in that order
+ */
+const char *daemon_socket_path(const char *path)
+{
+	static char buf[PATH_MAX];
+	const char *home;
+
+	if (path)
+		return path;
+
+	path = getenv("CDBA_SOCKET");
+	if (path)
+		return path;
+
+	home = getenv("HOME");
+	if (!home)
+		home = ".";
+
+	snprintf(buf, sizeof(buf), "%s/.cdba.sock", home);
+
+	return buf;
+}
+
+/**
+ * daemon_attach() - run the session in the daemon, if one is running
+ * @path:	path of the daemon's socket
+ * @username:	user to run the session as
+ *
+ * Return: -1 if no daemon is listening on @path, otherwise doesn't return
+ */
+int daemon_attach(const char *path, const char *username)
+{
+	struct sockaddr_un addr = daemon_address(path);
+	int fds[] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr hdr;
+	} control = {};
+	struct cmsghdr *cmsg = &control.hdr;
+	struct iovec iov = {
+		.iov_base = (void *)username,
+		.iov_len = strlen(username) + 1,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	char c;
+	int ret;
+	int fd;
+
+	if (iov.iov_len > DAEMON_USERNAME_MAX)
+		errx(1, "user name too long");
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(1, "failed to create socket");
+
+	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0) {
+		close(fd);
+		return -1;
+	}
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, 0) < 0)
+		err(1, "failed to attach to cdba daemon");
+
+	/* The session owns our stdio now, wait for it to finish */
+	while (read(fd, &c, 1) < 0 && errno == EINTR)
+		;
+
+	exit(0);
+}
+
+/* Receive the session's user name and file descriptors */
+static int daemon_receive(int fd, char *username, int *fds)
+{
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = {
+		.iov_base = username,
+		.iov_len = DAEMON_USERNAME_MAX,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	ssize_t n;
+
+	/* Only accept sessions from our own user, which authenticated them */
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+	    cred.uid != getuid()) {
+		syslog(LOG_WARNING, "rejecting connection from uid %d", (int)cred.uid);
+		return -1;
+	}
+
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n <= 0 || username[n - 1] != '\0')
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+		return -1;
+
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+	return 0;
+}
+
+/* In the forked child, make the received file descriptors our stdio */
+static void daemon_session_stdio(const int *fds)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (dup2(fds[i], i) < 0)
+			err(1, "failed to set up session stdio");
+		close(fds[i]);
+	}
+}
+
+/**
+ * daemon_run() - accept sessions on a unix socket
+ * @path:	path of the socket to listen on
+ *
+ * Only returns in the forked child of each session, with stdin, stdout and
+ * stderr connected to the client.
+ *
+ * Return: name of the user of the session
+ */
+const char *daemon_run(const char *path)
+{
+	struct sockaddr_un addr = daemon_address(path);
+	static char username[DAEMON_USERNAME_MAX];
+	struct pollfd pfds[2];
+	int listen_fd;
+	int watch_fd;
+	int fds[3];
+	pid_t pid;
+	int ret;
+	int fd;
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
+		err(1, "failed to create socket");
+
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		err(1, "failed to bind \"%s\"", path);
+
+	chmod(path, 0600);
+
+	if (listen(listen_fd, 16) < 0)
+		err(1, "failed to listen on \"%s\"", path);
+
+	/* Sessions are reaped automatically */
+	signal(SIGCHLD, SIG_IGN);
+
+	watch_fd = config_cache_watch();
+	if (watch_fd < 0)
+		warn("unable to watch the configuration for changes");
+
+	syslog(LOG_INFO, "listening on %s", path);
+
+	for (;;) {
+		pfds[0].fd = listen_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = watch_fd;
+		pfds[1].events = POLLIN;
+
+		ret = poll(pfds, 2, -1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret < 0)
+			err(1, "failed to poll");
+
+		if (pfds[1].revents & POLLIN)
+			config_cache_reload(watch_fd);
+
+		if (!(pfds[0].revents & POLLIN))
+			continue;
+
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0 && errno == EINTR)
+			continue;
+		else if (fd < 0)
+			err(1, "failed to accept session");
+
+		if (daemon_receive(fd, username, fds) < 0) {
+			close(fd);
+			continue;
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			warn("failed to fork session");
+		} else if (pid == 0) {
+			/*
+			 * The connection is left open, without being inherited
+			 * by our children, to tell cdba-server when we're done.
+			 */
+			close(listen_fd);
+			if (watch_fd >= 0)
+				close(watch_fd);
+			signal(SIGCHLD, SIG_DFL);
+			daemon_session_stdio(fds);
+
+			return username;
+		}
+
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+		close(fd);
+	}
+}
@@ -0,0 +1,8 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+const char *daemon_socket_path(const char *path);
+int daemon_attach(const char *path, const char *username);
+const char *daemon_run(const char *path);
+
+#endif
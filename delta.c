@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * rsync style delta encoding of boot images. The server sends a weak rolling
+ * checksum and a truncated strong hash for each block of the image it already
+ * has, the client searches its image for these blocks at any byte offset and
+ * describes the new image as a sequence of block copies and literal data.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "sha256.h"
+
+#define DELTA_BLOCK_MIN		4096
+#define DELTA_BLOCK_MAX		65536
+
+struct delta_index {
+	uint32_t weak;
+	uint32_t block;
+};
+
+/* Blocks of roughly sqrt(size), balancing signature size and granularity */
+size_t delta_block_size(size_t size)
+{
+	size_t block_size = DELTA_BLOCK_MIN;
+
+	while (block_size < DELTA_BLOCK_MAX && block_size * block_size < size)
+		block_size *= 2;
+
+	return block_size;
+}
+
+uint32_t delta_weak(const uint8_t *p, size_t len)
+{
+	uint32_t a = 0;
+	uint32_t b = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		a += p[i];
+		b += (len - i) * p[i];
+	}
+
+	return (b & 0xffff) << 16 | (a & 0xffff);
+}
+
+/* Slide the weak checksum window of @len bytes one byte forward */
+static uint32_t delta_weak_roll(uint32_t weak, size_t len, uint8_t out, uint8_t in)
+{
+	uint32_t a = weak & 0xffff;
+	uint32_t b = weak >> 16;
+
+	a = (a - out + in) & 0xffff;
+	b = (b - len * out + a) & 0xffff;
+
+	return b << 16 | a;
+}
+
+void delta_strong(const uint8_t *p, size_t len, uint8_t *strong)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	struct sha256_ctx ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, p, len);
+	sha256_final(&ctx, digest);
+
+	memcpy(strong, digest, FASTBOOT_STRONG_SIZE);
+}
+
+void delta_signatures(const uint8_t *data, size_t nblocks, uint32_t block_size,
+		      struct fastboot_block_signature *sigs)
+{
+	const uint8_t *p;
+	size_t i;
+
+	for (i = 0; i < nblocks; i++) {
+		p = data + i * block_size;
+
+		sigs[i].weak = delta_weak(p, block_size);
+		delta_strong(p, block_size, sigs[i].strong);
+	}
+}
+
+static int delta_index_cmp(const void *a, const void *b)
+{
+	const struct delta_index *ia = a;
+	const struct delta_index *ib = b;
+
+	if (ia->weak != ib->weak)
+		return ia->weak < ib->weak ? -1 : 1;
+
+	return 0;
+}
+
+static void delta_emit(struct delta_op **ops, size_t *count, int op,
+		       size_t offset, size_t len)
+{
+	struct delta_op *last = *count ? &(*ops)[*count - 1] : NULL;
+
+	/* Merge with the previous operation when contiguous */
+	if (last && last->op == op && last->offset + last->len == offset) {
+		last->len += len;
+		return;
+	}
+
+	*ops = realloc(*ops, (*count + 1) * sizeof(**ops));
+	(*ops)[*count].op = op;
+	(*ops)[*count].offset = offset;
+	(*ops)[*count].len = len;
+	(*count)++;
+}
+
+/* Find a block with matching signature, the index is sorted by weak checksum */
+static int delta_match(const uint8_t *p, uint32_t block_size, uint32_t weak,
+		       const struct delta_index *index, size_t nsigs,
+		       const struct fastboot_block_signature *sigs)
+{
+	uint8_t strong[FASTBOOT_STRONG_SIZE];
+	struct delta_index key = { .weak = weak };
+	const struct delta_index *entry;
+	bool hashed = false;
+
+	entry = bsearch(&key, index, nsigs, sizeof(*index), delta_index_cmp);
+	if (!entry)
+		return -1;
+
+	while (entry > index && entry[-1].weak == weak)
+		entry--;
+
+	for (; entry < index + nsigs && entry->weak == weak; entry++) {
+		if (!hashed) {
+			delta_strong(p, block_size, strong);
+			hashed = true;
+		}
+
+		if (!memcmp(strong, sigs[entry->block].strong, FASTBOOT_STRONG_SIZE))
+			return entry->block;
+	}
+
+	return -1;
+}
+
+/**
+ * delta_compute() - describe image as copies of known blocks and literal data
+ * @data:	the new image
+ * @size:	size of the new image
+ * @sigs:	signatures of the blocks of the image on the other side
+ * @nsigs:	number of entries in @sigs
+ * @block_size:	size of each block described by @sigs
+ * @ops:	resulting array of operations, to be freed by the caller
+ * @matched:	number of bytes of the new image found in known blocks
+ *
+ * A copy operation carries the index of the first block and the number of
+ * consecutive blocks, a literal operation the offset and length of the data in
+ * the new image.
+ *
+ * Return: number of operations in @ops
+ */
+size_t delta_compute(const uint8_t *data, size_t size,
+		     const struct fastboot_block_signature *sigs, size_t nsigs,
+		     uint32_t block_size, struct delta_op **ops, size_t *matched)
+{
+	struct delta_index *index;
+	uint8_t *tags;
+	size_t literal = 0;
+	size_t count = 0;
+	size_t pos = 0;
+	uint32_t weak;
+	size_t i;
+	int block;
+
+	*ops = NULL;
+	*matched = 0;
+
+	index = calloc(nsigs, sizeof(*index));
+	tags = calloc(1, 65536 / 8);
+
+	for (i = 0; i < nsigs; i++) {
+		index[i].weak = sigs[i].weak;
+		index[i].block = i;
+		tags[(sigs[i].weak & 0xffff) / 8] |= 1 << (sigs[i].weak & 7);
+	}
+	qsort(index, nsigs, sizeof(*index), delta_index_cmp);
+
+	if (size >= block_size)
+		weak = delta_weak(data, block_size);
+
+	while (nsigs && pos + block_size <= size) {
+		block = -1;
+		if (tags[(weak & 0xffff) / 8] & (1 << (weak & 7)))
+			block = delta_match(data + pos, block_size, weak, index, nsigs, sigs);
+
+		if (block >= 0) {
+			if (pos > literal)
+				delta_emit(ops, &count, FASTBOOT_DELTA_LITERAL, literal, pos - literal);
+
+			delta_emit(ops, &count, FASTBOOT_DELTA_COPY, block, 1);
+			*matched += block_size;
+
+			pos += block_size;
+			literal = pos;
+
+			if (pos + block_size <= size)
+				weak = delta_weak(data + pos, block_size);
+			continue;
+		}
+
+		if (pos + block_size < size)
+			weak = delta_weak_roll(weak, block_size, data[pos], data[pos + block_size]);
+		pos++;
+	}
+
+	if (size > literal)
+		delta_emit(ops, &count, FASTBOOT_DELTA_LITERAL, literal, size - literal);
+
+	free(index);
+	free(tags);
+
+	return count;
+}
@@ -0,0 +1,24 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cdba.h"
+
+struct delta_op {
+	int op;
+	size_t offset;
+	size_t len;
+};
+
+size_t delta_block_size(size_t size);
+uint32_t delta_weak(const uint8_t *p, size_t len);
+void delta_strong(const uint8_t *p, size_t len, uint8_t *strong);
+void delta_signatures(const uint8_t *data, size_t nblocks, uint32_t block_size,
+		      struct fastboot_block_signature *sigs);
+size_t delta_compute(const uint8_t *data, size_t size,
+		     const struct fastboot_block_signature *sigs, size_t nsigs,
+		     uint32_t block_size, struct delta_op **ops, size_t *matched);
+
+#endif
@@ -4,7 +4,6 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
-#include <sys/file.h>
 #include <sys/stat.h>
 
 #include <assert.h>
@@ -14,13 +13,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <syslog.h>
 
+#include "board_lock.h"
 #include "cdba-server.h"
+#include "config_cache.h"
 #include "device.h"
 #include "fastboot.h"
-#include "list.h"
 #include "ppps.h"
 #include "status-cmd.h"
 #include "watch.h"
@@ -39,97 +38,15 @@
 #define device_console(_dev, _op, ...) \
 	(_dev)->console_ops->_op((_dev) , ## __VA_ARGS__)
 
-static struct list_head devices = LIST_INIT(devices);
-
-void device_add(struct device *device)
-{
-	list_add(&devices, &device->node);
-}
-
-static void device_lock(struct device *device)
-{
-	char lock[PATH_MAX];
-	int fd;
-	int n;
-
-	n = snprintf(lock, sizeof(lock), "/tmp/cdba-%s.lock", device->board);
-	if (n >= (int)sizeof(lock))
-		errx(1, "failed to build lockfile path");
-
-	fd = open(lock, O_RDONLY | O_CREAT, 0666);
-	if (fd >= 0)
-		close(fd);
-
-	fd = open(lock, O_RDONLY | O_CLOEXEC);
-	if (fd < 0)
-		err(1, "failed to open lockfile %s", lock);
-
-	while (1) {
-		char c;
-
-		n = flock(fd, LOCK_EX | LOCK_NB);
-		if (!n)
-			return;
-
-		warnx("board is in use, waiting...");
-
-		sleep(3);
-
-		/* check that connection isn't gone */
-		if (read(STDIN_FILENO, &c, 1) == 0)
-			errx(1, "connection is gone");
-	}
-}
-
-static bool device_check_access(struct device *device,
-				const char *username)
-{
-	struct device_user *user;
-
-	if (!device->users)
-		return true;
-
-	if (!username)
-		return false;
-
-	list_for_each_entry(user, device->users, node) {
-		if (!strcmp(user->username, username))
-			return true;
-	}
-
-	return false;
-}
-
 static int device_power_off(struct device *device);
 
-struct device *device_open(const char *board,
-			   const char *username)
+/* Open the controller and console of a board that has been locked */
+static struct device *device_setup(struct device *device)
 {
-	struct device *device;
-
-	list_for_each_entry(device, &devices, node) {
-		if (!strcmp(device->board, board))
-			goto found;
-	}
-
-	syslog(LOG_INFO, "user %s asked for non-existing board %s", username, board);
-	return NULL;
-
-found:
-	if (!device_check_access(device, username)) {
-		syslog(LOG_INFO, "user %s access denied to the board %s", username, board);
-
-		return NULL;
-	}
-
-	syslog(LOG_INFO, "user %s opening board %s", username, board);
-
 	assert(device->console_ops);
 	assert(device->console_ops->open);
 	assert(device->console_ops->write);
 
-	device_lock(device);
-
 	if (device_has_control(device, open)) {
 		device->cdb = device_control(device, open);
 		if (!device->cdb)
@@ -149,7 +66,7 @@ found:
 	 * */
 	if (device->power_always_on) {
 		device_power_off(device);
-		sleep(2);
+		device_settle(device, 2000);
 	}
 
 	if (device->usb_always_on)
@@ -158,6 +75,86 @@ found:
 	return device;
 }
 
+struct device *device_open(const char *board,
+			   const char *username)
+{
+	const struct config_cache_board *entry;
+	struct device *device;
+
+	entry = config_cache_find(board, strlen(board));
+	if (!entry) {
+		syslog(LOG_INFO, "user %s asked for non-existing board %s", username, board);
+		return NULL;
+	}
+
+	if (!config_cache_access(entry, username)) {
+		syslog(LOG_INFO, "user %s access denied to the board %s", username, board);
+
+		return NULL;
+	}
+
+	device = config_cache_parse(entry);
+
+	syslog(LOG_INFO, "user %s opening board %s", username, board);
+
+	board_lock(device->board);
+
+	return device_setup(device);
+}
+
+/**
+ * device_open_pool() - open the first free board of a pool
+ * @pool:	class or tag of the boards
+ * @username:	user asking for the board
+ *
+ * Return: the board, or NULL if the pool has no boards @username may use
+ */
+struct device *device_open_pool(const char *pool,
+				const char *username)
+{
+	const struct config_cache_board *entry;
+	const char **boards = NULL;
+	unsigned int count = 0;
+	struct device *device;
+	const char *board;
+	unsigned int i;
+	unsigned int idx;
+
+	for (i = 0; (entry = config_cache_board(i)); i++) {
+		if (!config_cache_in_pool(entry, pool) ||
+		    !config_cache_access(entry, username))
+			continue;
+
+		/* Skip boards shadowed by an earlier board of the same name */
+		board = config_cache_str(entry->board);
+		if (config_cache_find(board, strlen(board)) != entry)
+			continue;
+
+		boards = realloc(boards, (count + 1) * sizeof(*boards));
+		if (!boards)
+			err(1, "failed to allocate pool");
+
+		boards[count++] = board;
+	}
+
+	if (!count) {
+		syslog(LOG_INFO, "user %s asked for empty pool %s", username, pool);
+		return NULL;
+	}
+
+	idx = board_lock_pool(pool, boards, count);
+
+	entry = config_cache_find(boards[idx], strlen(boards[idx]));
+	free(boards);
+
+	device = config_cache_parse(entry);
+
+	syslog(LOG_INFO, "user %s opening board %s from pool %s", username,
+	       device->board, pool);
+
+	return device_setup(device);
+}
+
 static void device_impl_power(struct device *device, bool on)
 {
 	device_control(device, power, on);
@@ -243,6 +240,8 @@ static int device_power_on(struct device *device)
 	if (!device || !device_has_control(device, power))
 		return 0;
 
+	board_lock_set_off(false);
+
 	device->state = DEVICE_STATE_START;
 	device_tick(device);
 
@@ -255,10 +254,33 @@ static int device_power_off(struct device *device)
 		return 0;
 
 	device_control(device, power, false);
+	board_lock_set_off(true);
 
 	return 0;
 }
 
+/**
+ * device_settle() - wait for a board to have been powered off long enough
+ * @device:	device, powered off by the caller
+ * @ms:		time the board should be off, before it's powered on again
+ *
+ * A board that has been off since the previous session, or since earlier in
+ * this session, has already served some or all of the time.
+ */
+void device_settle(struct device *device, unsigned int ms)
+{
+	long off;
+
+	off = board_lock_off_ms();
+	if (off < 0) {
+		board_lock_set_off(true);
+		off = 0;
+	}
+
+	if (off < ms)
+		usleep((ms - off) * 1000);
+}
+
 int device_power(struct device *device, bool on)
 {
 	if (on)
@@ -321,6 +343,15 @@ void device_fastboot_continue(struct device *device)
 	fastboot_continue(device->fastboot);
 }
 
+void device_fastboot_reboot(struct device *device)
+{
+	if (!device->fastboot) {
+		fprintf(stderr, "fastboot not opened\n");
+		return;
+	}
+	fastboot_reboot(device->fastboot);
+}
+
 void device_fastboot_flash_reboot(struct device *device)
 {
 	if (!device->fastboot) {
@@ -331,12 +362,28 @@ void device_fastboot_flash_reboot(struct device *device)
 	fastboot_reboot(device->fastboot);
 }
 
-void device_boot(struct device *device, const void *data, size_t len)
+static void device_boot_prepare(struct device *device)
 {
 	warnx("booting the board...");
 	if (device->set_active)
 		fastboot_set_active(device->fastboot, device->set_active);
-	fastboot_download(device->fastboot, data, len);
+}
+
+int device_boot_start(struct device *device, size_t len)
+{
+	device_boot_prepare(device);
+
+	return fastboot_download_start(device->fastboot, len);
+}
+
+int device_boot_write(struct device *device, const void *data, size_t len)
+{
+	return fastboot_download_write(device->fastboot, data, len);
+}
+
+void device_boot_finish(struct device *device)
+{
+	fastboot_download_finish(device->fastboot);
 	device->boot(device);
 
 	if (device->status_enabled && !device->usb_always_on) {
@@ -345,6 +392,113 @@ void device_boot(struct device *device, const void *data, size_t len)
 	}
 }
 
+int device_flash(struct device *device, const char *partition,
+		 const void *data, size_t len)
+{
+	if (!device->fastboot) {
+		fprintf(stderr, "fastboot not opened\n");
+		return -1;
+	}
+
+	return fastboot_flash_image(device->fastboot, partition, data, len);
+}
+
+static void device_flash_complete(struct fastboot *fb, int status, void *data)
+{
+	struct device *device = data;
+
+	device->flash_done(device->flash_done_data, status);
+}
+
+/**
+ * device_flash_async() - flash image to partition in the background
+ * @device:	device to flash
+ * @partition:	name of the partition
+ * @data:	image, must remain valid until @done is invoked
+ * @len:	length of the image
+ * @done:	invoked with the status once the partition is flashed
+ * @done_data:	passed to @done
+ */
+void device_flash_async(struct device *device, const char *partition,
+			const void *data, size_t len,
+			void (*done)(void *, int), void *done_data)
+{
+	if (!device->fastboot) {
+		fprintf(stderr, "fastboot not opened\n");
+		done(done_data, -1);
+		return;
+	}
+
+	device->flash_done = done;
+	device->flash_done_data = done_data;
+
+	fastboot_flash_image_async(device->fastboot, partition, data, len,
+				   device_flash_complete, device);
+}
+
+size_t device_max_download_size(struct device *device)
+{
+	if (!device->fastboot)
+		return 0;
+
+	return fastboot_max_download_size(device->fastboot);
+}
+
+static void device_boot_complete(struct fastboot *fb, int status, void *data)
+{
+	struct device *device = data;
+
+	if (status < 0)
+		warnx("failed to transfer boot image");
+	else
+		device_boot_finish(device);
+
+	device->boot_done(device->boot_done_data);
+}
+
+/**
+ * device_boot() - download and boot image
+ * @device:	device to boot
+ * @data:	image, must remain valid until @done is invoked
+ * @len:	length of the image
+ * @done:	invoked after the device is booted, or booting failed
+ * @done_data:	passed to @done
+ *
+ * The image is transferred in the background, allowing other events to be
+ * handled in the meantime.
+ */
+void device_boot(struct device *device, const void *data, size_t len,
+		 void (*done)(void *), void *done_data)
+{
+	size_t max;
+	int ret;
+
+	device->boot_done = done;
+	device->boot_done_data = done_data;
+
+	/* Boards flashing the boot partition can take it in sparse chunks */
+	max = device_max_download_size(device);
+	if (device->boot == device_fastboot_flash_reboot && max && len > max) {
+		device_boot_prepare(device);
+
+		ret = device_flash(device, "boot", data, len);
+		if (!ret)
+			fastboot_reboot(device->fastboot);
+
+		done(done_data);
+		return;
+	}
+
+	ret = device_boot_start(device, len);
+	if (ret < 0) {
+		done(done_data);
+		return;
+	}
+
+	fastboot_download_async(device->fastboot, data, len,
+				device_boot_complete, device);
+}
+
 void device_send_break(struct device *device)
 {
 	if (device_has_console(device, send_break))
@@ -353,18 +507,23 @@ void device_send_break(struct device *device)
 
 void device_list_devices(const char *username)
 {
-	struct device *device;
+	const struct config_cache_board *entry;
+	const char *board;
+	const char *name;
+	unsigned int i;
 	size_t len;
 	char buf[80];
 
-	list_for_each_entry(device, &devices, node) {
-		if (!device_check_access(device, username))
+	for (i = 0; (entry = config_cache_board(i)); i++) {
+		if (!config_cache_access(entry, username))
 			continue;
 
-		if (device->name)
-			len = snprintf(buf, sizeof(buf), "%-20s %s", device->board, device->name);
+		board = config_cache_str(entry->board);
+		name = config_cache_str(entry->name);
+		if (name)
+			len = snprintf(buf, sizeof(buf), "%-20s %s", board, name);
 		else
-			len = snprintf(buf, sizeof(buf), "%s", device->board);
+			len = snprintf(buf, sizeof(buf), "%s", board);
 
 		cdba_send_buf(MSG_LIST_DEVICES, len, buf);
 	}
@@ -374,27 +533,34 @@ void device_list_devices(const char *username)
 
 void device_info(const char *username, const void *data, size_t dlen)
 {
-	char *description = NULL;
-	struct device *device;
+	const struct config_cache_board *entry;
+	const char *description = NULL;
 	size_t len = 0;
 
-	list_for_each_entry(device, &devices, node) {
-		if (strncmp(device->board, data, dlen))
-			continue;
-
-		if (!device_check_access(device, username))
-			continue;
-
-		if (device->description) {
-			description = device->description;
-			len = strlen(device->description);
-			break;
-		}
+	entry = config_cache_find(data, strnlen(data, dlen));
+	if (entry && config_cache_access(entry, username)) {
+		description = config_cache_str(entry->description);
+		if (description)
+			len = strlen(description);
 	}
 
 	cdba_send_buf(MSG_BOARD_INFO, len, description);
 }
 
+/**
+ * device_console_close() - stop reading the console
+ * @dev:	device
+ *
+ * Console output still held for batching is sent to the client, so this is
+ * to be called before the client's output queue is drained.
+ */
+void device_console_close(struct device *dev)
+{
+	if (dev->console && device_has_console(dev, close))
+		device_console(dev, close);
+	dev->console = NULL;
+}
+
 void device_close(struct device *dev)
 {
 	if (!dev->usb_always_on)
@@ -405,3 +571,49 @@ void device_close(struct device *dev)
 	if (device_has_control(dev, close))
 		device_control(dev, close);
 }
+
+/**
+ * device_free() - free a parsed board configuration
+ * @dev:	the board, not opened
+ */
+void device_free(struct device *dev)
+{
+	struct device_user *user;
+	struct device_user *next_user;
+	struct device_tag *tag;
+	struct device_tag *next_tag;
+
+	if (dev->users) {
+		list_for_each_entry_safe(user, next_user, dev->users, node) {
+			free((void *)user->username);
+			free(user);
+		}
+		free(dev->users);
+	}
+
+	if (dev->tags) {
+		list_for_each_entry_safe(tag, next_tag, dev->tags, node) {
+			free((void *)tag->tag);
+			free(tag);
+		}
+		free(dev->tags);
+	}
+
+	if (dev->control_options && dev->control_ops->free_options)
+		dev->control_ops->free_options(dev->control_options);
+	else
+		free(dev->control_options);
+
+	free(dev->board);
+	free(dev->board_class);
+	free(dev->control_dev);
+	free(dev->console_dev);
+	free(dev->name);
+	free(dev->serial);
+	free(dev->description);
+	free(dev->ppps_path);
+	free(dev->ppps3_path);
+	free((void *)dev->set_active);
+	free(dev->status_cmd);
+	free(dev);
+}
@@ -4,6 +4,7 @@
 #include <termios.h>
 #include "cdba.h"
 #include "list.h"
+#include "tty.h"
 
 struct cdb_assist;
 struct fastboot;
@@ -13,6 +14,7 @@ struct device_parser;
 
 struct control_ops {
 	void *(*parse_options)(struct device_parser *dp);
+	void (*free_options)(void *options);
 	void *(*open)(struct device *dev);
 	void (*close)(struct device *dev);
 	int (*power)(struct device *dev, bool on);
@@ -26,10 +28,13 @@ struct console_ops {
 	int (*write)(struct device *dev, const void *buf, size_t len);
 
 	void (*send_break)(struct device *dev);
+	void (*close)(struct device *dev);
 };
 
 struct device {
 	char *board;
+	char *board_class;
+	struct list_head *tags;
 	char *control_dev;
 	void *control_options;
 	char *console_dev;
@@ -43,14 +48,25 @@ struct device {
 	bool tickle_mmc;
 	bool usb_always_on;
 	bool power_always_on;
+	bool fastboot_stream;
 	struct fastboot *fastboot;
 	unsigned int fastboot_key_timeout;
+	unsigned int console_batch_size;
+	unsigned int console_batch_latency;
+	struct tty_options console_tty;
+	unsigned int console_char_delay;
+	unsigned int console_line_delay;
+	struct tty_options control_tty;
 	int state;
 	bool has_power_key;
 
 	bool status_enabled;
 
 	void (*boot)(struct device *);
+	void (*boot_done)(void *);
+	void *boot_done_data;
+	void (*flash_done)(void *, int);
+	void *flash_done_data;
 
 	const struct control_ops *control_ops;
 	const struct console_ops *console_ops;
@@ -61,8 +77,6 @@ struct device {
 	void *console;
 
 	char *status_cmd;
-
-	struct list_head node;
 };
 
 struct device_user {
@@ -71,24 +85,44 @@ struct device_user {
 	struct list_head node;
 };
 
-void device_add(struct device *device);
+struct device_tag {
+	const char *tag;
+
+	struct list_head node;
+};
 
 struct device *device_open(const char *board,
 			   const char *username);
+struct device *device_open_pool(const char *pool,
+				const char *username);
 void device_close(struct device *dev);
+void device_free(struct device *dev);
+void device_console_close(struct device *dev);
 int device_power(struct device *device, bool on);
+void device_settle(struct device *device, unsigned int ms);
 void device_key(struct device *device, int key, bool asserted);
 
 void device_status_enable(struct device *device);
 void device_usb(struct device *device, bool on);
 int device_write(struct device *device, const void *buf, size_t len);
 
-void device_boot(struct device *device, const void *data, size_t len);
+void device_boot(struct device *device, const void *data, size_t len,
+		 void (*done)(void *), void *done_data);
+int device_boot_start(struct device *device, size_t len);
+int device_boot_write(struct device *device, const void *data, size_t len);
+void device_boot_finish(struct device *device);
+int device_flash(struct device *device, const char *partition,
+		 const void *data, size_t len);
+void device_flash_async(struct device *device, const char *partition,
+			const void *data, size_t len,
+			void (*done)(void *, int), void *done_data);
+size_t device_max_download_size(struct device *device);
 
 void device_fastboot_open(struct device *device,
 			  struct fastboot_ops *fastboot_ops);
 void device_fastboot_boot(struct device *device);
 void device_fastboot_flash_reboot(struct device *device);
+void device_fastboot_reboot(struct device *device);
 void device_send_break(struct device *device);
 void device_list_devices(const char *username);
 void device_info(const char *username, const void *data, size_t dlen);
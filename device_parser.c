@@ -6,10 +6,15 @@
  */
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <yaml.h>
 
+#include "config_cache.h"
+#include "console_batch.h"
 #include "device.h"
 #include "device_parser.h"
+#include "fastboot_cache.h"
 
 #define TOKEN_LENGTH	16384
 
@@ -106,13 +111,28 @@ static void set_console_ops(struct device *dev, const struct console_ops *ops)
 	dev->console_ops = ops;
 }
 
-static void parse_board(struct device_parser *dp)
+static enum tty_flow_control parse_flow_control(const char *value)
+{
+	int flow_control;
+
+	flow_control = tty_parse_flow_control(value);
+	if (flow_control < 0) {
+		fprintf(stderr, "device parser: unknown flow control \"%s\"\n", value);
+		exit(1);
+	}
+
+	return flow_control;
+}
+
+static struct device *parse_board(struct device_parser *dp)
 {
 	struct device *dev;
 	char value[TOKEN_LENGTH];
 	char key[TOKEN_LENGTH];
 
 	dev = calloc(1, sizeof(*dev));
+	dev->console_batch_size = CONSOLE_BATCH_SIZE;
+	dev->console_batch_latency = CONSOLE_BATCH_LATENCY;
 
 	while (device_parser_accept(dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
 		if (!strcmp(key, "users")) {
@@ -137,6 +157,25 @@ static void parse_board(struct device_parser *dp)
 			continue;
 		}
 
+		if (!strcmp(key, "tags")) {
+			dev->tags = calloc(1, sizeof(*dev->tags));
+			list_init(dev->tags);
+
+			device_parser_expect(dp, YAML_SEQUENCE_START_EVENT, NULL, 0);
+
+			while (device_parser_accept(dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
+				struct device_tag *tag = calloc(1, sizeof(*tag));
+
+				tag->tag = strdup(key);
+
+				list_add(dev->tags, &tag->node);
+			}
+
+			device_parser_expect(dp, YAML_SEQUENCE_END_EVENT, NULL, 0);
+
+			continue;
+		}
+
 		if (!strcmp(key, "local_gpio")) {
 			dev->control_options = local_gpio_ops.parse_options(dp);
 			if (dev->control_options)
@@ -160,6 +199,8 @@ static void parse_board(struct device_parser *dp)
 			dev->board = strdup(value);
 		} else if (!strcmp(key, "name")) {
 			dev->name = strdup(value);
+		} else if (!strcmp(key, "class")) {
+			dev->board_class = strdup(value);
 		} else if (!strcmp(key, "cdba")) {
 			dev->control_dev = strdup(value);
 			set_control_ops(dev, &cdb_assist_ops);
@@ -190,16 +231,38 @@ static void parse_board(struct device_parser *dp)
 				dev->boot = device_fastboot_boot;
 		} else if (!strcmp(key, "fastboot_set_active")) {
 			if (!strcmp(value, "true"))
-				dev->set_active = "a";
+				dev->set_active = strdup("a");
 			else
 				dev->set_active = strdup(value);
 		} else if (!strcmp(key, "broken_fastboot_boot")) {
 			if (!strcmp(value, "true"))
 				dev->boot = device_fastboot_flash_reboot;
+		} else if (!strcmp(key, "fastboot_stream")) {
+			dev->fastboot_stream = !strcmp(value, "true");
 		} else if (!strcmp(key, "description")) {
 			dev->description = strdup(value);
 		} else if (!strcmp(key, "fastboot_key_timeout")) {
 			dev->fastboot_key_timeout = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "console_batch_size")) {
+			dev->console_batch_size = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "console_batch_latency")) {
+			dev->console_batch_latency = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "console_baud")) {
+			dev->console_tty.baud = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "console_flow_control")) {
+			dev->console_tty.flow_control = parse_flow_control(value);
+		} else if (!strcmp(key, "console_low_latency")) {
+			dev->console_tty.low_latency = !strcmp(value, "true");
+		} else if (!strcmp(key, "console_char_delay")) {
+			dev->console_char_delay = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "console_line_delay")) {
+			dev->console_line_delay = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "control_baud")) {
+			dev->control_tty.baud = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "control_flow_control")) {
+			dev->control_tty.flow_control = parse_flow_control(value);
+		} else if (!strcmp(key, "control_low_latency")) {
+			dev->control_tty.low_latency = !strcmp(value, "true");
 		} else if (!strcmp(key, "usb_always_on")) {
 			dev->usb_always_on = !strcmp(value, "true");
 		} else if (!strcmp(key, "ppps_path")) {
@@ -221,25 +284,60 @@ static void parse_board(struct device_parser *dp)
 		exit(1);
 	}
 
-	device_add(dev);
+	return dev;
 }
 
-int device_parser(const char *path)
+/* Consume the current node, including any nested nodes */
+static void skip_node(struct device_parser *dp)
+{
+	int depth = 0;
+
+	do {
+		switch (dp->event.type) {
+		case YAML_MAPPING_START_EVENT:
+		case YAML_SEQUENCE_START_EVENT:
+			depth++;
+			break;
+		case YAML_MAPPING_END_EVENT:
+		case YAML_SEQUENCE_END_EVENT:
+			depth--;
+			break;
+		default:
+			break;
+		}
+
+		yaml_event_delete(&dp->event);
+		nextsym(dp);
+	} while (depth);
+}
+
+static size_t mark_line(struct device_parser *dp)
+{
+	return dp->event.start_mark.line;
+}
+
+/**
+ * device_parser_parse() - parse a configuration
+ * @buf:	YAML formatted configuration
+ * @len:	length of @buf
+ * @layout:	invoked with each board and the lines of the top-level entries
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int device_parser_parse(const char *buf, size_t len,
+			struct device_parser_layout *layout)
 {
 	struct device_parser dp;
 	char key[TOKEN_LENGTH];
-	FILE *fh;
-
-	fh = fopen(path, "r");
-	if (!fh)
-		return -1;
+	struct device *dev;
+	size_t first_line;
 
 	if(!yaml_parser_initialize(&dp.parser)) {
 		fprintf(stderr, "device parser: failed to initialize parser\n");
 		return -1;
 	}
 
-	yaml_parser_set_input_file(&dp.parser, fh);
+	yaml_parser_set_input_string(&dp.parser, (const unsigned char *)buf, len);
 
 	nextsym(&dp);
 
@@ -248,12 +346,41 @@ int device_parser(const char *path)
 	device_parser_expect(&dp, YAML_DOCUMENT_START_EVENT, NULL, 0);
 	device_parser_expect(&dp, YAML_MAPPING_START_EVENT, NULL, 0);
 
-	if (device_parser_accept(&dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
+	for (;;) {
+		first_line = mark_line(&dp);
+		if (!device_parser_accept(&dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH))
+			break;
+
+		if (!strcmp(key, "fastboot_cache")) {
+			fastboot_cache_parse_options(&dp);
+			layout->global(first_line, mark_line(&dp), layout->data);
+			continue;
+		}
+
+		/* Boards are located by their lines, which flow style breaks */
+		if (dp.event.type == YAML_SEQUENCE_START_EVENT &&
+		    dp.event.data.sequence_start.style == YAML_FLOW_SEQUENCE_STYLE)
+			layout->flow_style = true;
+
 		device_parser_expect(&dp, YAML_SEQUENCE_START_EVENT, NULL, 0);
 
-		while (device_parser_accept(&dp, YAML_MAPPING_START_EVENT, NULL, 0)) {
-			parse_board(&dp);
+		for (;;) {
+			first_line = mark_line(&dp);
+			if (dp.event.type == YAML_MAPPING_START_EVENT &&
+			    !layout->flow_style && layout->reuse &&
+			    layout->reuse(first_line, layout->data)) {
+				skip_node(&dp);
+				layout->board(NULL, first_line, mark_line(&dp), layout->data);
+				continue;
+			}
+
+			if (!device_parser_accept(&dp, YAML_MAPPING_START_EVENT, NULL, 0))
+				break;
+
+			dev = parse_board(&dp);
 			device_parser_expect(&dp, YAML_MAPPING_END_EVENT, NULL, 0);
+
+			layout->board(dev, first_line, mark_line(&dp), layout->data);
 		}
 
 		device_parser_expect(&dp, YAML_SEQUENCE_END_EVENT, NULL, 0);
@@ -266,7 +393,60 @@ int device_parser(const char *path)
 	yaml_event_delete(&dp.event);
 	yaml_parser_delete(&dp.parser);
 
-	fclose(fh);
-
 	return 0;
 }
+
+static void board_capture(struct device *dev, size_t first_line,
+			  size_t end_line, void *data)
+{
+	struct device **result = data;
+
+	*result = dev;
+}
+
+static void global_ignore(size_t first_line, size_t end_line, void *data)
+{
+}
+
+/**
+ * device_parser_board() - parse the configuration of a single board
+ * @buf:	the lines of one entry of the list of boards
+ * @len:	length of @buf
+ *
+ * Return: the board, or NULL on failure
+ */
+struct device *device_parser_board(const char *buf, size_t len)
+{
+	static const char prefix[] = "devices:\n";
+	struct device *dev = NULL;
+	struct device_parser_layout layout = {
+		.board = board_capture,
+		.global = global_ignore,
+		.data = &dev,
+	};
+	char *doc;
+	int ret;
+
+	doc = malloc(sizeof(prefix) - 1 + len);
+	if (!doc)
+		return NULL;
+
+	memcpy(doc, prefix, sizeof(prefix) - 1);
+	memcpy(doc + sizeof(prefix) - 1, buf, len);
+
+	ret = device_parser_parse(doc, sizeof(prefix) - 1 + len, &layout);
+	free(doc);
+
+	return ret ? NULL : dev;
+}
+
+/**
+ * device_parser() - load the board configuration
+ * @path:	path of the YAML formatted configuration
+ *
+ * Return: 0 on success, -1 if @path can't be read
+ */
+int device_parser(const char *path)
+{
+	return config_cache_load(path);
+}
@@ -1,13 +1,35 @@
 #ifndef __DEVICE_PARSER_H__
 #define __DEVICE_PARSER_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+
+struct device;
 struct device_parser;
 
+/* Location of the configuration entries, in lines counted from 0 */
+struct device_parser_layout {
+	void (*board)(struct device *dev, size_t first_line, size_t end_line, void *data);
+	void (*global)(size_t first_line, size_t end_line, void *data);
+	/*
+	 * Optional, return true to skip the board and pass NULL to board(),
+	 * not used for boards in flow style
+	 */
+	bool (*reuse)(size_t first_line, void *data);
+	void *data;
+
+	/* Set if boards can't be located by their lines */
+	bool flow_style;
+};
+
 int device_parser_accept(struct device_parser *dp, int type,
 			 char *scalar,  size_t scalar_len);
 bool device_parser_expect(struct device_parser *dp, int type,
 			  char *scalar,  size_t scalar_len);
 
+int device_parser_parse(const char *buf, size_t len,
+			struct device_parser_layout *layout);
+struct device *device_parser_board(const char *buf, size_t len);
 int device_parser(const char *path);
 
 #endif
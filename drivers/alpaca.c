@@ -37,7 +37,8 @@ static void *alpaca_open(struct device *dev)
 
 	alpaca = calloc(1, sizeof(*alpaca));
 
-	alpaca->alpaca_fd = tty_open(dev->control_dev, &alpaca->alpaca_tios);
+	alpaca->alpaca_fd = tty_open(dev->control_dev, &alpaca->alpaca_tios,
+				      &dev->control_tty);
 	if (alpaca->alpaca_fd < 0)
 		err(1, "failed to open %s", dev->control_dev);
 
@@ -48,7 +49,7 @@ static void *alpaca_open(struct device *dev)
 	else
 		alpaca_usb_device_power(alpaca, 0);
 
-	usleep(500000);
+	device_settle(dev, 500);
 
 	return alpaca;
 }
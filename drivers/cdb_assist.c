@@ -258,7 +258,8 @@ static void *cdb_assist_open(struct device *dev)
 
 	cdb = calloc(1, sizeof(*cdb));
 
-	cdb->control_tty = tty_open(dev->control_dev, &cdb->control_tios);
+	cdb->control_tty = tty_open(dev->control_dev, &cdb->control_tios,
+				     &dev->control_tty);
 	if (cdb->control_tty < 0)
 		return NULL;
 
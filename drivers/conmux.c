@@ -17,6 +17,7 @@
 #include <unistd.h>
 
 #include "cdba-server.h"
+#include "console_batch.h"
 #include "device.h"
 #include "watch.h"
 
@@ -24,6 +25,8 @@ extern int h_errno;
 
 struct conmux {
 	int fd;
+
+	struct console_batch *batch;
 };
 
 struct conmux_lookup {
@@ -182,20 +185,37 @@ out:
 	return ret;
 }
 
+static int conmux_data(int fd, void *data);
+
+static void conmux_resume(void *data)
+{
+	struct conmux *conmux = data;
+
+	watch_add_readfd(conmux->fd, conmux_data, conmux);
+}
+
 static int conmux_data(int fd, void *data)
 {
-	char buf[128];
+	struct conmux *conmux = data;
+	size_t avail;
 	ssize_t n;
 
-	n = read(fd, buf, sizeof(buf));
+	/* Leave the data in the socket until the client has room for it */
+	avail = cdba_credit(CREDIT_CHANNEL_CONSOLE);
+	if (!avail) {
+		watch_del_readfd(fd);
+		cdba_credit_wait(CREDIT_CHANNEL_CONSOLE, conmux_resume, data);
+		return 0;
+	}
+
+	n = console_batch_read(conmux->batch, fd, avail);
 	if (n < 0)
 		return n;
 
 	if (!n) {
+		console_batch_flush(conmux->batch);
 		fprintf(stderr, "Received EOF from conmux\n");
 		watch_quit();
-	} else {
-		cdba_send_buf(MSG_CONSOLE, n, buf);
 	}
 
 	return 0;
@@ -268,8 +288,10 @@ static void *conmux_open(struct device *dev)
 
 	conmux = calloc(1, sizeof(*conmux));
 	conmux->fd = fd;
+	conmux->batch = console_batch_new(dev->console_batch_size,
+					  dev->console_batch_latency);
 
-	watch_add_readfd(conmux->fd, conmux_data, NULL);
+	watch_add_readfd(conmux->fd, conmux_data, conmux);
 
 	return conmux;
 }
@@ -314,6 +336,15 @@ static void *conmux_console_open(struct device *dev)
 	return dev->cdb;
 }
 
+static void conmux_console_close(struct device *dev)
+{
+	struct conmux *conmux = dev->cdb;
+
+	watch_del_readfd(conmux->fd);
+	console_batch_free(conmux->batch);
+	conmux->batch = NULL;
+}
+
 const struct control_ops conmux_ops = {
 	.open = conmux_open,
 	.power = conmux_power,
@@ -322,4 +353,5 @@ const struct control_ops conmux_ops = {
 const struct console_ops conmux_console_ops = {
 	.open = conmux_console_open,
 	.write = conmux_write,
+	.close = conmux_console_close,
 };
@@ -326,7 +326,7 @@ static void *ftdi_gpio_open(struct device *dev)
 	else
 		ftdi_gpio_device_usb(ftdi_gpio, 0);
 
-	usleep(500000);
+	device_settle(dev, 500);
 
 	return ftdi_gpio;
 }
@@ -394,8 +394,21 @@ static void ftdi_gpio_key(struct device *dev, int key, bool asserted)
 	}
 }
 
+static void ftdi_gpio_free_options(void *data)
+{
+	struct ftdi_gpio_options *options = data;
+
+	free(options->ftdi.description);
+	free(options->ftdi.vendor);
+	free(options->ftdi.product);
+	free(options->ftdi.serial);
+	free(options->ftdi.devicenode);
+	free(options);
+}
+
 const struct control_ops ftdi_gpio_ops = {
 	.parse_options = ftdi_gpio_parse_options,
+	.free_options = ftdi_gpio_free_options,
 	.open = ftdi_gpio_open,
 	.power = ftdi_gpio_power,
 	.usb = ftdi_gpio_usb,
@@ -42,7 +42,6 @@ void *laurent_parse_options(struct device_parser *dp)
 	char key[TOKEN_LENGTH];
 
 	options = calloc(1, sizeof(*options));
-	options->password = DEFAULT_PASSWORD;
 	options->usb_relay = -1;
 
 	device_parser_accept(dp, YAML_MAPPING_START_EVENT, NULL, 0);
@@ -67,6 +66,9 @@ void *laurent_parse_options(struct device_parser *dp)
 	if (!options->server)
 		errx(1, "%s: server hostname not specified", __func__);
 
+	if (!options->password)
+		options->password = strdup(DEFAULT_PASSWORD);
+
 	return options;
 }
 
@@ -215,8 +217,18 @@ static void laurent_usb(struct device *dev, bool on)
 			on);
 }
 
+static void laurent_free_options(void *data)
+{
+	struct laurent_options *options = data;
+
+	free((void *)options->server);
+	free((void *)options->password);
+	free(options);
+}
+
 const struct control_ops laurent_ops = {
 	.parse_options = laurent_parse_options,
+	.free_options = laurent_free_options,
 	.open = laurent_open,
 	.power = laurent_power,
 	.usb = laurent_usb,
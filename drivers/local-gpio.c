@@ -100,7 +100,7 @@ static void *local_gpio_open(struct device *dev)
 	else
 		local_gpio_device_usb(local_gpio, 0);
 
-	usleep(500000);
+	device_settle(dev, 500);
 
 	return local_gpio;
 }
@@ -154,8 +154,19 @@ static void local_gpio_key(struct device *dev, int key, bool asserted)
 	}
 }
 
+static void local_gpio_free_options(void *data)
+{
+	struct local_gpio_options *options = data;
+	int i;
+
+	for (i = 0; i < GPIO_COUNT; i++)
+		free(options->gpios[i].chip);
+	free(options);
+}
+
 const struct control_ops local_gpio_ops = {
 	.parse_options = local_gpio_parse_options,
+	.free_options = local_gpio_free_options,
 	.open = local_gpio_open,
 	.power = local_gpio_power,
 	.usb = local_gpio_usb,
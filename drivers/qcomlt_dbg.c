@@ -41,6 +41,8 @@ struct qcomlt_dbg {
 	enum qcomlt_parse_state parse_state;
 	unsigned long mv;
 	unsigned long ma;
+
+	struct watch_timer *status_timer;
 };
 
 static void *qcomlt_dbg_open(struct device *dev)
@@ -51,7 +53,7 @@ static void *qcomlt_dbg_open(struct device *dev)
 
 	dbg = calloc(1, sizeof(*dbg));
 
-	dbg->fd = tty_open(dev->control_dev, &dbg->orig_tios);
+	dbg->fd = tty_open(dev->control_dev, &dbg->orig_tios, &dev->control_tty);
 	if (dbg->fd < 0)
 		err(1, "failed to open %s", dev->control_dev);
 
@@ -195,20 +197,30 @@ static void qcomlt_dbg_request_status(void *data)
 	struct qcomlt_dbg *dbg = data;
 
 	write(dbg->fd, "s", 1);
-
-	watch_timer_add(200, qcomlt_dbg_request_status, dbg);
 }
 
 static void qcomlt_dbg_status_enable(struct device *dev)
 {
 	struct qcomlt_dbg *dbg = dev->cdb;
 
+	if (dbg->status_timer)
+		return;
+
 	watch_add_readfd(dbg->fd, qcomlt_dbg_ctrl_data, dbg);
-	watch_timer_add(200, qcomlt_dbg_request_status, dbg);
+	dbg->status_timer = watch_timer_add_periodic(200, qcomlt_dbg_request_status, dbg);
+}
+
+static void qcomlt_dbg_close(struct device *dev)
+{
+	struct qcomlt_dbg *dbg = dev->cdb;
+
+	watch_timer_cancel(dbg->status_timer);
+	dbg->status_timer = NULL;
 }
 
 const struct control_ops qcomlt_dbg_ops = {
 	.open = qcomlt_dbg_open,
+	.close = qcomlt_dbg_close,
 	.power = qcomlt_dbg_power,
 	.usb = qcomlt_dbg_usb,
 	.key = qcomlt_dbg_key,
@@ -8,6 +8,7 @@
 #include <linux/usb/ch9.h>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include <dirent.h>
 #include <err.h>
@@ -15,6 +16,7 @@
 #include <fcntl.h>
 #include <libudev.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,10 +24,28 @@
 
 #include "cdba-server.h"
 #include "fastboot.h"
+#include "sparse.h"
 #include "watch.h"
 
 #define MAX_USBFS_BULK_SIZE (16*1024)
 
+/*
+ * Downloads are split in URBs that are submitted asynchronously, keeping a
+ * few in flight to saturate the link. Kernels without
+ * USBDEVFS_CAP_NO_PACKET_SIZE_LIM limit each URB to MAX_USBFS_BULK_SIZE.
+ *
+ * Where usbfs supports mmap() the URB buffers are allocated from the device,
+ * allowing the kernel to transfer them without copying.
+ */
+#define FASTBOOT_URB_SIZE	(128*1024)
+#define FASTBOOT_URB_COUNT	8
+
+struct fastboot_urb {
+	struct usbdevfs_urb urb;
+	void *buf;
+	bool busy;
+};
+
 struct fastboot {
 	const char *serial;
 
@@ -42,6 +62,57 @@ struct fastboot {
 	int state;
 
 	struct udev_monitor *mon;
+
+	size_t max_download_size;
+
+	struct fastboot_urb urbs[FASTBOOT_URB_COUNT];
+	unsigned int urbs_busy;
+	size_t urb_size;
+	int urb_status;
+
+	/* Partially filled URB buffer, of streamed downloads */
+	struct fastboot_urb *fill;
+	size_t fill_len;
+
+	/* Download from caller provided buffers, in the background */
+	struct iovec tx_single;
+	const struct iovec *tx_iov;
+	int tx_iovcnt;
+	int tx_index;
+	size_t tx_offset;
+	void (*tx_done)(struct fastboot *fb, int status, void *data);
+	void *tx_cb_data;
+
+	/* Response to a command, received in the background */
+	struct usbdevfs_urb rx_urb;
+	char rx_buf[65];
+	bool rx_busy;
+	bool rx_complete;
+	void (*rx_done)(struct fastboot *fb, int status, void *data);
+	void *rx_cb_data;
+};
+
+/* A partition image, as one or more downloads each followed by a flash */
+struct fastboot_piece {
+	struct iovec *iov;
+	int iovcnt;
+	size_t size;
+	void *headers;
+};
+
+struct fastboot_flash {
+	struct fastboot *fb;
+	char *partition;
+
+	const char *data;
+	size_t len;
+
+	struct fastboot_piece *pieces;
+	size_t count;
+	size_t current;
+
+	void (*done)(struct fastboot *fb, int status, void *data);
+	void *cb_data;
 };
 
 enum {
@@ -121,6 +192,271 @@ static int fastboot_write(struct fastboot *fb, const void *data, size_t len)
 	return count;
 }
 
+static struct fastboot_urb *fastboot_urb_get(struct fastboot *fb)
+{
+	int i;
+
+	for (i = 0; i < FASTBOOT_URB_COUNT; i++) {
+		if (!fb->urbs[i].busy) {
+			fb->urbs[i].busy = true;
+			return &fb->urbs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int fastboot_urb_submit(struct fastboot *fb, struct fastboot_urb *furb,
+			       void *data, size_t len)
+{
+	int ret;
+
+	memset(&furb->urb, 0, sizeof(furb->urb));
+	furb->urb.type = USBDEVFS_URB_TYPE_BULK;
+	furb->urb.endpoint = fb->ep_out;
+	furb->urb.buffer = data;
+	furb->urb.buffer_length = len;
+	furb->urb.usercontext = furb;
+
+	ret = ioctl(fb->fd, USBDEVFS_SUBMITURB, &furb->urb);
+	if (ret < 0) {
+		warn("failed to submit usb bulk transfer");
+		furb->busy = false;
+		return -errno;
+	}
+
+	fb->urbs_busy++;
+
+	return 0;
+}
+
+static int fastboot_submit(struct fastboot *fb, const void *data, size_t len)
+{
+	struct fastboot_urb *furb;
+
+	furb = fastboot_urb_get(fb);
+	if (!furb)
+		return -EBUSY;
+
+	/* Without usbfs buffers the kernel copies, so @data may go away */
+	if (!furb->buf)
+		return fastboot_urb_submit(fb, furb, (void *)data, len);
+
+	memcpy(furb->buf, data, len);
+
+	return fastboot_urb_submit(fb, furb, furb->buf, len);
+}
+
+static void fastboot_urbs_alloc(struct fastboot *fb)
+{
+	void *buf;
+	int i;
+
+	for (i = 0; i < FASTBOOT_URB_COUNT; i++) {
+		buf = mmap(NULL, fb->urb_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fb->fd, 0);
+		if (buf == MAP_FAILED)
+			goto unmap;
+
+		fb->urbs[i].buf = buf;
+	}
+
+	return;
+
+unmap:
+	/* Fall back to passing our own buffers */
+	while (--i >= 0) {
+		munmap(fb->urbs[i].buf, fb->urb_size);
+		fb->urbs[i].buf = NULL;
+	}
+}
+
+static void fastboot_urbs_free(struct fastboot *fb)
+{
+	int i;
+
+	for (i = 0; i < FASTBOOT_URB_COUNT; i++) {
+		if (fb->urbs[i].buf)
+			munmap(fb->urbs[i].buf, fb->urb_size);
+		fb->urbs[i].buf = NULL;
+	}
+}
+
+/* Forget about in flight URBs, as they are discarded with the device */
+static void fastboot_urbs_reset(struct fastboot *fb)
+{
+	int i;
+
+	for (i = 0; i < FASTBOOT_URB_COUNT; i++)
+		fb->urbs[i].busy = false;
+
+	fb->urbs_busy = 0;
+	fb->fill = NULL;
+	fb->fill_len = 0;
+
+	if (fb->rx_busy) {
+		fb->rx_busy = false;
+		fb->rx_urb.status = -ENODEV;
+		fb->rx_complete = true;
+	}
+}
+
+/* Reap completed URBs, waiting for the first one if @wait */
+static int fastboot_reap(struct fastboot *fb, bool wait)
+{
+	struct fastboot_urb *furb;
+	struct usbdevfs_urb *urb;
+	int count = 0;
+	int ret;
+
+	while (fb->urbs_busy || fb->rx_busy) {
+		ret = ioctl(fb->fd, wait && !count ? USBDEVFS_REAPURB :
+						     USBDEVFS_REAPURBNDELAY, &urb);
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		else if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0) {
+			warn("failed to reap usb bulk transfer");
+			fb->urb_status = -ENXIO;
+			fastboot_urbs_reset(fb);
+			return -ENXIO;
+		}
+
+		/* The response is handled from the watch loop */
+		if (urb == &fb->rx_urb) {
+			fb->rx_busy = false;
+			fb->rx_complete = true;
+			count++;
+			continue;
+		}
+
+		furb = urb->usercontext;
+		if (urb->status || urb->actual_length != urb->buffer_length) {
+			warnx("usb bulk transfer failed: %d", urb->status);
+			fb->urb_status = -EIO;
+		}
+
+		furb->busy = false;
+		fb->urbs_busy--;
+		count++;
+	}
+
+	return count;
+}
+
+static void fastboot_tx_fill(struct fastboot *fb)
+{
+	const struct iovec *iov;
+	size_t len;
+	int ret;
+
+	while (!fb->urb_status && fb->tx_index < fb->tx_iovcnt) {
+		iov = &fb->tx_iov[fb->tx_index];
+		if (fb->tx_offset == iov->iov_len) {
+			fb->tx_index++;
+			fb->tx_offset = 0;
+			continue;
+		}
+
+		len = MIN(iov->iov_len - fb->tx_offset, fb->urb_size);
+
+		ret = fastboot_submit(fb, (char *)iov->iov_base + fb->tx_offset, len);
+		if (ret == -EBUSY)
+			return;
+		else if (ret < 0)
+			fb->urb_status = ret;
+		else
+			fb->tx_offset += len;
+	}
+}
+
+static void fastboot_tx_complete(struct fastboot *fb)
+{
+	void (*done)(struct fastboot *fb, int status, void *data) = fb->tx_done;
+	int status = fb->urb_status;
+
+	fb->tx_done = NULL;
+	fb->tx_iov = NULL;
+	fb->urb_status = 0;
+
+	done(fb, status, fb->tx_cb_data);
+}
+
+static int fastboot_rx_submit(struct fastboot *fb)
+{
+	int ret;
+
+	memset(&fb->rx_urb, 0, sizeof(fb->rx_urb));
+	fb->rx_urb.type = USBDEVFS_URB_TYPE_BULK;
+	fb->rx_urb.endpoint = fb->ep_in;
+	fb->rx_urb.buffer = fb->rx_buf;
+	fb->rx_urb.buffer_length = sizeof(fb->rx_buf) - 1;
+
+	ret = ioctl(fb->fd, USBDEVFS_SUBMITURB, &fb->rx_urb);
+	if (ret < 0) {
+		warn("failed to submit usb bulk transfer");
+		return -errno;
+	}
+
+	fb->rx_busy = true;
+
+	return 0;
+}
+
+static void fastboot_rx_complete(struct fastboot *fb)
+{
+	void (*done)(struct fastboot *fb, int status, void *data) = fb->rx_done;
+	int n = fb->rx_urb.actual_length;
+	int status = 0;
+
+	if (fb->rx_urb.status || n < 4) {
+		warnx("failed to receive fastboot response");
+		status = -ENXIO;
+	} else {
+		fb->rx_buf[n] = '\0';
+
+		if (strncmp(fb->rx_buf, "INFO", 4) == 0) {
+			fb->ops->info(fb, fb->rx_buf + 4, n - 4);
+
+			status = fastboot_rx_submit(fb);
+			if (!status)
+				return;
+		} else if (strncmp(fb->rx_buf, "FAIL", 4) == 0) {
+			fprintf(stderr, "%s\n", fb->rx_buf + 4);
+			status = -ENXIO;
+		}
+	}
+
+	fb->rx_done = NULL;
+	if (done)
+		done(fb, status, fb->rx_cb_data);
+}
+
+/* URB completions make the usbfs fd writable */
+static int handle_usb_completion(int fd, void *data)
+{
+	struct fastboot *fb = data;
+
+	fastboot_reap(fb, false);
+
+	if (fb->rx_complete) {
+		fb->rx_complete = false;
+		fastboot_rx_complete(fb);
+	}
+
+	if (!fb->tx_done)
+		return 0;
+
+	fastboot_tx_fill(fb);
+
+	if (!fb->urbs_busy)
+		fastboot_tx_complete(fb);
+
+	return 0;
+}
+
 static int parse_usb_desc(int usbfd, unsigned *ep_in, unsigned *ep_out)
 {
 	const struct usb_interface_descriptor *ifc;
@@ -226,12 +562,25 @@ static int parse_usb_desc(int usbfd, unsigned *ep_in, unsigned *ep_out)
 	return -ENOENT;
 }
 
+static void fastboot_query_max_download_size(struct fastboot *fb)
+{
+	char buf[64];
+	int ret;
+
+	fb->max_download_size = 0;
+
+	ret = fastboot_getvar(fb, "max-download-size", buf, sizeof(buf));
+	if (ret > 0)
+		fb->max_download_size = strtoull(buf, NULL, 0);
+}
+
 static int handle_fastboot_add(struct fastboot *fastboot, struct udev_device *dev)
 {
 	const char *dev_path;
 	const char *dev_node;
 	unsigned ep_out;
 	unsigned ep_in;
+	uint32_t caps;
 	int usbfd;
 	int ret;
 
@@ -253,8 +602,20 @@ static int handle_fastboot_add(struct fastboot *fastboot, struct udev_device *de
 	fastboot->fd = usbfd;
 	fastboot->dev_path = strdup(dev_path);
 
+	ret = ioctl(usbfd, USBDEVFS_GET_CAPABILITIES, &caps);
+	if (ret == 0 && (caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM))
+		fastboot->urb_size = FASTBOOT_URB_SIZE;
+	else
+		fastboot->urb_size = MAX_USBFS_BULK_SIZE;
+
+	fastboot_urbs_alloc(fastboot);
+
+	watch_add_writefd(usbfd, handle_usb_completion, fastboot);
+
 	fastboot->state = FASTBOOT_STATE_OPENED;
 
+	fastboot_query_max_download_size(fastboot);
+
 	if (fastboot->ops && fastboot->ops->opened)
 		fastboot->ops->opened(fastboot, fastboot->data);
 
@@ -287,10 +648,22 @@ static int handle_udev_event(int fd, void *data)
 		if (!fastboot->dev_path || strcmp(dev_path, fastboot->dev_path))
 			goto unref_dev;
 
+		watch_del_writefd(fastboot->fd);
+		fastboot_urbs_reset(fastboot);
+		fastboot_urbs_free(fastboot);
 		close(fastboot->fd);
 		fastboot->fd = -1;
 		fastboot->dev_path = NULL;
 
+		if (fastboot->rx_complete) {
+			fastboot->rx_complete = false;
+			fastboot_rx_complete(fastboot);
+		}
+		if (fastboot->tx_done) {
+			fastboot->urb_status = -ENXIO;
+			fastboot_tx_complete(fastboot);
+		}
+
 		if (fastboot->ops && fastboot->ops->disconnect)
 			fastboot->ops->disconnect(fastboot->data);
 
@@ -364,44 +737,217 @@ int fastboot_getvar(struct fastboot *fb, const char *var, char *buf, size_t len)
 	return fastboot_read(fb, buf, len);
 }
 
-int fastboot_download(struct fastboot *fb, const void *data, size_t len)
+int fastboot_download_start(struct fastboot *fb, size_t len)
 {
-	size_t xfer;
-	ssize_t n;
-	size_t offset = 0;
-	void *buf;
 	char cmd[32];
-	int ret = 0;
+	int n;
 
-	buf = malloc(MAX_USBFS_BULK_SIZE);
-	if (!buf)
-		err(1, "failed to allocate usb scratch buffer");
+	if (len > UINT32_MAX ||
+	    (fb->max_download_size && len > fb->max_download_size)) {
+		fprintf(stderr, "download of %zu bytes exceeds max-download-size\n", len);
+		return -1;
+	}
 
 	n = sprintf(cmd, "download:%08x", (unsigned int)len);
 	fastboot_write(fb, cmd, n);
 
-	n = fastboot_read(fb, buf, MAX_USBFS_BULK_SIZE);
+	n = fastboot_read(fb, NULL, 0);
 	if (n < 0) {
 		fprintf(stderr, "remote rejected download request\n");
 		return -1;
 	}
 
-	while (len > 0) {
-		xfer = MIN(len, MAX_USBFS_BULK_SIZE);
+	return 0;
+}
 
-		ret = fastboot_write(fb, (const char *)data + offset, xfer);
+static int fastboot_fill_flush(struct fastboot *fb)
+{
+	struct fastboot_urb *furb = fb->fill;
+	size_t len = fb->fill_len;
+
+	if (!furb)
+		return 0;
+
+	fb->fill = NULL;
+	fb->fill_len = 0;
+
+	return fastboot_urb_submit(fb, furb, furb->buf, len);
+}
+
+/*
+ * Collect streamed data in usbfs buffers, submitting each as it fills up, so
+ * URBs are of full size regardless of how the data arrives.
+ */
+static int fastboot_fill(struct fastboot *fb, const char *data, size_t len)
+{
+	size_t n;
+	int ret;
+
+	while (len) {
+		if (!fb->fill) {
+			fb->fill = fastboot_urb_get(fb);
+			if (!fb->fill) {
+				ret = fastboot_reap(fb, true);
+				if (ret < 0)
+					return ret;
+				continue;
+			}
+		}
+
+		n = MIN(len, fb->urb_size - fb->fill_len);
+		memcpy((char *)fb->fill->buf + fb->fill_len, data, n);
+		fb->fill_len += n;
+		data += n;
+		len -= n;
+
+		if (fb->fill_len == fb->urb_size) {
+			ret = fastboot_fill_flush(fb);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Queue @data for transfer, returning as soon as it's submitted. Only waits
+ * for a previous transfer to complete if all URBs are in flight.
+ */
+int fastboot_download_write(struct fastboot *fb, const void *data, size_t len)
+{
+	const char *p = data;
+	size_t n;
+	int ret;
+
+	if (fb->urbs[0].buf) {
+		ret = fastboot_fill(fb, data, len);
+		if (ret < 0)
+			return -1;
+
+		return fb->urb_status ? -1 : 0;
+	}
+
+	while (len) {
+		n = MIN(len, fb->urb_size);
+
+		ret = fastboot_submit(fb, p, n);
+		if (ret == -EBUSY) {
+			fastboot_reap(fb, true);
+			continue;
+		} else if (ret < 0) {
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return fb->urb_status ? -1 : 0;
+}
+
+int fastboot_download_finish(struct fastboot *fb)
+{
+	int ret;
+
+	ret = fastboot_fill_flush(fb);
+	if (ret < 0)
+		fb->urb_status = ret;
+
+	while (fb->urbs_busy) {
+		ret = fastboot_reap(fb, true);
 		if (ret < 0)
-			goto out;
+			break;
+	}
+
+	ret = fb->urb_status;
+	fb->urb_status = 0;
+	if (ret < 0)
+		return ret;
+
+	return fastboot_read(fb, NULL, 0);
+}
+
+/**
+ * fastboot_download_async() - transfer download data in the background
+ * @fb:		fastboot handle, after fastboot_download_start()
+ * @data:	data to transfer, must remain valid until @done is invoked
+ * @len:	length of @data
+ * @done:	invoked once all data is transferred, or the transfer failed
+ * @cb_data:	passed to @done
+ *
+ * URBs are refilled from the watch loop as they complete, so other events are
+ * handled while the download is in progress.
+ */
+void fastboot_download_async(struct fastboot *fb, const void *data, size_t len,
+			     void (*done)(struct fastboot *fb, int status, void *data),
+			     void *cb_data)
+{
+	fb->tx_single.iov_base = (void *)data;
+	fb->tx_single.iov_len = len;
+
+	fastboot_download_asyncv(fb, &fb->tx_single, 1, done, cb_data);
+}
+
+/* As fastboot_download_async(), the data gathered from @iov */
+void fastboot_download_asyncv(struct fastboot *fb, const struct iovec *iov, int iovcnt,
+			      void (*done)(struct fastboot *fb, int status, void *data),
+			      void *cb_data)
+{
+	fb->tx_iov = iov;
+	fb->tx_iovcnt = iovcnt;
+	fb->tx_index = 0;
+	fb->tx_offset = 0;
+	fb->tx_done = done;
+	fb->tx_cb_data = cb_data;
+
+	fastboot_tx_fill(fb);
+
+	if (!fb->urbs_busy)
+		fastboot_tx_complete(fb);
+}
 
-		offset += xfer;
-		len -= xfer;
+/**
+ * fastboot_command_async() - issue command, receiving the response later
+ * @fb:		fastboot handle
+ * @cmd:	the command
+ * @done:	invoked with the status of the command, once it completes
+ * @cb_data:	passed to @done
+ *
+ * For commands that take a while to complete on the device, such as flash,
+ * during which other events should be handled.
+ */
+void fastboot_command_async(struct fastboot *fb, const char *cmd,
+			    void (*done)(struct fastboot *fb, int status, void *data),
+			    void *cb_data)
+{
+	int ret;
+
+	ret = fastboot_write(fb, cmd, strlen(cmd));
+	if (ret >= 0)
+		ret = fastboot_rx_submit(fb);
+	if (ret < 0) {
+		done(fb, -ENXIO, cb_data);
+		return;
 	}
 
-	ret = fastboot_read(fb, NULL, 0);
+	fb->rx_done = done;
+	fb->rx_cb_data = cb_data;
+}
+
+int fastboot_download(struct fastboot *fb, const void *data, size_t len)
+{
+	int ret;
+
+	ret = fastboot_download_start(fb, len);
+	if (ret < 0)
+		return ret;
 
-out:
-	free(buf);
-	return ret;
+	ret = fastboot_download_write(fb, data, len);
+	if (ret < 0)
+		return ret;
+
+	return fastboot_download_finish(fb);
 }
 
 int fastboot_boot(struct fastboot *fb)
@@ -452,11 +998,238 @@ int fastboot_flash(struct fastboot *fb, const char *partition)
 	n = sprintf(buf, "flash:%s", partition);
 	fastboot_write(fb, buf, n);
 
-	fastboot_read(fb, buf, sizeof(buf));
+	n = fastboot_read(fb, buf, sizeof(buf));
+
+	return n < 0 ? n : 0;
+}
+
+static bool fastboot_flash_in_image(struct fastboot_flash *flash, const void *p)
+{
+	return (const char *)p >= flash->data && (const char *)p < flash->data + flash->len;
+}
+
+/* Keep a sparse image, with copies of its headers */
+static int fastboot_flash_collect(const struct iovec *iov, int iovcnt, size_t size, void *data)
+{
+	struct fastboot_flash *flash = data;
+	struct fastboot_piece *piece;
+	size_t hdr_len = 0;
+	char *p;
+	int i;
+
+	flash->pieces = realloc(flash->pieces, (flash->count + 1) * sizeof(*flash->pieces));
+	piece = &flash->pieces[flash->count++];
+
+	for (i = 0; i < iovcnt; i++) {
+		if (!fastboot_flash_in_image(flash, iov[i].iov_base))
+			hdr_len += iov[i].iov_len;
+	}
+
+	piece->iov = calloc(iovcnt, sizeof(*piece->iov));
+	piece->iovcnt = iovcnt;
+	piece->size = size;
+	piece->headers = p = malloc(hdr_len + 1);
+
+	for (i = 0; i < iovcnt; i++) {
+		piece->iov[i] = iov[i];
+		if (fastboot_flash_in_image(flash, iov[i].iov_base))
+			continue;
+
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		piece->iov[i].iov_base = p;
+		p += iov[i].iov_len;
+	}
 
 	return 0;
 }
 
+static void fastboot_flash_free(struct fastboot_flash *flash)
+{
+	size_t i;
+
+	for (i = 0; i < flash->count; i++) {
+		free(flash->pieces[i].iov);
+		free(flash->pieces[i].headers);
+	}
+
+	free(flash->pieces);
+	free(flash->partition);
+	free(flash);
+}
+
+/*
+ * Plan the flashing of an image, splitting it in sparse images if it doesn't
+ * fit in the device's download buffer.
+ */
+static struct fastboot_flash *fastboot_flash_prepare(struct fastboot *fb, const char *partition,
+						     const void *data, size_t len)
+{
+	struct fastboot_flash *flash;
+	struct iovec iov = { (void *)data, len };
+	size_t max = UINT32_MAX;
+	int ret;
+
+	if (fb->max_download_size)
+		max = MIN(fb->max_download_size, max);
+
+	flash = calloc(1, sizeof(*flash));
+	flash->fb = fb;
+	flash->partition = strdup(partition);
+	flash->data = data;
+	flash->len = len;
+
+	if (len <= max) {
+		fastboot_flash_collect(&iov, 1, len, flash);
+		return flash;
+	}
+
+	ret = sparse_split(data, len, max, fastboot_flash_collect, flash);
+	if (ret < 0) {
+		fprintf(stderr, "unable to split image for %s\n", partition);
+		fastboot_flash_free(flash);
+		return NULL;
+	}
+
+	return flash;
+}
+
+/**
+ * fastboot_flash_image() - download and flash image to partition
+ * @fb:		fastboot handle
+ * @partition:	name of the partition
+ * @data:	raw or Android sparse image
+ * @len:	length of @data
+ *
+ * Images that don't fit in the device's download buffer are split in sparse
+ * images that are downloaded and flashed one after the other.
+ *
+ * Return: 0 on success, negative on failure
+ */
+int fastboot_flash_image(struct fastboot *fb, const char *partition,
+			 const void *data, size_t len)
+{
+	struct fastboot_piece *piece;
+	struct fastboot_flash *flash;
+	int ret = 0;
+	size_t i;
+	int j;
+
+	flash = fastboot_flash_prepare(fb, partition, data, len);
+	if (!flash)
+		return -EINVAL;
+
+	for (i = 0; !ret && i < flash->count; i++) {
+		piece = &flash->pieces[i];
+
+		ret = fastboot_download_start(fb, piece->size);
+		for (j = 0; !ret && j < piece->iovcnt; j++)
+			ret = fastboot_download_write(fb, piece->iov[j].iov_base,
+						      piece->iov[j].iov_len);
+		if (!ret)
+			ret = fastboot_download_finish(fb);
+		if (ret >= 0)
+			ret = fastboot_flash(fb, partition);
+	}
+
+	fastboot_flash_free(flash);
+
+	return ret < 0 ? ret : 0;
+}
+
+static void fastboot_flash_next(struct fastboot_flash *flash);
+
+static void fastboot_flash_complete(struct fastboot_flash *flash, int status)
+{
+	flash->done(flash->fb, status, flash->cb_data);
+	fastboot_flash_free(flash);
+}
+
+static void fastboot_flash_flashed(struct fastboot *fb, int status, void *data)
+{
+	struct fastboot_flash *flash = data;
+
+	if (status < 0) {
+		fastboot_flash_complete(flash, status);
+		return;
+	}
+
+	flash->current++;
+	fastboot_flash_next(flash);
+}
+
+static void fastboot_flash_sent(struct fastboot *fb, int status, void *data)
+{
+	struct fastboot_flash *flash = data;
+	char cmd[80];
+
+	if (status >= 0)
+		status = fastboot_download_finish(fb);
+	if (status < 0) {
+		fastboot_flash_complete(flash, status);
+		return;
+	}
+
+	snprintf(cmd, sizeof(cmd), "flash:%s", flash->partition);
+	fastboot_command_async(fb, cmd, fastboot_flash_flashed, flash);
+}
+
+static void fastboot_flash_next(struct fastboot_flash *flash)
+{
+	struct fastboot_piece *piece;
+	int ret;
+
+	if (flash->current == flash->count) {
+		fastboot_flash_complete(flash, 0);
+		return;
+	}
+
+	piece = &flash->pieces[flash->current];
+
+	ret = fastboot_download_start(flash->fb, piece->size);
+	if (ret < 0) {
+		fastboot_flash_complete(flash, ret);
+		return;
+	}
+
+	fastboot_download_asyncv(flash->fb, piece->iov, piece->iovcnt,
+				 fastboot_flash_sent, flash);
+}
+
+/**
+ * fastboot_flash_image_async() - download and flash image in the background
+ * @fb:		fastboot handle
+ * @partition:	name of the partition
+ * @data:	raw or Android sparse image, valid until @done is invoked
+ * @len:	length of @data
+ * @done:	invoked once the image is flashed, or flashing failed
+ * @cb_data:	passed to @done
+ *
+ * As fastboot_flash_image(), but returns right away.
+ */
+void fastboot_flash_image_async(struct fastboot *fb, const char *partition,
+				const void *data, size_t len,
+				void (*done)(struct fastboot *fb, int status, void *data),
+				void *cb_data)
+{
+	struct fastboot_flash *flash;
+
+	flash = fastboot_flash_prepare(fb, partition, data, len);
+	if (!flash) {
+		done(fb, -EINVAL, cb_data);
+		return;
+	}
+
+	flash->done = done;
+	flash->cb_data = cb_data;
+
+	fastboot_flash_next(flash);
+}
+
+size_t fastboot_max_download_size(struct fastboot *fb)
+{
+	return fb->max_download_size;
+}
+
 int fastboot_reboot(struct fastboot *fb)
 {
 	char buf[80];
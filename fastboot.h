@@ -1,6 +1,8 @@
 #ifndef __FASTBOOT_H__
 #define __FASTBOOT_H__
 
+#include <sys/uio.h>
+
 struct fastboot;
 
 struct fastboot_ops {
@@ -12,10 +14,29 @@ struct fastboot_ops {
 struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, void *);
 int fastboot_getvar(struct fastboot *fb, const char *var, char *buf, size_t len);
 int fastboot_download(struct fastboot *fb, const void *data, size_t len);
+int fastboot_download_start(struct fastboot *fb, size_t len);
+int fastboot_download_write(struct fastboot *fb, const void *data, size_t len);
+int fastboot_download_finish(struct fastboot *fb);
+void fastboot_download_async(struct fastboot *fb, const void *data, size_t len,
+			     void (*done)(struct fastboot *fb, int status, void *data),
+			     void *cb_data);
+void fastboot_download_asyncv(struct fastboot *fb, const struct iovec *iov, int iovcnt,
+			      void (*done)(struct fastboot *fb, int status, void *data),
+			      void *cb_data);
+void fastboot_command_async(struct fastboot *fb, const char *cmd,
+			    void (*done)(struct fastboot *fb, int status, void *data),
+			    void *cb_data);
 int fastboot_boot(struct fastboot *fb);
 int fastboot_erase(struct fastboot *fb, const char *partition);
 int fastboot_set_active(struct fastboot *fb, const char *active);
 int fastboot_flash(struct fastboot *fb, const char *partition);
+int fastboot_flash_image(struct fastboot *fb, const char *partition,
+			 const void *data, size_t len);
+void fastboot_flash_image_async(struct fastboot *fb, const char *partition,
+				const void *data, size_t len,
+				void (*done)(struct fastboot *fb, int status, void *data),
+				void *cb_data);
+size_t fastboot_max_download_size(struct fastboot *fb);
 int fastboot_reboot(struct fastboot *fb);
 int fastboot_continue(struct fastboot *fb);
 
@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Content addressed cache of boot images, keyed by their SHA-256 digest. The
+ * modification time of each cached image is bumped as it's used, so that the
+ * least recently used images can be evicted when the cache grows too large.
+ *
+ * The image last booted on each board by each user is referenced by a symlink,
+ * providing the base for delta uploads of the next image.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <yaml.h>
+
+#include "cdba.h"
+#include "device_parser.h"
+#include "fastboot_cache.h"
+#include "sha256.h"
+
+#define TOKEN_LENGTH	256
+
+struct fastboot_cache_entry {
+	int fd;
+	size_t size;
+	size_t written;
+	bool failed;
+
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	struct sha256_ctx ctx;
+
+	char tmp_path[PATH_MAX];
+	char path[PATH_MAX];
+};
+
+struct cache_file {
+	char name[2 * SHA256_DIGEST_SIZE + 1];
+	off_t size;
+	struct timespec mtime;
+};
+
+static char *cache_path;
+static unsigned long long cache_size;
+
+static unsigned long long parse_size(const char *value)
+{
+	unsigned long long size;
+	char *end;
+
+	size = strtoull(value, &end, 10);
+	switch (*end) {
+	case 'G':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'M':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'K':
+		size *= 1024;
+		break;
+	case '\0':
+		break;
+	default:
+		errx(1, "fastboot_cache: invalid size \"%s\"", value);
+	}
+
+	return size;
+}
+
+void fastboot_cache_parse_options(struct device_parser *dp)
+{
+	char value[TOKEN_LENGTH];
+	char key[TOKEN_LENGTH];
+
+	device_parser_expect(dp, YAML_MAPPING_START_EVENT, NULL, 0);
+
+	while (device_parser_accept(dp, YAML_SCALAR_EVENT, key, TOKEN_LENGTH)) {
+		if (!device_parser_accept(dp, YAML_SCALAR_EVENT, value, TOKEN_LENGTH))
+			errx(1, "%s: expected value for \"%s\"", __func__, key);
+
+		if (!strcmp(key, "path"))
+			cache_path = strdup(value);
+		else if (!strcmp(key, "size"))
+			cache_size = parse_size(value);
+		else
+			errx(1, "%s: unknown option \"%s\"", __func__, key);
+	}
+
+	device_parser_expect(dp, YAML_MAPPING_END_EVENT, NULL, 0);
+
+	if (!cache_path)
+		errx(1, "%s: cache path not specified", __func__);
+}
+
+static int fastboot_cache_path(char *path, const char *name)
+{
+	int n;
+
+	n = snprintf(path, PATH_MAX, "%s/%s", cache_path, name);
+
+	return n >= PATH_MAX ? -1 : 0;
+}
+
+static void digest_to_name(const uint8_t *digest, char *name)
+{
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		sprintf(name + 2 * i, "%02x", digest[i]);
+}
+
+/**
+ * fastboot_cache_lookup() - find image in the cache
+ * @digest:	SHA-256 digest of the image
+ * @size:	size of the image
+ *
+ * Return: read-only mapping of @size bytes of the image, NULL if not cached
+ */
+void *fastboot_cache_lookup(const uint8_t *digest, size_t size)
+{
+	char name[2 * SHA256_DIGEST_SIZE + 1];
+	char path[PATH_MAX];
+	struct stat sb;
+	void *data;
+	int fd;
+
+	if (!cache_path || !size)
+		return NULL;
+
+	digest_to_name(digest, name);
+	if (fastboot_cache_path(path, name) < 0)
+		return NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &sb) < 0 || sb.st_size != (off_t)size) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	/* Mark the image as recently used */
+	utimensat(AT_FDCWD, path, NULL, 0);
+
+	return data;
+}
+
+/**
+ * fastboot_cache_insert() - start adding an image to the cache
+ * @digest:	SHA-256 digest the client claims for the image
+ * @size:	size of the image
+ *
+ * The image content is passed using fastboot_cache_write() as it's received
+ * and is only made available for lookups by fastboot_cache_commit(), if it
+ * matches @digest.
+ *
+ * Return: cache entry, NULL if the image will not be cached
+ */
+struct fastboot_cache_entry *fastboot_cache_insert(const uint8_t *digest, size_t size)
+{
+	struct fastboot_cache_entry *entry;
+	char name[2 * SHA256_DIGEST_SIZE + 1];
+	int ret;
+
+	if (!cache_path || !size || (cache_size && size > cache_size))
+		return NULL;
+
+	ret = mkdir(cache_path, 0755);
+	if (ret < 0 && errno != EEXIST) {
+		warn("failed to create fastboot cache %s", cache_path);
+		return NULL;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	entry->size = size;
+	memcpy(entry->digest, digest, SHA256_DIGEST_SIZE);
+	sha256_init(&entry->ctx);
+
+	digest_to_name(digest, name);
+	if (fastboot_cache_path(entry->path, name) < 0 ||
+	    fastboot_cache_path(entry->tmp_path, ".tmp-XXXXXX") < 0)
+		goto free_entry;
+
+	entry->fd = mkstemp(entry->tmp_path);
+	if (entry->fd < 0) {
+		warn("failed to create fastboot cache entry");
+		goto free_entry;
+	}
+
+	return entry;
+
+free_entry:
+	free(entry);
+	return NULL;
+}
+
+void fastboot_cache_write(struct fastboot_cache_entry *entry, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	if (!entry || entry->failed)
+		return;
+
+	sha256_update(&entry->ctx, data, len);
+	entry->written += len;
+
+	while (len) {
+		n = write(entry->fd, p, len);
+		if (n < 0) {
+			warn("failed to write fastboot cache entry");
+			entry->failed = true;
+			return;
+		}
+
+		p += n;
+		len -= n;
+	}
+}
+
+static int cache_file_cmp(const void *a, const void *b)
+{
+	const struct cache_file *fa = a;
+	const struct cache_file *fb = b;
+
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+		return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+	if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+		return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+
+	return 0;
+}
+
+/* Drop the least recently used images until the cache fits its size limit */
+static void fastboot_cache_evict(void)
+{
+	struct cache_file *files = NULL;
+	unsigned long long total = 0;
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat sb;
+	size_t count = 0;
+	size_t i;
+	DIR *dir;
+
+	if (!cache_size)
+		return;
+
+	dir = opendir(cache_path);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (strlen(de->d_name) != 2 * SHA256_DIGEST_SIZE)
+			continue;
+
+		if (fstatat(dirfd(dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0 ||
+		    !S_ISREG(sb.st_mode))
+			continue;
+
+		files = realloc(files, (count + 1) * sizeof(*files));
+		strcpy(files[count].name, de->d_name);
+		files[count].size = sb.st_size;
+		files[count].mtime = sb.st_mtim;
+		count++;
+
+		total += sb.st_size;
+	}
+	closedir(dir);
+
+	qsort(files, count, sizeof(*files), cache_file_cmp);
+
+	for (i = 0; i < count && total > cache_size; i++) {
+		if (fastboot_cache_path(path, files[i].name) < 0)
+			continue;
+
+		if (unlink(path) == 0)
+			total -= files[i].size;
+	}
+
+	free(files);
+}
+
+/**
+ * fastboot_cache_commit() - make the written image available for lookups
+ * @entry:	cache entry, as returned by fastboot_cache_insert()
+ *
+ * Return: 0 if the image was added to the cache, -1 otherwise
+ */
+int fastboot_cache_commit(struct fastboot_cache_entry *entry)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	int ret;
+
+	if (!entry)
+		return -1;
+
+	sha256_final(&entry->ctx, digest);
+
+	if (entry->failed || entry->written != entry->size) {
+		fastboot_cache_abort(entry);
+		return -1;
+	}
+
+	/* Never store an image under somebody else's digest */
+	if (memcmp(digest, entry->digest, SHA256_DIGEST_SIZE)) {
+		warnx("fastboot image doesn't match its digest, not caching");
+		fastboot_cache_abort(entry);
+		return -1;
+	}
+
+	close(entry->fd);
+
+	ret = rename(entry->tmp_path, entry->path);
+	if (ret < 0) {
+		warn("failed to add image to fastboot cache");
+		unlink(entry->tmp_path);
+	}
+
+	free(entry);
+
+	fastboot_cache_evict();
+
+	return ret;
+}
+
+void fastboot_cache_abort(struct fastboot_cache_entry *entry)
+{
+	if (!entry)
+		return;
+
+	close(entry->fd);
+	unlink(entry->tmp_path);
+	free(entry);
+}
+
+/*
+ * Append @s to the name in @buf, escaping '%', '-' and '/' as %XX so that
+ * the board and user components of the name can't run into each other.
+ */
+static int last_name_append(char *buf, size_t size, size_t *len, const char *s)
+{
+	int n;
+
+	for (; *s; s++) {
+		if (*s == '%' || *s == '-' || *s == '/')
+			n = snprintf(buf + *len, size - *len, "%%%02X", (unsigned char)*s);
+		else
+			n = snprintf(buf + *len, size - *len, "%c", *s);
+
+		if (n >= (int)(size - *len))
+			return -1;
+
+		*len += n;
+	}
+
+	return 0;
+}
+
+static int fastboot_cache_last_path(char *path, const char *board, const char *user)
+{
+	char name[NAME_MAX + 1] = ".last-";
+	size_t len = strlen(name);
+
+	if (last_name_append(name, sizeof(name), &len, board) < 0 ||
+	    len + 1 >= sizeof(name))
+		return -1;
+
+	name[len++] = '-';
+	name[len] = '\0';
+
+	if (last_name_append(name, sizeof(name), &len, user) < 0)
+		return -1;
+
+	return fastboot_cache_path(path, name);
+}
+
+/**
+ * fastboot_cache_set_last() - record the image last booted on a board
+ * @board:	name of the board
+ * @user:	user booting the board
+ * @digest:	SHA-256 digest of the cached image
+ */
+void fastboot_cache_set_last(const char *board, const char *user, const uint8_t *digest)
+{
+	char name[2 * SHA256_DIGEST_SIZE + 1];
+	char tmp_name[32];
+	char tmp_path[PATH_MAX];
+	char path[PATH_MAX];
+
+	if (!cache_path)
+		return;
+
+	digest_to_name(digest, name);
+	snprintf(tmp_name, sizeof(tmp_name), ".tmp-last-%d", getpid());
+	if (fastboot_cache_last_path(path, board, user) < 0 ||
+	    fastboot_cache_path(tmp_path, tmp_name) < 0)
+		return;
+
+	/* Replace the link atomically, a concurrent reader sees old or new */
+	unlink(tmp_path);
+	if (symlink(name, tmp_path) < 0 || rename(tmp_path, path) < 0) {
+		warn("failed to record last fastboot image");
+		unlink(tmp_path);
+	}
+}
+
+/**
+ * fastboot_cache_last() - find the image last booted on a board
+ * @board:	name of the board
+ * @user:	user booting the board
+ * @size:	size of the returned image
+ *
+ * Return: read-only mapping of the image, NULL if there's none in the cache
+ */
+void *fastboot_cache_last(const char *board, const char *user, size_t *size)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	void *data;
+	int fd;
+
+	if (!cache_path)
+		return NULL;
+
+	if (fastboot_cache_last_path(path, board, user) < 0)
+		return NULL;
+
+	/* The image might have been evicted, leaving the link dangling */
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &sb) < 0 || !sb.st_size) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	utimensat(AT_FDCWD, path, NULL, 0);
+
+	*size = sb.st_size;
+
+	return data;
+}
@@ -0,0 +1,21 @@
+#ifndef __FASTBOOT_CACHE_H__
+#define __FASTBOOT_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct device_parser;
+struct fastboot_cache_entry;
+
+void fastboot_cache_parse_options(struct device_parser *dp);
+
+void *fastboot_cache_lookup(const uint8_t *digest, size_t size);
+struct fastboot_cache_entry *fastboot_cache_insert(const uint8_t *digest, size_t size);
+void fastboot_cache_write(struct fastboot_cache_entry *entry, const void *data, size_t len);
+int fastboot_cache_commit(struct fastboot_cache_entry *entry);
+void fastboot_cache_abort(struct fastboot_cache_entry *entry);
+
+void fastboot_cache_set_last(const char *board, const char *user, const uint8_t *digest);
+void *fastboot_cache_last(const char *board, const char *user, size_t *size);
+
+#endif
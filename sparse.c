@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Splitting of images in Android sparse images, that each fit in the
+ * bootloader's download buffer. Every sparse image describes the full
+ * partition, with the blocks carried by other sparse images skipped, so they
+ * can be flashed back to back.
+ */
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdba.h"
+#include "sparse.h"
+
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+#define SPARSE_BLOCK_SIZE	4096
+
+#define CHUNK_TYPE_RAW		0xcac1
+#define CHUNK_TYPE_FILL		0xcac2
+#define CHUNK_TYPE_DONT_CARE	0xcac3
+#define CHUNK_TYPE_CRC32	0xcac4
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+} __packed;
+
+struct chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;
+	uint32_t total_sz;
+} __packed;
+
+struct sparse_chunk {
+	uint16_t type;
+	uint32_t blocks;
+	const char *data;
+	size_t len;
+};
+
+struct sparse_file {
+	uint32_t blk_sz;
+	uint32_t total_blks;
+
+	struct sparse_chunk *chunks;
+	size_t count;
+};
+
+static const char sparse_zeroes[SPARSE_BLOCK_SIZE];
+
+static void sparse_add(struct sparse_file *sf, uint16_t type, uint32_t blocks,
+		       const char *data, size_t len)
+{
+	struct sparse_chunk *chunk;
+
+	sf->chunks = realloc(sf->chunks, (sf->count + 1) * sizeof(*sf->chunks));
+	chunk = &sf->chunks[sf->count++];
+	chunk->type = type;
+	chunk->blocks = blocks;
+	chunk->data = data;
+	chunk->len = len;
+}
+
+/* Describe a raw image as one RAW chunk, the last block padded with zeroes */
+static int sparse_from_raw(struct sparse_file *sf, const char *data, size_t len)
+{
+	size_t blocks = (len + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE;
+
+	if (blocks > UINT32_MAX)
+		return -EINVAL;
+
+	sf->blk_sz = SPARSE_BLOCK_SIZE;
+	sf->total_blks = blocks;
+
+	sparse_add(sf, CHUNK_TYPE_RAW, blocks, data, len);
+
+	return 0;
+}
+
+static int sparse_parse(struct sparse_file *sf, const char *data, size_t len)
+{
+	const struct sparse_header *hdr = (const void *)data;
+	const struct chunk_header *chunk;
+	const char *end = data + len;
+	const char *p;
+	size_t payload;
+	uint32_t i;
+
+	if (len < sizeof(*hdr) || hdr->major_version != 1 ||
+	    hdr->file_hdr_sz < sizeof(*hdr) ||
+	    hdr->chunk_hdr_sz < sizeof(*chunk) ||
+	    !hdr->blk_sz || hdr->blk_sz % 4)
+		return -EINVAL;
+
+	sf->blk_sz = hdr->blk_sz;
+	sf->total_blks = hdr->total_blks;
+
+	p = data + hdr->file_hdr_sz;
+	for (i = 0; i < hdr->total_chunks; i++) {
+		chunk = (const void *)p;
+		if (end - p < hdr->chunk_hdr_sz || chunk->total_sz < hdr->chunk_hdr_sz ||
+		    end - p < chunk->total_sz)
+			return -EINVAL;
+
+		payload = chunk->total_sz - hdr->chunk_hdr_sz;
+		p += hdr->chunk_hdr_sz;
+
+		switch (chunk->chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (payload != (size_t)chunk->chunk_sz * hdr->blk_sz)
+				return -EINVAL;
+			break;
+		case CHUNK_TYPE_FILL:
+			if (payload != sizeof(uint32_t))
+				return -EINVAL;
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			break;
+		case CHUNK_TYPE_CRC32:
+			/* The checksum no longer applies once split */
+			p += payload;
+			continue;
+		default:
+			return -EINVAL;
+		}
+
+		sparse_add(sf, chunk->chunk_type, chunk->chunk_sz, p, payload);
+		p += payload;
+	}
+
+	return 0;
+}
+
+struct sparse_piece {
+	struct sparse_header hdr;
+	struct chunk_header *chunk_hdrs;
+	struct iovec *iov;
+	int iovcnt;
+	size_t size;
+	uint32_t blocks;
+};
+
+static void piece_chunk(struct sparse_piece *piece, uint16_t type, uint32_t blocks,
+			const char *data, size_t len, size_t pad)
+{
+	struct chunk_header *hdr = &piece->chunk_hdrs[piece->hdr.total_chunks++];
+
+	hdr->chunk_type = type;
+	hdr->reserved1 = 0;
+	hdr->chunk_sz = blocks;
+	hdr->total_sz = sizeof(*hdr) + len + pad;
+
+	piece->iov[piece->iovcnt].iov_base = hdr;
+	piece->iov[piece->iovcnt++].iov_len = sizeof(*hdr);
+
+	if (len) {
+		piece->iov[piece->iovcnt].iov_base = (void *)data;
+		piece->iov[piece->iovcnt++].iov_len = len;
+	}
+
+	if (pad) {
+		piece->iov[piece->iovcnt].iov_base = (void *)sparse_zeroes;
+		piece->iov[piece->iovcnt++].iov_len = pad;
+	}
+
+	piece->size += hdr->total_sz;
+	piece->blocks += blocks;
+}
+
+static void piece_reset(struct sparse_piece *piece, const struct sparse_file *sf,
+			uint32_t skip)
+{
+	piece->hdr.total_chunks = 0;
+	piece->iovcnt = 1;
+	piece->size = sizeof(piece->hdr);
+	piece->blocks = 0;
+
+	/* Skip the blocks carried by previous pieces */
+	if (skip)
+		piece_chunk(piece, CHUNK_TYPE_DONT_CARE, skip, NULL, 0, 0);
+}
+
+static int piece_emit(struct sparse_piece *piece, const struct sparse_file *sf,
+		      int (*cb)(const struct iovec *iov, int iovcnt, size_t size, void *data),
+		      void *cb_data)
+{
+	if (piece->blocks < sf->total_blks)
+		piece_chunk(piece, CHUNK_TYPE_DONT_CARE,
+			    sf->total_blks - piece->blocks, NULL, 0, 0);
+
+	return cb(piece->iov, piece->iovcnt, piece->size, cb_data);
+}
+
+/**
+ * sparse_split() - split image in sparse images of limited size
+ * @data:	raw or sparse image
+ * @len:	length of @data
+ * @max:	maximum size of each resulting sparse image
+ * @cb:		invoked for each sparse image, described by an iovec
+ * @cb_data:	passed to @cb
+ *
+ * Return: 0 on success, negative errno on failure or as returned from @cb
+ */
+int sparse_split(const void *data, size_t len, size_t max,
+		 int (*cb)(const struct iovec *iov, int iovcnt, size_t size, void *data),
+		 void *cb_data)
+{
+	const struct sparse_header *in_hdr = data;
+	struct sparse_file sf = {};
+	struct sparse_piece piece = {};
+	/* Room for a chunk header and skipping of the remaining blocks */
+	size_t overhead = 2 * sizeof(struct chunk_header);
+	const struct sparse_chunk *chunk;
+	uint32_t start = 0;
+	uint32_t blocks;
+	size_t chunk_len;
+	size_t offset;
+	size_t avail;
+	size_t pad;
+	size_t i;
+	int ret;
+
+	if (len >= sizeof(*in_hdr) && in_hdr->magic == SPARSE_HEADER_MAGIC)
+		ret = sparse_parse(&sf, data, len);
+	else
+		ret = sparse_from_raw(&sf, data, len);
+	if (ret < 0)
+		goto out;
+
+	ret = -EINVAL;
+	if (max < sizeof(piece.hdr) + 2 * overhead + sf.blk_sz)
+		goto out;
+
+	piece.hdr.magic = SPARSE_HEADER_MAGIC;
+	piece.hdr.major_version = 1;
+	piece.hdr.file_hdr_sz = sizeof(struct sparse_header);
+	piece.hdr.chunk_hdr_sz = sizeof(struct chunk_header);
+	piece.hdr.blk_sz = sf.blk_sz;
+	piece.hdr.total_blks = sf.total_blks;
+
+	/* Splitting RAW chunks adds at most one chunk per piece */
+	piece.chunk_hdrs = calloc(sf.count + 3, sizeof(*piece.chunk_hdrs));
+	piece.iov = calloc(3 * (sf.count + 3) + 1, sizeof(*piece.iov));
+	piece.iov[0].iov_base = &piece.hdr;
+	piece.iov[0].iov_len = sizeof(piece.hdr);
+
+	piece_reset(&piece, &sf, 0);
+
+	for (i = 0; i < sf.count; i++) {
+		chunk = &sf.chunks[i];
+		offset = 0;
+		blocks = chunk->blocks;
+
+		while (blocks) {
+			avail = 0;
+			if (piece.size + overhead < max)
+				avail = max - piece.size - overhead;
+
+			if (chunk->type != CHUNK_TYPE_RAW) {
+				if (avail < chunk->len) {
+					ret = piece_emit(&piece, &sf, cb, cb_data);
+					if (ret < 0)
+						goto out;
+					piece_reset(&piece, &sf, start);
+				}
+
+				piece_chunk(&piece, chunk->type, blocks, chunk->data, chunk->len, 0);
+				start += blocks;
+				break;
+			}
+
+			/* Take as many whole blocks as fit in this piece */
+			chunk_len = MIN((size_t)blocks, avail / sf.blk_sz);
+			if (!chunk_len) {
+				ret = piece_emit(&piece, &sf, cb, cb_data);
+				if (ret < 0)
+					goto out;
+				piece_reset(&piece, &sf, start);
+				continue;
+			}
+
+			/* Only a raw image's last block is short, pad it */
+			pad = 0;
+			if (offset + chunk_len * sf.blk_sz > chunk->len)
+				pad = offset + chunk_len * sf.blk_sz - chunk->len;
+
+			piece_chunk(&piece, CHUNK_TYPE_RAW, chunk_len,
+				    chunk->data + offset,
+				    chunk_len * sf.blk_sz - pad, pad);
+
+			offset += chunk_len * sf.blk_sz;
+			blocks -= chunk_len;
+			start += chunk_len;
+		}
+	}
+
+	ret = piece_emit(&piece, &sf, cb, cb_data);
+
+out:
+	free(piece.chunk_hdrs);
+	free(piece.iov);
+	free(sf.chunks);
+
+	return ret;
+}
@@ -0,0 +1,12 @@
+#ifndef __SPARSE_H__
+#define __SPARSE_H__
+
+#include <sys/uio.h>
+
+#include <stddef.h>
+
+int sparse_split(const void *data, size_t len, size_t max,
+		 int (*cb)(const struct iovec *iov, int iovcnt, size_t size, void *data),
+		 void *cb_data);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "staging.h"
+
+#define STAGING_MIN_CAPACITY	(1024 * 1024)
+
+static int staging_resize(struct staging *stage, size_t capacity)
+{
+	void *p;
+	int ret;
+
+	ret = ftruncate(stage->fd, capacity);
+	if (ret < 0)
+		return -1;
+
+	if (stage->data)
+		p = mremap(stage->data, stage->capacity, capacity, MREMAP_MAYMOVE);
+	else
+		p = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, stage->fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	stage->data = p;
+	stage->capacity = capacity;
+
+	return 0;
+}
+
+/**
+ * staging_init() - prepare a memfd backed staging area
+ * @stage:	staging object to initialize
+ * @size:	expected size of the content, or 0 if unknown
+ *
+ * The mapping is created once for the announced size, and grown by remapping
+ * (rather than copying) if more data than expected arrives.
+ *
+ * Return: 0 on success, negative on failure
+ */
+int staging_init(struct staging *stage, size_t size)
+{
+	memset(stage, 0, sizeof(*stage));
+
+	stage->fd = memfd_create("cdba-staging", MFD_CLOEXEC);
+	if (stage->fd < 0)
+		return -1;
+
+	if (staging_resize(stage, size ? size : STAGING_MIN_CAPACITY) < 0) {
+		close(stage->fd);
+		stage->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int staging_append(struct staging *stage, const void *data, size_t len)
+{
+	size_t capacity = stage->capacity;
+
+	while (stage->size + len > capacity)
+		capacity = capacity * 2;
+
+	if (capacity != stage->capacity && staging_resize(stage, capacity) < 0)
+		return -1;
+
+	memcpy((char *)stage->data + stage->size, data, len);
+	stage->size += len;
+
+	return 0;
+}
+
+void staging_release(struct staging *stage)
+{
+	if (stage->data)
+		munmap(stage->data, stage->capacity);
+	if (stage->fd >= 0)
+		close(stage->fd);
+
+	memset(stage, 0, sizeof(*stage));
+	stage->fd = -1;
+}
@@ -0,0 +1,17 @@
+#ifndef __STAGING_H__
+#define __STAGING_H__
+
+#include <stddef.h>
+
+struct staging {
+	int fd;
+	void *data;
+	size_t size;
+	size_t capacity;
+};
+
+int staging_init(struct staging *stage, size_t size);
+int staging_append(struct staging *stage, const void *data, size_t len);
+void staging_release(struct staging *stage);
+
+#endif
@@ -5,6 +5,8 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <unistd.h>
@@ -13,12 +15,76 @@
 
 #include "tty.h"
 
-int tty_open(const char *tty, struct termios *old)
+#define ARRAY_SIZE(x) ((sizeof(x)/sizeof((x)[0])))
+
+static const struct {
+	unsigned int baud;
+	speed_t speed;
+} tty_speeds[] = {
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+	{ 460800, B460800 },
+	{ 500000, B500000 },
+	{ 576000, B576000 },
+	{ 921600, B921600 },
+	{ 1000000, B1000000 },
+	{ 1152000, B1152000 },
+	{ 1500000, B1500000 },
+	{ 2000000, B2000000 },
+	{ 2500000, B2500000 },
+	{ 3000000, B3000000 },
+	{ 3500000, B3500000 },
+	{ 4000000, B4000000 },
+};
+
+static speed_t tty_speed(unsigned int baud)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(tty_speeds); i++) {
+		if (tty_speeds[i].baud == baud)
+			return tty_speeds[i].speed;
+	}
+
+	return B0;
+}
+
+/* Ask the driver to not hold on to received data, where supported */
+static void tty_set_low_latency(int fd)
 {
+	struct serial_struct serial;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial) < 0)
+		return;
+
+	serial.flags |= ASYNC_LOW_LATENCY;
+	ioctl(fd, TIOCSSERIAL, &serial);
+}
+
+/**
+ * tty_open() - open and configure a serial port
+ * @tty:	path of the tty
+ * @old:	filled with the original settings of the tty
+ * @options:	baud rate, flow control and latency, or NULL for 115200 8N1
+ *		without flow control
+ *
+ * Return: file descriptor of the tty
+ */
+int tty_open(const char *tty, struct termios *old, const struct tty_options *options)
+{
+	unsigned int baud = TTY_DEFAULT_BAUD;
 	struct termios tios;
+	speed_t speed;
 	int ret;
 	int fd;
 
+	if (options && options->baud)
+		baud = options->baud;
+
 	fd = open(tty, O_RDWR | O_NOCTTY | O_EXCL);
 	if (fd < 0)
 		err(1, "unable to open \"%s\"", tty);
@@ -27,10 +93,19 @@ int tty_open(const char *tty, struct termios *old)
 	if (ret < 0)
 		err(1, "unable to retrieve \"%s\" tios", tty);
 
+	speed = tty_speed(baud);
+
 	memset(&tios, 0, sizeof(tios));
-	tios.c_cflag = B115200 | CS8 | CLOCAL | CREAD;
+	tios.c_cflag = CS8 | CLOCAL | CREAD;
 	tios.c_iflag = IGNPAR;
 	tios.c_oflag = 0;
+	cfsetispeed(&tios, speed == B0 ? B115200 : speed);
+	cfsetospeed(&tios, speed == B0 ? B115200 : speed);
+
+	if (options && options->flow_control == TTY_FLOW_RTSCTS)
+		tios.c_cflag |= CRTSCTS;
+	else if (options && options->flow_control == TTY_FLOW_XONXOFF)
+		tios.c_iflag |= IXON | IXOFF;
 
 	tcflush(fd, TCIFLUSH);
 
@@ -38,5 +113,30 @@ int tty_open(const char *tty, struct termios *old)
 	if (ret < 0)
 		err(1, "unable to update \"%s\" tios", tty);
 
+	/* Rates without a Bxxx constant are applied on top of the rest */
+	if (speed == B0 && tty_set_custom_baud(fd, baud) < 0)
+		err(1, "unable to set baud rate %u on \"%s\"", baud, tty);
+
+	if (options && options->low_latency)
+		tty_set_low_latency(fd);
+
 	return fd;
 }
+
+/**
+ * tty_parse_flow_control() - parse flow control setting of the configuration
+ * @value:	"none", "rtscts" or "xonxoff"
+ *
+ * Return: the flow control, or -1 if @value isn't recognized
+ */
+int tty_parse_flow_control(const char *value)
+{
+	if (!strcmp(value, "none"))
+		return TTY_FLOW_NONE;
+	else if (!strcmp(value, "rtscts"))
+		return TTY_FLOW_RTSCTS;
+	else if (!strcmp(value, "xonxoff"))
+		return TTY_FLOW_XONXOFF;
+
+	return -1;
+}
@@ -1,7 +1,25 @@
 #ifndef __TTY_H__
 #define __TTY_H__
 
+#include <stdbool.h>
+
+#define TTY_DEFAULT_BAUD	115200
+
+enum tty_flow_control {
+	TTY_FLOW_NONE,
+	TTY_FLOW_RTSCTS,
+	TTY_FLOW_XONXOFF,
+};
+
+struct tty_options {
+	unsigned int baud;
+	enum tty_flow_control flow_control;
+	bool low_latency;
+};
+
 struct termios;
-int tty_open(const char *tty, struct termios *old);
+int tty_open(const char *tty, struct termios *old, const struct tty_options *options);
+int tty_parse_flow_control(const char *value);
+int tty_set_custom_baud(int fd, unsigned int baud);
 
 #endif
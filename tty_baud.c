@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Baud rates without a Bxxx constant, using the termios2 interface of the
+ * kernel. Its definitions in <asm/termbits.h> conflict with <termios.h>, so
+ * they're kept apart from the rest of tty.c.
+ */
+#include <sys/ioctl.h>
+#include <asm/ioctls.h>
+#include <asm/termbits.h>
+#include <errno.h>
+
+#include "tty.h"
+
+/**
+ * tty_set_custom_baud() - configure an arbitrary baud rate
+ * @fd:		file descriptor of the tty
+ * @baud:	baud rate
+ *
+ * Return: 0 on success, -1 with errno set on failure
+ */
+int tty_set_custom_baud(int fd, unsigned int baud)
+{
+#if defined(TCGETS2) && defined(BOTHER)
+	struct termios2 tios2;
+
+	if (ioctl(fd, TCGETS2, &tios2) < 0)
+		return -1;
+
+	tios2.c_cflag &= ~CBAUD;
+	tios2.c_cflag |= BOTHER;
+	tios2.c_ispeed = baud;
+	tios2.c_ospeed = baud;
+
+	return ioctl(fd, TCSETS2, &tios2);
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
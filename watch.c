@@ -5,7 +5,8 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <alloca.h>
 #include <err.h>
 #include <errno.h>
@@ -15,108 +16,430 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cdba.h"
 #include "list.h"
 #include "watch.h"
 
+#define WATCH_MAX_EVENTS	32
+
 static bool quit_invoked;
 
+/* The read and write watches of a file descriptor, registered with epoll */
 struct watch {
 	struct list_head node;
 
 	int fd;
-	int (*cb)(int, void*);
-	void *data;
+
+	int (*read_cb)(int, void*);
+	void *read_data;
+
+	int (*write_cb)(int, void*);
+	void *write_data;
+
+	/* Not pollable, such as a regular file, and always ready */
+	bool always;
+	bool removed;
 };
 
-struct timer {
-	struct list_head node;
-	struct timeval tv;
+struct watch_timer {
+	struct timespec ts;
+	int interval_ms;
+
+	/* Position in the timer heap, or -1 when not scheduled */
+	int index;
+	bool cancelled;
 
 	void (*cb)(void *);
 	void *data;
 };
 
-static struct list_head read_watches = LIST_INIT(read_watches);
-static struct list_head timer_watches = LIST_INIT(timer_watches);
+static struct list_head watches = LIST_INIT(watches);
 
-void watch_add_readfd(int fd, int (*cb)(int, void*), void *data)
+/* Pending timers, as a binary min-heap ordered by expiry */
+static struct watch_timer **timers;
+static int timer_count;
+static int timer_capacity;
+static struct watch_timer *timer_firing;
+
+static int epoll_fd = -1;
+static int timer_fd = -1;
+
+static int watch_epoll(void)
+{
+	if (epoll_fd < 0) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0)
+			err(1, "failed to create epoll instance");
+	}
+
+	return epoll_fd;
+}
+
+static struct watch *watch_find(int fd)
 {
 	struct watch *w;
 
+	list_for_each_entry(w, &watches, node) {
+		if (w->fd == fd && !w->removed)
+			return w;
+	}
+
+	return NULL;
+}
+
+/* Register, update or unregister the watch with epoll, per its callbacks */
+static void watch_update(struct watch *w, int op)
+{
+	struct epoll_event ev = { .data.ptr = w };
+	int ret;
+
+	if (w->read_cb)
+		ev.events |= EPOLLIN;
+	if (w->write_cb)
+		ev.events |= EPOLLOUT;
+
+	if (!ev.events) {
+		if (!w->always)
+			epoll_ctl(watch_epoll(), EPOLL_CTL_DEL, w->fd, NULL);
+		w->removed = true;
+		return;
+	}
+
+	if (w->always)
+		return;
+
+	ret = epoll_ctl(watch_epoll(), op, w->fd, &ev);
+	if (ret < 0 && errno == EPERM)
+		w->always = true;
+	else if (ret < 0)
+		err(1, "failed to watch fd %d", w->fd);
+}
+
+static struct watch *watch_get(int fd, int *op)
+{
+	struct watch *w;
+
+	w = watch_find(fd);
+	if (w) {
+		*op = EPOLL_CTL_MOD;
+		return w;
+	}
+
 	w = calloc(1, sizeof(*w));
 	w->fd = fd;
-	w->cb = cb;
-	w->data = data;
+	list_add(&watches, &w->node);
 
-	list_add(&read_watches, &w->node);
+	*op = EPOLL_CTL_ADD;
+	return w;
 }
 
-void watch_timer_add(int timeout_ms, void (*cb)(void *), void *data)
+void watch_add_readfd(int fd, int (*cb)(int, void*), void *data)
 {
-	struct timeval tv_timeout;
-	struct timeval now;
-	struct timer *t;
+	struct watch *w;
+	int op;
 
-	t = calloc(1, sizeof(*t));
+	w = watch_get(fd, &op);
+	w->read_cb = cb;
+	w->read_data = data;
+
+	watch_update(w, op);
+}
+
+/**
+ * watch_add_writefd() - invoke callback while fd is writable
+ * @fd:		file descriptor to watch
+ * @cb:		callback, invoked with @fd and @data
+ * @data:	passed to @cb
+ *
+ * Watches are level triggered, the watch should be removed while there's
+ * nothing to write.
+ */
+void watch_add_writefd(int fd, int (*cb)(int, void*), void *data)
+{
+	struct watch *w;
+	int op;
 
-	gettimeofday(&now, NULL);
+	w = watch_get(fd, &op);
+	w->write_cb = cb;
+	w->write_data = data;
 
-	tv_timeout.tv_sec = timeout_ms / 1000;
-	tv_timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	watch_update(w, op);
+}
 
-	t->cb = cb;
-	t->data = data;
-	timeradd(&now, &tv_timeout, &t->tv);
+/*
+ * Watches might be removed from within a callback, while events referring to
+ * them are pending, so they're only marked here and freed by watch_purge().
+ * The fd is unregistered right away, as it's likely to be closed next.
+ */
+void watch_del_readfd(int fd)
+{
+	struct watch *w;
 
-	list_add(&timer_watches, &t->node);
+	w = watch_find(fd);
+	if (!w)
+		return;
+
+	w->read_cb = NULL;
+	watch_update(w, EPOLL_CTL_MOD);
 }
 
-static struct timeval *watch_timer_next(void)
+void watch_del_writefd(int fd)
 {
-	static struct timeval timeout;
-	struct timeval now;
-	struct timer *next;
-	struct timer *t;
+	struct watch *w;
 
-	if (list_empty(&timer_watches))
-		return NULL;
+	w = watch_find(fd);
+	if (!w)
+		return;
 
-	next = list_entry_first(&timer_watches, struct timer, node);
+	w->write_cb = NULL;
+	watch_update(w, EPOLL_CTL_MOD);
+}
 
-	list_for_each_entry(t, &timer_watches, node) {
-		if (timercmp(&t->tv, &next->tv, <))
-			next = t;
+static void watch_purge(void)
+{
+	struct watch *tmp;
+	struct watch *w;
+
+	list_for_each_entry_safe(w, tmp, &watches, node) {
+		if (w->removed) {
+			list_del(&w->node);
+			free(w);
+		}
 	}
+}
 
-	gettimeofday(&now, NULL);
-	timersub(&next->tv, &now, &timeout);
-	if (timeout.tv_sec < 0) {
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 0;
+static void timespec_add_ms(struct timespec *ts, int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
 	}
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
 
-	return &timeout;
+	return a->tv_nsec < b->tv_nsec;
 }
 
-static void watch_timer_invoke(void)
+static void timer_heap_set(struct watch_timer *t, int index)
 {
-	struct timeval now;
-	struct timer *tmp;
-	struct timer *t;
+	timers[index] = t;
+	t->index = index;
+}
+
+static void timer_heap_up(int index)
+{
+	struct watch_timer *t = timers[index];
+	int parent;
+
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (!timespec_before(&t->ts, &timers[parent]->ts))
+			break;
+
+		timer_heap_set(timers[parent], index);
+		index = parent;
+	}
+
+	timer_heap_set(t, index);
+}
+
+static void timer_heap_down(int index)
+{
+	struct watch_timer *t = timers[index];
+	int child;
+
+	for (;;) {
+		child = 2 * index + 1;
+		if (child >= timer_count)
+			break;
+
+		if (child + 1 < timer_count &&
+		    timespec_before(&timers[child + 1]->ts, &timers[child]->ts))
+			child++;
+
+		if (!timespec_before(&timers[child]->ts, &t->ts))
+			break;
 
-	gettimeofday(&now, NULL);
+		timer_heap_set(timers[child], index);
+		index = child;
+	}
 
-	list_for_each_entry_safe(t, tmp, &timer_watches, node) {
-		if (timercmp(&t->tv, &now, <)) {
-			t->cb(t->data);
+	timer_heap_set(t, index);
+}
 
-			list_del(&t->node);
+static void timer_heap_push(struct watch_timer *t)
+{
+	if (timer_count == timer_capacity) {
+		timer_capacity = timer_capacity ? timer_capacity * 2 : 16;
+		timers = realloc(timers, timer_capacity * sizeof(*timers));
+		if (!timers)
+			err(1, "failed to allocate timer heap");
+	}
+
+	timer_heap_set(t, timer_count++);
+	timer_heap_up(t->index);
+}
+
+static void timer_heap_remove(struct watch_timer *t)
+{
+	int index = t->index;
+	struct watch_timer *last;
+
+	if (index < 0)
+		return;
+
+	t->index = -1;
+
+	last = timers[--timer_count];
+	if (last == t)
+		return;
+
+	timer_heap_set(last, index);
+	timer_heap_up(index);
+	timer_heap_down(last->index);
+}
+
+/* Arm the timerfd for the earliest timer, or disarm it if there are none */
+static void watch_timer_arm(void)
+{
+	struct itimerspec its = {};
+
+	if (timer_count) {
+		its.it_value = timers[0]->ts;
+
+		/* A zero it_value disarms the timer */
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		err(1, "failed to arm timer");
+}
+
+static int watch_timer_invoke(int fd, void *data)
+{
+	struct watch_timer *t;
+	struct timespec now;
+	uint64_t ticks;
+
+	read(timer_fd, &ticks, sizeof(ticks));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (timer_count && !timespec_before(&now, &timers[0]->ts)) {
+		t = timers[0];
+		timer_heap_remove(t);
+
+		/* Periodic timers keep their cadence, unless they fell behind */
+		if (t->interval_ms) {
+			timespec_add_ms(&t->ts, t->interval_ms);
+			if (timespec_before(&t->ts, &now)) {
+				t->ts = now;
+				timespec_add_ms(&t->ts, t->interval_ms);
+			}
+			timer_heap_push(t);
+		}
+
+		timer_firing = t;
+		t->cb(t->data);
+		timer_firing = NULL;
+
+		if (!t->interval_ms || t->cancelled) {
+			timer_heap_remove(t);
 			free(t);
 		}
 	}
+
+	watch_timer_arm();
+
+	return 0;
+}
+
+static struct watch_timer *watch_timer_schedule(int timeout_ms, int interval_ms,
+						void (*cb)(void *), void *data)
+{
+	struct watch_timer *t;
+
+	if (timer_fd < 0) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0)
+			err(1, "failed to create timerfd");
+
+		watch_add_readfd(timer_fd, watch_timer_invoke, NULL);
+	}
+
+	t = calloc(1, sizeof(*t));
+
+	clock_gettime(CLOCK_MONOTONIC, &t->ts);
+	timespec_add_ms(&t->ts, timeout_ms);
+
+	t->interval_ms = interval_ms;
+	t->cb = cb;
+	t->data = data;
+
+	timer_heap_push(t);
+
+	if (t->index == 0)
+		watch_timer_arm();
+
+	return t;
+}
+
+/**
+ * watch_timer_add() - invoke callback once, after a timeout
+ * @timeout_ms:	timeout, in milliseconds
+ * @cb:		callback, invoked with @data
+ * @data:	passed to @cb
+ *
+ * Return: handle of the timer, valid until @cb has been invoked, for
+ * cancelling it using watch_timer_cancel()
+ */
+struct watch_timer *watch_timer_add(int timeout_ms, void (*cb)(void *), void *data)
+{
+	return watch_timer_schedule(timeout_ms, 0, cb, data);
+}
+
+/**
+ * watch_timer_add_periodic() - invoke callback repeatedly
+ * @interval_ms: interval between invocations, in milliseconds
+ * @cb:		callback, invoked with @data
+ * @data:	passed to @cb
+ *
+ * Return: handle of the timer, valid until cancelled using
+ * watch_timer_cancel()
+ */
+struct watch_timer *watch_timer_add_periodic(int interval_ms, void (*cb)(void *), void *data)
+{
+	return watch_timer_schedule(interval_ms, interval_ms, cb, data);
+}
+
+/**
+ * watch_timer_cancel() - cancel a pending timer
+ * @t:		timer handle, may be NULL
+ *
+ * May be invoked from the timer's own callback.
+ */
+void watch_timer_cancel(struct watch_timer *t)
+{
+	if (!t)
+		return;
+
+	if (t == timer_firing) {
+		t->cancelled = true;
+		return;
+	}
+
+	timer_heap_remove(t);
+	free(t);
 }
 
 void watch_quit(void)
@@ -124,44 +447,81 @@ void watch_quit(void)
 	quit_invoked = true;
 }
 
+static int watch_invoke(int (*cb)(int, void*), int fd, void *data)
+{
+	int ret;
+
+	ret = cb(fd, data);
+	if (ret < 0)
+		fprintf(stderr, "cb returned %d\n", ret);
+
+	return ret;
+}
+
 int watch_main_loop(bool (*quit_cb)(void))
 {
-	struct timeval *timeoutp;
+	struct epoll_event events[WATCH_MAX_EVENTS];
 	struct watch *w;
-	fd_set rfds;
+	int timeout;
 	int nfds;
 	int ret;
+	int i;
 
 	while (!quit_invoked) {
 		if (quit_cb && quit_cb())
 			break;
 
-		nfds = 0;
+		watch_purge();
 
-		list_for_each_entry(w, &read_watches, node) {
-			nfds = MAX(nfds, w->fd);
-			FD_SET(w->fd, &rfds);
+		/* Don't block if any of the unpollable fds is being watched */
+		timeout = -1;
+		list_for_each_entry(w, &watches, node) {
+			if (w->always)
+				timeout = 0;
 		}
 
-		timeoutp = watch_timer_next();
-		ret = select(nfds + 1, &rfds, NULL, NULL, timeoutp);
-		if (ret < 0 && errno == EINTR)
+		nfds = epoll_wait(watch_epoll(), events, WATCH_MAX_EVENTS, timeout);
+		if (nfds < 0 && errno == EINTR)
 			continue;
-		else if (ret < 0) {
+		else if (nfds < 0) {
 			int err = errno;
-			fprintf(stderr, "select returned %s\n", strerror(err));
+			fprintf(stderr, "epoll_wait returned %s\n", strerror(err));
 			return -err;
 		}
 
-		watch_timer_invoke();
+		for (i = 0; i < nfds; i++) {
+			w = events[i].data.ptr;
+
+			/* Errors and hangups are reported to the callbacks */
+			if (!w->removed && w->read_cb &&
+			    events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				ret = watch_invoke(w->read_cb, w->fd, w->read_data);
+				if (ret < 0)
+					return ret;
+			}
+
+			if (!w->removed && w->write_cb &&
+			    events[i].events & (EPOLLOUT | EPOLLERR)) {
+				ret = watch_invoke(w->write_cb, w->fd, w->write_data);
+				if (ret < 0)
+					return ret;
+			}
+		}
+
+		list_for_each_entry(w, &watches, node) {
+			if (!w->always || w->removed)
+				continue;
 
-		list_for_each_entry(w, &read_watches, node) {
-			if (FD_ISSET(w->fd, &rfds)) {
-				ret = w->cb(w->fd, w->data);
-				if (ret < 0) {
-					fprintf(stderr, "cb returned %d\n", ret);
+			if (w->read_cb) {
+				ret = watch_invoke(w->read_cb, w->fd, w->read_data);
+				if (ret < 0)
+					return ret;
+			}
+
+			if (!w->removed && w->write_cb) {
+				ret = watch_invoke(w->write_cb, w->fd, w->write_data);
+				if (ret < 0)
 					return ret;
-				}
 			}
 		}
 	}
@@ -172,14 +532,9 @@ int watch_main_loop(bool (*quit_cb)(void))
 int watch_run(void)
 {
 	struct watch *w;
-	bool found = false;
-
-	list_for_each_entry(w, &read_watches, node) {
-		if (w->fd == STDIN_FILENO)
-			found = true;
-	}
 
-	if (!found) {
+	w = watch_find(STDIN_FILENO);
+	if (!w || !w->read_cb) {
 		fprintf(stderr, "rfds is trash!\n");
 		return -EINVAL;
 	}
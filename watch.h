@@ -2,8 +2,15 @@
 #define __WATCH_H__
 
 void watch_add_readfd(int fd, int (*cb)(int, void*), void *data);
+void watch_add_writefd(int fd, int (*cb)(int, void*), void *data);
+void watch_del_readfd(int fd);
+void watch_del_writefd(int fd);
 int watch_add_quit(int (*cb)(int, void*), void *data);
-void watch_timer_add(int timeout_ms, void (*cb)(void *), void *data);
+struct watch_timer;
+
+struct watch_timer *watch_timer_add(int timeout_ms, void (*cb)(void *), void *data);
+struct watch_timer *watch_timer_add_periodic(int interval_ms, void (*cb)(void *), void *data);
+void watch_timer_cancel(struct watch_timer *t);
 void watch_quit(void);
 int watch_main_loop(bool (*quit_cb)(void));
 int watch_run(void);